@@ -1,11 +1,20 @@
 //#include <RHReliableDatagram.h>
 //#include <RH_NRF24.h>
+#include <avr/sleep.h>
+
 #include "mini-radiohead.h"
 
 #include "SensorinoUtils.h"
 #include "Base.h"
 #include "MessageJsonConverter.h"
 #include "FragmentedDatagram.h"
+#include "RxQueueDatagram.h"
+#include "SlipFrame.h"
+#include "XmitQueue.h"
+#include "Uart.h"
+#include "ValueCache.h"
+#include "RateLimit.h"
+#include "BaseStats.h"
 
 /* TODO: make these configurable */
 #define CONFIG_CSN_PIN  10
@@ -18,21 +27,60 @@
 
 #define USE_NEWLINES
 
+#ifdef USE_NEWLINES
+# define NEWLINES 1
+#else
+# define NEWLINES 0
+#endif
+
 void watchdogConfig(uint8_t x) {
     WDTCSR = _BV(WDCE) | _BV(WDE);
     WDTCSR = x;
 }
 
+/*
+ * RAM budget on the ATmega328 (2048 bytes), static storage counted by
+ * hand from the AVR type sizes:
+ *
+ *   xmitQueue        284  3 radio frames, see XmitQueue.h
+ *   Message pool     272  2 Messages, the Json parser's and the SLIP
+ *                         decoder's, plus the discard one which its
+ *                         static constructor keeps linked in
+ *   deltaCache       189  see Delta.h
+ *   radioManager     155  mostly the Rx ring, see RxQueueDatagram.h
+ *   uart             146  mostly the Rx ring, see Uart.h
+ *   conv             113  mostly the Json token
+ *   valueCache        98
+ *   stats             93
+ *   tlvIndex          55  the find() index, see Message.cpp
+ *   rateLimit         52
+ *   core, the rest    21
+ *                   ----
+ *                   1478  plus ~100 of .data strings
+ *
+ * That leaves around 450 bytes of stack.  Base::loop() with a radio frame
+ * and a resync REQUEST on its stack, printFrame() and an interrupt on
+ * top need about 400, there's little to spare.  Check "avr-size -A" after
+ * growing any of these.
+ */
 static MessageJsonConverter conv;
+static DeltaCache deltaCache;
+static ValueCache valueCache;
+static RateLimit rateLimit;
+static BaseStats stats;
+static SlipDecoder slip;
+/* Set once the server talks to us in SLIP frames, see SlipFrame.h */
+static bool binaryMode;
 
 static RH_NRF24 radio(CONFIG_CE_PIN, CONFIG_CSN_PIN);
-static FragmentedDatagram<RHReliableDatagram, RH_NRF24_MAX_MESSAGE_LEN,
-        MAX_MESSAGE_SIZE> radioManager(radio, 0);
+typedef FragmentedDatagram<RxQueueDatagram<RHReliableDatagram>,
+        RH_NRF24_MAX_MESSAGE_LEN, MAX_RADIO_MESSAGE_SIZE> RadioManager;
+static RadioManager radioManager(radio, 0);
 
 void Base::setup() {
     watchdogConfig(0);
 
-    Serial.begin(115200);
+    uart.begin(115200);
 
     radioManager.init();
 
@@ -50,116 +98,287 @@ void Base::setup() {
     sei();
 }
 
-static bool checkJsonError(aJsonObject *obj) {
-    if (aJson.getObjectItem(obj, "type"))
-        return 0;
+static XmitQueue xmitQueue;
+/* The entry being sent, the radio is ours while it's set */
+static XmitEntry *xmitCurrent;
 
-    if (aJson.getObjectItem(obj, "error")) {
-        char *str = aJson.print(obj);
-        Serial.write(str);
-#ifdef USE_NEWLINES
-        Serial.write("\r\n");
-#endif
-        free(str);
-        return 1;
+static void xmitReport(uint8_t dst, bool ok) {
+    if (binaryMode)
+        SlipDecoder::writeXmitResult(uart, dst, ok);
+    else
+        MessageJsonConverter::printXmitResult(uart, dst, ok, NEWLINES);
+}
+
+/* Queue a Message for sending, @return NULL if there's no room */
+static XmitEntry *xmit(const uint8_t *raw, int len) {
+    XmitEntry *e = NULL;
+
+    /* Big payloads are only for the host side */
+    if (len <= MAX_RADIO_MESSAGE_SIZE)
+        e = xmitQueue.push(raw, len, millis());
+
+    if (e)
+        stats.xmitQueued++;
+    else
+        stats.xmitQueueFull++;
+    return e;
+}
+
+/* Same but reports a Message that can't be queued as failed */
+static void xmitOrFail(const uint8_t *raw, int len) {
+    if (!xmit(raw, len))
+        xmitReport(MessageView(raw, len).getDstAddress(), 0);
+}
+
+/*
+ * Move the radio queue along without ever waiting: collect the result of
+ * the send in progress, if any, drop what's past its deadline and start
+ * the next message.  Only a failed message whose time is up is reported
+ * as failed, the others are retried after a while.
+ */
+static void xmitPoll(void) {
+    uint16_t now = millis();
+    XmitEntry *e;
+
+    if (xmitCurrent) {
+        int8_t ret = radioManager.sendPoll();
+
+        if (ret == RH_TX_PENDING)
+            return;
+
+        if (ret == RH_TX_OK) {
+            if (!xmitCurrent->quiet)
+                xmitReport(xmitCurrent->dst, 1);
+            xmitQueue.remove(xmitCurrent);
+            stats.xmitOk++;
+        } else {
+            xmitQueue.backOff(xmitCurrent, now);
+            stats.xmitRetries++;
+        }
+        xmitCurrent = NULL;
     }
 
-    Serial.write("{\"error\":\"noType\"}");
-#ifdef USE_NEWLINES
-    Serial.write("\r\n");
-#endif
-    return 1;
+    while ((e = xmitQueue.expired(now))) {
+        if (!e->quiet)
+            xmitReport(e->dst, 0);
+        xmitQueue.remove(e);
+        stats.xmitFailed++;
+    }
+
+    xmitCurrent = xmitQueue.pick(now);
+    if (xmitCurrent)
+        radioManager.sendStart(xmitCurrent->raw, xmitCurrent->len,
+                xmitCurrent->dst);
 }
 
-void Base::loop() {
-    static aJsonStream aJsonSerial(&Serial);
-    static uint8_t garbageCnt = 0;
+/* Keep a chattering node from hogging the serial link, @return false if
+ * @msg is not to be passed on.
+ */
+static bool rateLimitAllow(MessageView &msg) {
+    Message::Type type = msg.getType();
 
-    /* Wait until something happens on UART or radio */
-    __asm__ volatile ("sleep");
+    if (type != Message::PUBLISH && type != Message::PUBLISH_BATCH)
+        return 1;
 
-    while (Serial.available()) {
-        conv.putch(Serial.read());
+    /* In binary mode the server follows the delta coding, a gap in the
+     * chain would only make it ask the node for a keyframe.
+     */
+    if (binaryMode && msg.find(Data::DELTA_REF, 0, NULL))
+        return 1;
 
-        /* We've received and parsed a new JSON message */
-        if (conv.obj) {
-            Message *msg = NULL;
-            bool jsonOk = !checkJsonError(conv.obj);
+    if (rateLimit.allow(msg.getSrcAddress(), millis()))
+        return 1;
 
-            if (jsonOk)
-                msg = MessageJsonConverter::jsonToMessage(*conv.obj);
-            aJson.deleteItem(conv.obj);
-            conv.obj = NULL;
+    stats.rateLimited++;
+    return 0;
+}
 
-            /* Succesfully converted to Message */
-            if (msg) {
-                if (!radioManager.sendtoWait((uint8_t *) msg->getRawData(),
-                        msg->getRawLength(), msg->getDstAddress())) {
-                    Serial.write("{\"error\":\"xmitError\"}");
-#ifdef USE_NEWLINES
-                    Serial.write("\r\n");
-#endif
-                }
-                delete msg;
-            } else if (jsonOk) {
-                Serial.write("{\"error\":\"structError\"}");
+static void rateLimitReport(void) {
+    uint8_t node;
+    uint16_t count;
+
+    while (rateLimit.report(millis(), &node, &count))
+        if (binaryMode)
+            SlipDecoder::writeRateLimited(uart, node, count);
+        else
+            MessageJsonConverter::printRateLimited(uart, node, count,
+                    NEWLINES);
+}
+
+/* Also collect the counters kept elsewhere */
+static void printStats(void) {
+    Uart::Stats uartStats;
+    RadioManager::RxStats rxStats;
+
+    uart.getStats(uartStats);
+    radioManager.getRxStats(rxStats);
+    stats.uartOverflows = uartStats.overflows;
+    stats.uartErrors = uartStats.errors;
+    stats.radioRingDrops = rxStats.drops;
+    stats.radioRingPeak = rxStats.peak;
+    stats.jsonSyntaxErrors = conv.syntaxErrors;
+    stats.jsonStructErrors = conv.structErrors;
+
+    stats.print(uart, NEWLINES);
+}
+
+void Base::loop() {
+    static uint8_t garbageCnt = 0;
+    uint32_t start, serialStart;
+    bool serialIn;
+
+    /* Wait until something happens on UART or radio, unless there's
+     * a send to keep an eye on or bytes came in since the last check.
+     * The instruction after sei() runs before any interrupt so a byte
+     * received after the check still wakes us up.
+     */
+    cli();
+    if (xmitQueue.empty() && !uart.available()) {
+        sei();
+        sleep_cpu();
+    } else
+        sei();
+
+    start = micros();
+    xmitPoll();
+
+    serialIn = uart.available();
+    serialStart = micros();
+    while (uart.available()) {
+        uint8_t chr = uart.read();
+
+        /* SLIP_END never appears in Json text, the frame is ours */
+        if (chr == SLIP_END || slip.inFrame()) {
+            int len = slip.putch(chr);
+
+            if (len == SLIP_MORE)
+                continue;
+
+            binaryMode = 1;
+            if (len < 0) {
+                SlipDecoder::writeControl(uart, len == SLIP_TOO_LONG ?
+                        SLIP_ERR_SIZE : SLIP_ERR_CRC);
+                stats.slipErrors++;
+            } else if (len == 0)
+                SlipDecoder::writeControl(uart, 0);
+            else if (len >= HEADERS_LENGTH) {
+                stats.slipIn++;
+                xmitOrFail(slip.getFrame(), len);
+                xmitPoll();
+            }
+            continue;
+        }
+
+        conv.putch(chr);
+
+        /* We've received and converted a new JSON message */
+        if (conv.msg) {
+            Message *msg = conv.msg;
+
+            conv.msg = NULL;
+            binaryMode = 0;
+            stats.jsonIn++;
+
+            /* Answer from the cache if the server allows */
+            if (!(msg->getType() == Message::REQUEST && conv.cachedOk &&
+                        valueCache.answer(uart, *msg, NEWLINES)))
+                xmitOrFail(msg->getRawData(), msg->getRawLength());
+            msg->release();
+            xmitPoll();
+        } else if (conv.error) {
+            binaryMode = 0;
+            uart.write("{\"error\":\"");
+            uart.write(conv.error);
+            uart.write("\"}");
 #ifdef USE_NEWLINES
-                Serial.write("\r\n");
+            uart.write("\r\n");
 #endif
-            }
+            conv.error = NULL;
+        } else if (conv.statsRequest) {
+            binaryMode = 0;
+            printStats();
+            conv.statsRequest = 0;
         }
     }
 
+    if (serialIn)
+        stats.serialUs.add(micros() - serialStart);
+
     while (radioManager.available()) {
-        Message msg;
-        uint8_t len;
-
-        /* New radio packet received */
-        if (radioManager.recvfromAck(msg.getWriteBuffer(), &len,
-                    NULL, NULL, NULL, NULL)) {
-            msg.writeLength(len);
-            aJsonObject *obj = MessageJsonConverter::messageToJson(msg);
-
-            /* Successfully converted to JSON */
-            if (obj) {
-                aJsonObject *type = aJson.getObjectItem(obj, "type");
-                bool garbage = !strcmp(type->valuestring, "unknown") ||
-                    !strcmp(type->valuestring, "garbage");
-
-                /* Poor man's printk_ratelimit */
-                if (garbage && garbageCnt < 3) {
-                    garbageCnt++;
-                    garbage = false;
-                } else if (!garbage)
-                    garbageCnt = 0;
-
-                if (!garbage) {
-                    /* FIXME this blocks */
-                    aJson.print(obj, &aJsonSerial);
-#ifdef USE_NEWLINES
-                    Serial.write("\r\n");
-#endif
-                }
+        uint8_t frame[MAX_RADIO_MESSAGE_SIZE], len;
+
+        /* New radio packet received, reassemble it on the stack and
+         * parse it in place from there.
+         */
+        if (!radioManager.recvfromAck(frame, &len))
+            continue;
+        stats.radioRx++;
+
+        MessageView msg(frame, len);
+        bool allow = rateLimitAllow(msg);
+
+        /* The server does the delta decoding and the rest in binary mode */
+        if (binaryMode) {
+            if (allow)
+                SlipDecoder::write(uart, frame, len);
+        } else if (!allow) {
+            /* The node got its ack so its next delta refers to this
+             * frame, follow it without printing.  No keyframe REQUEST
+             * to a node that's sending too much already.
+             */
+            MessageJsonConverter::trackFrame(msg, deltaCache, &valueCache);
+        } else {
+            Message::Type type = msg.getType();
+            bool garbage = type == Message::GARBAGE ||
+                type > Message::PUBLISH_BATCH;
+            int resyncSvc;
+            uint32_t printStart;
+
+            /* Poor man's printk_ratelimit */
+            if (garbage && garbageCnt < 3) {
+                garbageCnt++;
+                garbage = false;
+            } else if (!garbage)
+                garbageCnt = 0;
+
+            if (garbage) {
+                stats.radioGarbage++;
+                continue;
+            }
 
-                aJson.deleteItem(obj);
+            /* FIXME this blocks */
+            printStart = micros();
+            resyncSvc = MessageJsonConverter::printFrame(uart, msg,
+                    deltaCache, NEWLINES, &valueCache);
+            stats.toJsonUs.add(micros() - printStart);
+
+            /* Ask the service for its current values, this also makes
+             * it send a keyframe.  Only one service per frame for
+             * simplicity, any others will fail again on their next
+             * PUBLISH.  Can't do this before we're done with @frame.
+             */
+            if (resyncSvc >= 0) {
+                Message req(0, msg.getSrcAddress());
+                XmitEntry *e;
+
+                req.setType(Message::REQUEST);
+                req.addIntValue(Data::SERVICE_ID, resyncSvc);
+                e = xmit(req.getRawData(), req.getRawLength());
+                if (e)
+                    e->quiet = 1;
             }
         }
     }
-}
-
-#if 0
-ISR(USART_RX_vect) {
-    uint8_t status = UCSR0A;
-    uint8_t ch = UDR0;
 
-    if (unlikely(status & 0x14))
-        return;
-
-    conv.putch(ch);
+    rateLimitReport();
+    xmitPoll();
+    stats.cycleUs.add(micros() - start);
 }
-#endif
 
-EMPTY_INTERRUPT(PCINT0_vect);
+/* The nRF24 IRQ line, get the payloads out of the chip right away */
+ISR(PCINT0_vect) {
+    radioManager.pump();
+}
 ISR(PCINT1_vect, ISR_ALIASOF(PCINT0_vect));
 ISR(PCINT2_vect, ISR_ALIASOF(PCINT0_vect));
 
@@ -167,13 +386,13 @@ ISR(PCINT2_vect, ISR_ALIASOF(PCINT0_vect));
 
 void Sensorino::die(const prog_char *err) {
     cli();
-    Serial.begin(115200);
-    pgmWrite(Serial, PSTR("Panic"));
+    uart.begin(115200);
+    pgmWrite(uart, PSTR("Panic"));
     if (err) {
-        pgmWrite(Serial, PSTR(" because: "));
-        pgmWrite(Serial, err);
+        pgmWrite(uart, PSTR(" because: "));
+        pgmWrite(uart, err);
     }
-    pgmWrite(Serial, PSTR("\nStopping\n"));
+    pgmWrite(uart, PSTR("\nStopping\n"));
     /* TODO: also broadcast the same stuff over all radio channels, etc.? */
     while (1);
 }
@@ -0,0 +1,63 @@
+/*
+ * Runtime statistics of the Base, see BaseStats.h.
+ */
+#include "BaseStats.h"
+#include "Message.h"
+#include "SensorinoUtils.h"
+
+/* @key has the punctuation before the value */
+static void printNum(Print &out, const prog_char *key, long val) {
+    pgmWrite(out, key);
+    out.print(val);
+}
+
+void Histogram::print(Print &out) {
+    for (uint8_t i = 0; i < STATS_HIST_BUCKETS; i++) {
+        out.write(i ? ',' : '[');
+        out.print((long) counts[i]);
+    }
+    out.write(']');
+}
+
+void BaseStats::print(Print &out, bool newlines) {
+    const Message::PoolStats &pool = Message::getPoolStats();
+
+    printNum(out, PSTR("{\"type\":\"stats\",\"uptime\":"), millis() / 1000);
+
+    printNum(out, PSTR(",\"radio\":{\"rx\":"), radioRx);
+    printNum(out, PSTR(",\"garbage\":"), radioGarbage);
+    printNum(out, PSTR(",\"rateLimited\":"), rateLimited);
+    printNum(out, PSTR(",\"ringDrops\":"), radioRingDrops);
+    printNum(out, PSTR(",\"ringPeak\":"), radioRingPeak);
+
+    printNum(out, PSTR("},\"xmit\":{\"queued\":"), xmitQueued);
+    printNum(out, PSTR(",\"ok\":"), xmitOk);
+    printNum(out, PSTR(",\"failed\":"), xmitFailed);
+    printNum(out, PSTR(",\"retries\":"), xmitRetries);
+    printNum(out, PSTR(",\"queueFull\":"), xmitQueueFull);
+
+    printNum(out, PSTR("},\"serial\":{\"json\":"), jsonIn);
+    printNum(out, PSTR(",\"syntaxErrors\":"), jsonSyntaxErrors);
+    printNum(out, PSTR(",\"structErrors\":"), jsonStructErrors);
+    printNum(out, PSTR(",\"frames\":"), slipIn);
+    printNum(out, PSTR(",\"frameErrors\":"), slipErrors);
+    printNum(out, PSTR(",\"overflows\":"), uartOverflows);
+    printNum(out, PSTR(",\"errors\":"), uartErrors);
+
+    printNum(out, PSTR("},\"pool\":{\"inUse\":"), pool.inUse);
+    printNum(out, PSTR(",\"peak\":"), pool.peak);
+    printNum(out, PSTR(",\"exhausted\":"), pool.exhausted);
+
+    printNum(out, PSTR("},\"us\":{\"bucketMin\":"), STATS_HIST_MIN_US);
+    pgmWrite(out, PSTR(",\"cycle\":"));
+    cycleUs.print(out);
+    pgmWrite(out, PSTR(",\"toJson\":"));
+    toJsonUs.print(out);
+    pgmWrite(out, PSTR(",\"serial\":"));
+    serialUs.print(out);
+    pgmWrite(out, PSTR("}}"));
+    if (newlines)
+        pgmWrite(out, PSTR("\r\n"));
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,65 @@
+/*
+ * Runtime statistics of the Base, dumped as a Json object when the server
+ * sends {"type":"stats"}.  The counters are 16-bit and wrap around, the
+ * server is expected to look at the difference between two dumps.  How
+ * long things take is collected in histograms with power-of-two buckets
+ * of microseconds: the first bucket counts durations under
+ * STATS_HIST_MIN_US, each next one those under twice as much and the last
+ * one everything longer.
+ */
+#ifndef BASE_STATS_H
+#define BASE_STATS_H
+
+#include <Arduino.h>
+
+#define STATS_HIST_BUCKETS 10
+#define STATS_HIST_MIN_SHIFT 6
+#define STATS_HIST_MIN_US (1 << STATS_HIST_MIN_SHIFT)
+
+class Histogram {
+public:
+    void add(uint32_t us) {
+        uint8_t i = 0;
+
+        for (us >>= STATS_HIST_MIN_SHIFT; us && i < STATS_HIST_BUCKETS - 1;
+                us >>= 1)
+            i++;
+        counts[i]++;
+    }
+
+    /* As a Json array */
+    void print(Print &out);
+
+private:
+    uint16_t counts[STATS_HIST_BUCKETS];
+};
+
+/* Static storage, starts out zeroed */
+struct BaseStats {
+    /* Counted as things happen */
+    uint16_t radioRx;           /* Frames received */
+    uint16_t radioGarbage;      /* Of those not printed as garbage */
+    uint16_t rateLimited;       /* PUBLISHes dropped, see RateLimit.h */
+    uint16_t xmitQueued;
+    uint16_t xmitOk;
+    uint16_t xmitFailed;        /* Not acked by the deadline */
+    uint16_t xmitRetries;       /* Attempts not acked */
+    uint16_t xmitQueueFull;     /* Not queued at all */
+    uint16_t jsonIn;            /* Messages from the server in Json */
+    uint16_t slipIn;            /* And in SLIP frames */
+    uint16_t slipErrors;        /* SLIP frames dropped */
+    Histogram cycleUs;          /* Base::loop() from wake-up to sleep */
+    Histogram toJsonUs;         /* Printing a radio frame */
+    Histogram serialUs;         /* Handling the bytes from the server */
+
+    /* Copied from elsewhere before print() */
+    uint16_t jsonSyntaxErrors, jsonStructErrors;
+    uint16_t uartOverflows, uartErrors;
+    uint16_t radioRingDrops;
+    uint8_t radioRingPeak;
+
+    void print(Print &out, bool newlines);
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
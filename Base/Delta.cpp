@@ -0,0 +1 @@
+../Sensorino/Delta.cpp
\ No newline at end of file
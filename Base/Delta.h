@@ -0,0 +1 @@
+../Sensorino/Delta.h
\ No newline at end of file
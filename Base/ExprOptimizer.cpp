@@ -0,0 +1,265 @@
+/*
+ * Expression bytecode optimisation, see ExprOptimizer.h.
+ */
+#include <string.h>
+#include <math.h>
+
+#include "ExprOptimizer.h"
+#include "Expression.h"
+
+using namespace Expression;
+
+struct State {
+    const uint8_t *in, *inEnd;
+    uint8_t *out, *outEnd;
+};
+
+/* What's known about a subexpression once it's been written out */
+struct Node {
+    uint8_t *start, *end;
+    bool isConst;
+    float value;
+};
+
+static bool get(State &s, uint8_t &byte) {
+    if (s.in >= s.inEnd)
+        return 0;
+
+    byte = *s.in++;
+    return 1;
+}
+
+static bool put(State &s, uint8_t byte) {
+    if (s.out >= s.outEnd)
+        return 0;
+
+    *s.out++ = byte;
+    return 1;
+}
+
+/* Replace @n's bytecode with the smallest encoding of @val */
+static bool constant(State &s, Node &n, float val) {
+    union {
+        float f;
+        uint32_t bits;
+    } fl;
+
+    s.out = n.start;
+    n.isConst = 1;
+    n.value = val;
+
+    /* Integers, but not -0 whose sign a division would show */
+    if (val >= -32768.0f && val <= 32767.0f && val == (int16_t) val &&
+            !(val == 0.0f && signbit(val))) {
+        int16_t intVal = val;
+
+        if (intVal >= -128 && intVal <= 127)
+            return put(s, VAL_INT8) && put(s, intVal);
+
+        return put(s, VAL_INT16) && put(s, intVal >> 8) && put(s, intVal);
+    }
+
+    fl.f = val;
+    return put(s, VAL_FLOAT) && put(s, fl.bits >> 24) &&
+        put(s, fl.bits >> 16) && put(s, fl.bits >> 8) && put(s, fl.bits);
+}
+
+/* Replace @n's bytecode with that of its operand @sub, negated if @neg */
+static void replace(State &s, Node &n, Node &sub, bool neg) {
+    uint8_t *dst = n.start;
+
+    /* --x is x */
+    if (neg && *sub.start == OP_NEG) {
+        sub.start++;
+        neg = 0;
+    }
+
+    if (neg)
+        *dst++ = OP_NEG;
+    memmove(dst, sub.start, sub.end - sub.start);
+    s.out = dst + (sub.end - sub.start);
+}
+
+static bool isConst(Node &n, float val) {
+    return n.isConst && n.value == val;
+}
+
+static bool node(State &s, Node &n);
+
+static bool binary(State &s, Node &n, uint8_t op) {
+    Node a, b;
+
+    if (!node(s, a) || !node(s, b))
+        return 0;
+
+    if (a.isConst && b.isConst)
+        return constant(s, n, evalBinary(op, a.value, b.value));
+
+    switch (op) {
+    case OP_SUB:
+        /* x - -0 is x + 0 which isn't x for x = -0 */
+        if (isConst(b, 0.0f) && !signbit(b.value))
+            replace(s, n, a, 0);
+        break;
+
+    case OP_MULT:
+        if (isConst(a, 1.0f) || isConst(a, -1.0f))
+            replace(s, n, b, a.value < 0);
+        else if (isConst(b, 1.0f) || isConst(b, -1.0f))
+            replace(s, n, a, b.value < 0);
+        break;
+
+    case OP_DIV:
+        if (isConst(b, 1.0f) || isConst(b, -1.0f))
+            replace(s, n, a, b.value < 0);
+        break;
+    }
+
+    return 1;
+}
+
+static bool node(State &s, Node &n) {
+    uint8_t op, buf[4];
+    Node a, b, c;
+
+    n.start = s.out;
+    n.isConst = 0;
+
+    if (!get(s, op) || !put(s, op))
+        return 0;
+
+    switch (op) {
+    case VAL_INT8:
+        if (!get(s, buf[0]))
+            return 0;
+        if (!constant(s, n, (int8_t) buf[0]))
+            return 0;
+        break;
+
+    case VAL_INT16:
+        if (!get(s, buf[0]) || !get(s, buf[1]))
+            return 0;
+        if (!constant(s, n, (int16_t) (((uint16_t) buf[0] << 8) | buf[1])))
+            return 0;
+        break;
+
+    case VAL_FLOAT:
+        {
+            union {
+                float f;
+                uint32_t bits;
+            } fl;
+
+            fl.bits = 0;
+            for (uint8_t i = 0; i < 4; i++) {
+                if (!get(s, buf[i]))
+                    return 0;
+                fl.bits = (fl.bits << 8) | buf[i];
+            }
+            if (!constant(s, n, fl.f))
+                return 0;
+        }
+        break;
+
+    case VAL_VARIABLE:
+    case VAL_PREVIOUS:
+        /* Service ID, Data::Type and number */
+        for (uint8_t i = 0; i < 3; i++)
+            if (!get(s, buf[0]) || !put(s, buf[0]))
+                return 0;
+        break;
+
+    case OP_EQ:
+    case OP_NE:
+    case OP_LT:
+    case OP_GT:
+    case OP_LE:
+    case OP_GE:
+    case OP_OR:
+    case OP_AND:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MULT:
+    case OP_DIV:
+        if (!binary(s, n, op))
+            return 0;
+        break;
+
+    case OP_NOT:
+    case OP_NEG:
+        if (!node(s, a))
+            return 0;
+
+        if (!a.isConst) {
+            if (op == OP_NEG)
+                replace(s, n, a, 1);
+        } else if (!constant(s, n, op == OP_NEG ? -a.value :
+                    isnan(a.value) ? NAN : !IS_TRUE(a.value)))
+            return 0;
+        break;
+
+    case OP_IN:
+        {
+            uint8_t count;
+            bool allConst, found = 0;
+
+            if (!get(s, count) || !put(s, count) || !node(s, a))
+                return 0;
+
+            allConst = a.isConst;
+            for (uint8_t i = 0; i < count; i++) {
+                if (!node(s, b))
+                    return 0;
+
+                allConst &= b.isConst;
+                if (allConst && IS_ZERO(a.value - b.value))
+                    found = 1;
+            }
+
+            if (allConst && !constant(s, n, found))
+                return 0;
+        }
+        break;
+
+    case OP_IFELSE:
+        if (!node(s, a) || !node(s, b) || !node(s, c))
+            return 0;
+
+        if (a.isConst && b.isConst && c.isConst) {
+            if (!constant(s, n, IS_TRUE(a.value) ? b.value : c.value))
+                return 0;
+        } else if (a.isConst && IS_TRUE(a.value) && c.isConst)
+            replace(s, n, b, 0);
+        else if (a.isConst && !IS_TRUE(a.value) && b.isConst)
+            replace(s, n, c, 0);
+        break;
+
+    case OP_BETWEEN:
+        if (!node(s, a) || !node(s, b) || !node(s, c))
+            return 0;
+
+        if (a.isConst && b.isConst && c.isConst &&
+                !constant(s, n, evalBetween(a.value, b.value, c.value)))
+            return 0;
+        break;
+
+    default:
+        return 0;
+    }
+
+    n.end = s.out;
+    return 1;
+}
+
+uint8_t exprOptimize(const uint8_t *in, uint8_t inLen,
+        uint8_t *out, uint8_t outSize) {
+    State s = { in, in + inLen, out, out + outSize };
+    Node n;
+
+    if (!node(s, n) || s.in != s.inEnd)
+        return 0;
+
+    return s.out - out;
+}
+
+/* vim: set sw=4 ts=4 et: */
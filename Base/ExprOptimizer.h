@@ -0,0 +1,33 @@
+/*
+ * Optimisation pass over Expression bytecode (see Expression.h), run by
+ * the Base on the rule conditions it compiles from text so that nodes
+ * store and evaluate less on every PUBLISH:
+ *  - subexpressions with no variables are evaluated once and replaced
+ *    with their value, e.g. (2 * 3) becomes 6,
+ * *  - x - 0, x * 1, x / 1 and --x become x, x * -1 and x / -1 become -x,
+ *    only identities that hold exactly in floats, e.g. not x + 0 which
+ *    turns -0 into 0,
+ *  - an ?: with a constant condition becomes the branch taken if the
+ *    other one has no variables,
+ *  - every constant gets the smallest of VAL_INT8, VAL_INT16, VAL_FLOAT
+ *    that holds it exactly.
+ * Constants are evaluated with the same code as RuleService uses so the
+ * result of the expression never changes.  Variables are never dropped
+ * because RuleService only evaluates a rule when one of the variables it
+ * references is in the PUBLISH.  Float operations are not reassociated,
+ * (x + 1) + 2 is not x + 3 in floats.
+ */
+#ifndef EXPR_OPTIMIZER_H
+#define EXPR_OPTIMIZER_H
+
+#include <stdint.h>
+
+/* Write the optimised version of the @inLen bytes of bytecode at @in to
+ * @out, at most @outSize bytes.  @return the new length or 0 if @in is
+ * malformed or the result doesn't fit.
+ */
+uint8_t exprOptimize(const uint8_t *in, uint8_t inLen,
+        uint8_t *out, uint8_t outSize);
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,348 @@
+/*
+ * Shortest round-trip float formatting, see FloatFormat.h.  Follows
+ * f2s.c of the reference implementation, minus the 128-bit paths.
+ */
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "FloatFormat.h"
+
+#define MANTISSA_BITS 23
+#define EXPONENT_BITS 8
+#define BIAS 127
+
+#define POW5_INV_BITCOUNT 59
+#define POW5_BITCOUNT 61
+
+/* floor(2 ^ (pow5bits(i) - 1 + POW5_INV_BITCOUNT) / 5 ^ i) + 1 */
+static const uint64_t pow5InvSplit[31] PROGMEM = {
+    0x0800000000000001ULL, 0x0666666666666667ULL, 0x051eb851eb851eb9ULL,
+    0x04189374bc6a7efaULL, 0x068db8bac710cb2aULL, 0x053e2d6238da3c22ULL,
+    0x0431bde82d7b634eULL, 0x06b5fca6af2bd216ULL, 0x055e63b88c230e78ULL,
+    0x044b82fa09b5a52dULL, 0x06df37f675ef6eaeULL, 0x057f5ff85e592558ULL,
+    0x0465e6604b7a8447ULL, 0x0709709a125da071ULL, 0x05a126e1a84ae6c1ULL,
+    0x0480ebe7b9d58567ULL, 0x0734aca5f6226f0bULL, 0x05c3bd5191b525a3ULL,
+    0x049c97747490eae9ULL, 0x0760f253edb4ab0eULL, 0x05e72843249088d8ULL,
+    0x04b8ed0283a6d3e0ULL, 0x078e480405d7b966ULL, 0x060b6cd004ac9452ULL,
+    0x04d5f0a66a23a9dbULL, 0x07bcb43d769f762bULL, 0x063090312bb2c4efULL,
+    0x04f3a68dbc8f03f3ULL, 0x07ec3daf94180651ULL, 0x065697bfa9acd1daULL,
+    0x051212ffbaf0a7e2ULL,
+};
+
+/* 5 ^ i scaled to POW5_BITCOUNT bits */
+static const uint64_t pow5Split[47] PROGMEM = {
+    0x1000000000000000ULL, 0x1400000000000000ULL, 0x1900000000000000ULL,
+    0x1f40000000000000ULL, 0x1388000000000000ULL, 0x186a000000000000ULL,
+    0x1e84800000000000ULL, 0x1312d00000000000ULL, 0x17d7840000000000ULL,
+    0x1dcd650000000000ULL, 0x12a05f2000000000ULL, 0x174876e800000000ULL,
+    0x1d1a94a200000000ULL, 0x12309ce540000000ULL, 0x16bcc41e90000000ULL,
+    0x1c6bf52634000000ULL, 0x11c37937e0800000ULL, 0x16345785d8a00000ULL,
+    0x1bc16d674ec80000ULL, 0x1158e460913d0000ULL, 0x15af1d78b58c4000ULL,
+    0x1b1ae4d6e2ef5000ULL, 0x10f0cf064dd59200ULL, 0x152d02c7e14af680ULL,
+    0x1a784379d99db420ULL, 0x108b2a2c28029094ULL, 0x14adf4b7320334b9ULL,
+    0x19d971e4fe8401e7ULL, 0x1027e72f1f128130ULL, 0x1431e0fae6d7217cULL,
+    0x193e5939a08ce9dbULL, 0x1f8def8808b02452ULL, 0x13b8b5b5056e16b3ULL,
+    0x18a6e32246c99c60ULL, 0x1ed09bead87c0378ULL, 0x13426172c74d822bULL,
+    0x1812f9cf7920e2b6ULL, 0x1e17b84357691b64ULL, 0x12ced32a16a1b11eULL,
+    0x178287f49c4a1d66ULL, 0x1d6329f1c35ca4bfULL, 0x125dfa371a19e6f7ULL,
+    0x16f578c4e0a060b5ULL, 0x1cb2d6f618c878e3ULL, 0x11efc659cf7d4b8dULL,
+    0x166bb7f0435c9e71ULL, 0x1c06a5ec5433c60dULL,
+};
+
+static uint64_t readSplit(const uint64_t *entry) {
+    const uint32_t *half = (const uint32_t *) entry;
+
+    return ((uint64_t) pgm_read_dword(half + 1) << 32) |
+        pgm_read_dword(half);
+}
+
+/* Number of bits in 5 ^ @e, for 0 <= @e <= 3528 */
+static int32_t pow5bits(int32_t e) {
+    return ((uint32_t) e * 1217359 >> 19) + 1;
+}
+
+/* floor(log10(2 ^ @e)) and floor(log10(5 ^ @e)), for small positive @e */
+static uint32_t log10Pow2(int32_t e) {
+    return (uint32_t) e * 78913 >> 18;
+}
+
+static uint32_t log10Pow5(int32_t e) {
+    return (uint32_t) e * 732923 >> 20;
+}
+
+static bool multipleOfPowerOf5(uint32_t val, uint32_t p) {
+    uint32_t count = 0;
+
+    while (val % 5 == 0) {
+        val /= 5;
+        count++;
+    }
+
+    return count >= p;
+}
+
+static bool multipleOfPowerOf2(uint32_t val, uint32_t p) {
+    return !(val & ((1UL << p) - 1));
+}
+
+/* (@m * @factor) >> @shift, @shift > 32 */
+static uint32_t mulShift(uint32_t m, uint64_t factor, int32_t shift) {
+    uint64_t lo = (uint64_t) m * (uint32_t) factor;
+    uint64_t hi = (uint64_t) m * (uint32_t) (factor >> 32);
+
+    return ((lo >> 32) + hi) >> (shift - 32);
+}
+
+static uint32_t mulPow5InvDivPow2(uint32_t m, uint32_t q, int32_t j) {
+    return mulShift(m, readSplit(pow5InvSplit + q), j);
+}
+
+static uint32_t mulPow5DivPow2(uint32_t m, uint32_t i, int32_t j) {
+    return mulShift(m, readSplit(pow5Split + i), j);
+}
+
+FloatDecimal floatToDecimal(float val) {
+    union {
+        float f;
+        uint32_t bits;
+    } ieee;
+    FloatDecimal ret;
+
+    ieee.f = val;
+    ret.negative = ieee.bits >> 31;
+
+    uint32_t ieeeMantissa = ieee.bits & ((1UL << MANTISSA_BITS) - 1);
+    uint32_t ieeeExponent = (ieee.bits >> MANTISSA_BITS) &
+        ((1 << EXPONENT_BITS) - 1);
+
+    if (!ieeeMantissa && !ieeeExponent) {
+        ret.digits = 0;
+        ret.exp = 0;
+        return ret;
+    }
+
+    int32_t e2;
+    uint32_t m2;
+
+    if (ieeeExponent == 0) {
+        e2 = 1 - BIAS - MANTISSA_BITS - 2;
+        m2 = ieeeMantissa;
+    } else {
+        e2 = (int32_t) ieeeExponent - BIAS - MANTISSA_BITS - 2;
+        m2 = (1UL << MANTISSA_BITS) | ieeeMantissa;
+    }
+
+    /* The interval of values that read back as @val is [mm, mp] / 4,
+     * its ends included when the mantissa is even.
+     */
+    bool acceptBounds = !(m2 & 1);
+    uint32_t mv = 4 * m2;
+    uint32_t mp = 4 * m2 + 2;
+    uint32_t mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+    uint32_t mm = 4 * m2 - 1 - mmShift;
+
+    /* Convert the interval to decimal */
+    uint32_t vr, vp, vm;
+    int32_t e10;
+    bool vmIsTrailingZeros = 0, vrIsTrailingZeros = 0;
+    uint8_t lastRemovedDigit = 0;
+
+    if (e2 >= 0) {
+        uint32_t q = log10Pow2(e2);
+        int32_t k = POW5_INV_BITCOUNT + pow5bits(q) - 1;
+        int32_t i = -e2 + (int32_t) q + k;
+
+        e10 = q;
+        vr = mulPow5InvDivPow2(mv, q, i);
+        vp = mulPow5InvDivPow2(mp, q, i);
+        vm = mulPow5InvDivPow2(mm, q, i);
+
+        if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+            /* We need to know one removed digit even if we are not
+             * going to loop below.
+             */
+            int32_t l = POW5_INV_BITCOUNT + pow5bits(q - 1) - 1;
+
+            lastRemovedDigit = mulPow5InvDivPow2(mv, q - 1,
+                    -e2 + (int32_t) q - 1 + l) % 10;
+        }
+
+        if (q <= 9) {
+            /* Only one of mp, mv and mm can be a multiple of 5, if any */
+            if (mv % 5 == 0)
+                vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+            else if (acceptBounds)
+                vmIsTrailingZeros = multipleOfPowerOf5(mm, q);
+            else
+                vp -= multipleOfPowerOf5(mp, q);
+        }
+    } else {
+        uint32_t q = log10Pow5(-e2);
+        int32_t i = -e2 - (int32_t) q;
+        int32_t k = pow5bits(i) - POW5_BITCOUNT;
+        int32_t j = (int32_t) q - k;
+
+        e10 = (int32_t) q + e2;
+        vr = mulPow5DivPow2(mv, i, j);
+        vp = mulPow5DivPow2(mp, i, j);
+        vm = mulPow5DivPow2(mm, i, j);
+
+        if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+            j = (int32_t) q - 1 - (pow5bits(i + 1) - POW5_BITCOUNT);
+            lastRemovedDigit = mulPow5DivPow2(mv, i + 1, j) % 10;
+        }
+
+        if (q <= 1) {
+            /* mv has at least q trailing zero bits, so is mp, mm has
+             * them only if mmShift is 1.
+             */
+            vrIsTrailingZeros = 1;
+            if (acceptBounds)
+                vmIsTrailingZeros = mmShift == 1;
+            else
+                vp--;
+        } else if (q < 31)
+            vrIsTrailingZeros = multipleOfPowerOf2(mv, q - 1);
+    }
+
+    /* Find the shortest representation in the interval */
+    int32_t removed = 0;
+    uint32_t output;
+
+    if (vmIsTrailingZeros || vrIsTrailingZeros) {
+        /* General case, rarely taken */
+        while (vp / 10 > vm / 10) {
+            vmIsTrailingZeros &= vm % 10 == 0;
+            vrIsTrailingZeros &= lastRemovedDigit == 0;
+            lastRemovedDigit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+
+        if (vmIsTrailingZeros)
+            while (vm % 10 == 0) {
+                vrIsTrailingZeros &= lastRemovedDigit == 0;
+                lastRemovedDigit = vr % 10;
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+
+        /* Round even if the exact number is .....50..0 */
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0)
+            lastRemovedDigit = 4;
+
+        /* We need to take vr + 1 if vr is outside bounds or we need to
+         * round up.
+         */
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) ||
+                lastRemovedDigit >= 5);
+    } else {
+        /* Common case */
+        while (vp / 10 > vm / 10) {
+            lastRemovedDigit = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+
+        output = vr + (vr == vm || lastRemovedDigit >= 5);
+    }
+
+    ret.digits = output;
+    ret.exp = e10 + removed;
+    return ret;
+}
+
+uint8_t formatFloat(char *str, float val) {
+    union {
+        float f;
+        uint32_t bits;
+    } ieee;
+    char digits[10], *ptr = digits + sizeof(digits), *start = str;
+    FloatDecimal dec;
+    int8_t len, point;
+
+    ieee.f = val;
+    if ((ieee.bits & 0x7f800000UL) == 0x7f800000UL) {
+        strcpy_P(str, PSTR("null"));
+        return 4;
+    }
+
+    dec = floatToDecimal(val);
+    do {
+        *--ptr = '0' + dec.digits % 10;
+        dec.digits /= 10;
+    } while (dec.digits);
+    len = digits + sizeof(digits) - ptr;
+    /* Position of the decimal point relative to the first digit */
+    point = len + dec.exp;
+
+    if (dec.negative)
+        *str++ = '-';
+
+    if (point > 9 || point < -4) {
+        /* d.ddde-xx */
+        *str++ = *ptr++;
+        if (len > 1) {
+            *str++ = '.';
+            memcpy(str, ptr, len - 1);
+            str += len - 1;
+        }
+
+        point--;
+        *str++ = 'e';
+        if (point < 0) {
+            *str++ = '-';
+            point = -point;
+        }
+        if (point >= 10)
+            *str++ = '0' + point / 10;
+        *str++ = '0' + point % 10;
+    } else if (point <= 0) {
+        /* 0.000ddd */
+        *str++ = '0';
+        *str++ = '.';
+        memset(str, '0', -point);
+        str += -point;
+        memcpy(str, ptr, len);
+        str += len;
+    } else {
+        /* ddd.ddd or ddd000.0 */
+        if (len > point) {
+            memcpy(str, ptr, point);
+            str += point;
+            *str++ = '.';
+            memcpy(str, ptr + point, len - point);
+            str += len - point;
+        } else {
+            memcpy(str, ptr, len);
+            str += len;
+            memset(str, '0', point - len);
+            str += point - len;
+            *str++ = '.';
+            *str++ = '0';
+        }
+    }
+
+    *str = '\0';
+    return str - start;
+}
+
+float decimalToFloat(uint32_t digits, int16_t exp) {
+    double pow10 = 1.0, base = 10.0;
+    uint16_t k = exp < 0 ? -exp : exp;
+
+    /* 10 ^ |exp| by squaring, exact up to 10 ^ 22 in a 64-bit double */
+    for (; k; k >>= 1, base *= base)
+        if (k & 1)
+            pow10 *= base;
+
+    return exp < 0 ? digits / pow10 : digits * pow10;
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,44 @@
+/*
+ * Shortest round-trip formatting of floats, the digits are those of the
+ * shortest decimal number that reads back as the same float.  This is
+ * Ulf Adams' Ryu algorithm (https://github.com/ulfjack/ryu) for single
+ * precision which only needs integer arithmetic, fast on soft-float AVRs
+ * and exact everywhere.
+ */
+#ifndef FLOAT_FORMAT_H
+#define FLOAT_FORMAT_H
+
+#include <stdint.h>
+
+/* Longest text formatFloat() writes, plus the NUL */
+#define FLOAT_STR_SIZE 17
+
+/* @val equals @digits * 10 ^ @exp, negated if @negative is set */
+struct FloatDecimal {
+    uint32_t digits;
+    int8_t exp;
+    bool negative;
+};
+
+/* Break down a finite @val into the shortest decimal that reads back as
+ * @val.  Zero gives zero digits.
+ */
+FloatDecimal floatToDecimal(float val);
+
+/* Write @val to @str as Json and Expression strings want it, in plain
+ * notation with at least one decimal when between 1e-5 and 1e9,
+ * otherwise in scientific notation.  NaNs and infinities become "null",
+ * neither Json nor Expressions have them.  @str needs FLOAT_STR_SIZE
+ * bytes, @return the length without the NUL.
+ */
+uint8_t formatFloat(char *str, float val);
+
+/* The reverse of floatToDecimal(), @digits * 10 ^ @exp rounded to a
+ * float.  Gives back the original float for every floatToDecimal()
+ * output on hosts with a 64-bit double, on AVRs where double is a float
+ * the result can be a unit in the last place off.
+ */
+float decimalToFloat(uint32_t digits, int16_t exp);
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -3,321 +3,362 @@
 
 #include "MessageJsonConverter.h"
 #include "Expression.h"
+#include "FloatFormat.h"
+#include "ExprOptimizer.h"
+#include "ValueCache.h"
 
 using namespace Data;
 
 static char lower(char chr) {
     if (chr >= 'A' && chr <= 'Z')
         return chr - 'A' + 'a';
+    return chr;
 }
 
 static bool isEnumType(Type t) {
     return t == DATATYPE;
 }
 
-aJsonObject *MessageJsonConverter::messageToJson(Message &m) {
-    aJsonObject *obj = aJson.createObject();
+/*
+ * Streaming conversion.  JSON needs all values of a type under one name so
+ * a first pass over the group marks which types are present and which
+ * repeat in two small bitmaps, then the second pass prints each type at
+ * its first occurrence, collecting the repeats into an array right there.
+ * All types without a name of their own share the "unknown" bit.
+ */
+#define JSON_TYPE_BITS 64
+#define JSON_UNKNOWN_BIT (JSON_TYPE_BITS - 1)
+
+#define BIT_TEST(map, bit) ((map)[(bit) >> 3] & (1 << ((bit) & 7)))
+#define BIT_SET(map, bit) ((map)[(bit) >> 3] |= 1 << ((bit) & 7))
+#define BIT_CLEAR(map, bit) ((map)[(bit) >> 3] &= ~(1 << ((bit) & 7)))
+
+static void printP(Print &out, const prog_char *str) {
+    char chr;
+
+    while ((chr = pgm_read_byte(str++)))
+        out.write(chr);
+}
+
+static void printInt(Print &out, long val) {
+    char buf[12], *ptr = buf + sizeof(buf);
+    unsigned long uval = val < 0 ? -val : val;
 
-    headerToJson(obj, m);
-    payloadToJson(obj, m);
+    *--ptr = '\0';
+    do {
+        *--ptr = '0' + uval % 10;
+        uval /= 10;
+    } while (uval);
+    if (val < 0)
+        *--ptr = '-';
 
-    return obj;
+    out.write(ptr);
 }
 
-void MessageJsonConverter::headerToJson(aJsonObject *obj, Message &m) {
-    uint8_t from = m.getSrcAddress();
-    uint8_t to = m.getDstAddress();
-    Message::Type type = m.getType();
-    char *typestr = NULL;
+/* Shortest text that reads back as the same float, JSON has no NaN */
+static void printFloat(Print &out, float val) {
+    char buf[FLOAT_STR_SIZE];
 
-    switch (type) {
-    case Message::PUBLISH:
-        typestr = "publish";
-        break;
-    case Message::SET:
-        typestr = "set";
-        break;
-    case Message::REQUEST:
-        typestr = "request";
-        break;
-    case Message::ERR:
-        typestr = "err";
-        break;
-    case Message::GARBAGE:
-        typestr = "garbage";
-        break;
-    default:
-        typestr = "unknown";
-    }
+    out.write((const uint8_t *) buf, formatFloat(buf, val));
+}
 
-    if (typestr)
-        aJson.addStringToObject(obj, "type", typestr);
-    else
-        aJson.addNumberToObject(obj, "type", type);
-
-    aJson.addNumberToObject(obj, "from", from);
-    if (to != 0)
-        aJson.addNumberToObject(obj, "to", to);
-}
-
-void MessageJsonConverter::payloadToJson(aJsonObject *obj, Message &m) {
-    for (Message::iter i = m.begin(); i; m.iterAdvance(i)) {
-        Type t;
-        uint32_t val;
-        const prog_char *cname;
-        char name[50];
-        Message::CodingType coding = (Message::CodingType) -1;
-        aJsonObject *parent, *child;
-        const prog_char *enumId = NULL;
-
-        m.iterGetTypeValue(i, &t, &val);
-        if (t == (Type) -1)
-            continue; /* TODO: Add a note in the JSON output */
-
-        cname = Message::dataTypeToString(t, &coding) ?: PSTR("Unknown");
-        strncpy_P(name, cname, sizeof(name));
-        name[0] = lower(name[0]);
-
-        switch (coding) {
-        case Message::boolCoding:
-            child = aJson.createItem((char) *(bool *) &val);
-            break;
-        case Message::intCoding:
-            if (isEnumType(t))
-                switch (t) {
-                case DATATYPE:
-                    enumId = Message::dataTypeToString(
-                            (Type) *(int *) &val, NULL);
-                    break;
-                }
-
-            if (enumId) {
-                char buf[50];
-                strncpy_P(buf, enumId, sizeof(buf));
-                child = aJson.createItem(buf);
-            } else
-                child = aJson.createItem(*(int *) &val);
-            break;
-        case Message::floatCoding:
-            child = aJson.createItem((double) *(float *) &val);
-            break;
-        case Message::binaryCoding:
-            switch (t) {
-            case MESSAGE:
-                child = aJson.createObject();
-                {
-                    Message subMsg;
-                    memcpy(subMsg.getWriteBuffer() + HEADERS_LENGTH,
-                            ((Message::BinaryValue *) &val)->value,
-                            ((Message::BinaryValue *) &val)->len);
-                    subMsg.writeLength(HEADERS_LENGTH +
-                            ((Message::BinaryValue *) &val)->len);
-                    payloadToJson(child, subMsg);
-                }
-                break;
+/* The bit of the element at @i or -1 if it's not printed, @absNum counts
+ * the "fixed" coded elements for the @abs lookup.
+ */
+static int8_t elemBit(MessageView &m, MessageView::iter i,
+        const DeltaValues *abs, uint8_t &absNum, Type &t) {
+    m.iterGetTypeValue(i, &t, NULL);
+    if (t == (Type) -1)
+        return -1; /* TODO: Add a note in the JSON output */
 
-            case EXPRESSION:
-                {
-                    child = aJson.createNull();
-                    child->type = aJson_String;
-                    child->valuestring = exprToString(
-                            ((Message::BinaryValue *) &val)->value,
-                            ((Message::BinaryValue *) &val)->len);
-                }
-                break;
+    if (abs && t == DELTA_REF)
+        return -1;
 
-            default:
-                child = aJson.createItem("fixme");
-            }
-            break;
-        default:
-            child = aJson.createItem("fixme");
-            break;
-        }
+    if (abs && Message::getFixedScale(t) && absNum++ >= abs->count)
+        return -1;
 
-        /* See if there is an item of the same name already. */
-        parent = aJson.getObjectItem(obj, name); /* slow lookup :/ */
+    if ((unsigned int) t >= JSON_UNKNOWN_BIT ||
+            !Message::dataTypeToString(t, NULL))
+        return JSON_UNKNOWN_BIT;
 
-        /* If there is one and it's not an array, convert it into a
-         * one-element array so we can append the new item to it.  This
-         * is necessary because, even though JSON objects don't
-         * explicitly disallow pairs with identical names, an object
-         * is defined as being unordered meaning that the order of
-         * same-typed elements would be lost, unlike in a list.
-         */
-        if (parent) {
-            if (parent->type != aJson_Array) {
-                /* Low-level but less inefficient */
-                aJsonObject *copy = aJson.createNull();
-                copy->type = parent->type;
-                copy->child = parent->child;
-                copy->valuefloat = parent->valuefloat;
-                parent->type = aJson_Array;
-                parent->child = NULL;
-                aJson.addItemToArray(parent, copy);
-            }
-            aJson.addItemToArray(parent, child);
-        } else
-            aJson.addItemToObject(obj, name, child);
-    }
+    return t;
 }
 
-static int messageAddElem(Message &msg, const char *name, aJsonObject *obj) {
-    Type t = Message::stringToDataType(name);
-    if (t == (Type) __INT_MAX__)
-        return -1;
-
+static void printValue(Print &out, MessageView &m, MessageView::iter i,
+        const DeltaValues *abs, uint8_t absNum) {
+    Type t;
+    union {
+        bool b;
+        int i;
+        float f;
+        Message::BinaryValue bin;
+    } val;
     Message::CodingType coding = (Message::CodingType) -1;
-    if (!Message::dataTypeToString(t, &coding))
-        return -1;
+    const prog_char *enumId = NULL;
+
+    m.iterGetTypeValue(i, &t, &val);
+    Message::dataTypeToString(t, &coding);
 
     switch (coding) {
     case Message::boolCoding:
-        if (obj->type != aJson_True && obj->type != aJson_False)
-            return -1;
-
-        msg.addBoolValue(t, obj->type == aJson_True);
+        printP(out, val.b ? PSTR("true") : PSTR("false"));
         break;
-
     case Message::intCoding:
-        if (isEnumType(t)) {
-            Type valuetype;
-
+        if (isEnumType(t))
             switch (t) {
             case DATATYPE:
-                if (obj->type == aJson_String)
-                    valuetype = Message::stringToDataType(obj->valuestring);
-                else if (obj->type == aJson_Int)
-                    valuetype = (Type) obj->valueint;
-                else
-                    return -1;
-                if (valuetype == (Type) __INT_MAX__)
-                    return -1;
-
-                msg.addDataTypeValue(valuetype);
+                enumId = Message::dataTypeToString(
+                        (Type) val.i, NULL);
+                break;
+            default:
                 break;
             }
-        } else if (obj->type == aJson_Int)
-            msg.addIntValue(t, obj->valueint);
-        else
-            return -1;
 
+        if (enumId) {
+            out.write('"');
+            printP(out, enumId);
+            out.write('"');
+        } else
+            printInt(out, val.i);
         break;
-
+    case Message::fixedCoding:
+        if (abs)
+            val.f = (float) abs->units[absNum] /
+                Message::getFixedScale(t);
+        /* Fall through */
     case Message::floatCoding:
-        if (obj->type != aJson_Int && obj->type != aJson_Float)
-            return -1;
-
-        msg.addFloatValue(t, obj->type == aJson_Int ?
-                obj->valueint : obj->valuefloat);
+        printFloat(out, val.f);
         break;
-
     case Message::binaryCoding:
         switch (t) {
         case MESSAGE:
-            if (obj->type != aJson_Object)
-                return -1;
             {
-                Message subMsg(0, 0);
-                if (!MessageJsonConverter::jsonToPayload(subMsg, *obj))
-                    return -1;
-                msg.addBinaryValue(t,
-                        subMsg.getRawData() + HEADERS_LENGTH,
-                        subMsg.getRawLength() - HEADERS_LENGTH);
+                MessageView subMsg(m, val.bin);
+                MessageView::iter j = subMsg.begin();
+
+                out.write('{');
+                MessageJsonConverter::printPayload(out, subMsg, j,
+                        false, false);
+                out.write('}');
             }
             break;
 
         case EXPRESSION:
-            if (obj->type != aJson_String)
-                return -1;
-            {
-                uint8_t len;
-                uint8_t *expr = MessageJsonConverter::exprFromString(
-                        obj->valuestring, &len);
-                if (!expr)
-                    return -1;
-                msg.addBinaryValue(t, expr, len);
-                free(expr);
-            }
+            out.write('"');
+            MessageJsonConverter::printExpr(out, val.bin.value, val.bin.len,
+                    EXPR_STR_MAX);
+            out.write('"');
             break;
 
         default:
-            return -1;
+            printP(out, PSTR("\"fixme\""));
         }
         break;
-
     default:
-        return -1;
+        printP(out, PSTR("\"fixme\""));
+        break;
+    }
+}
+
+void MessageJsonConverter::printMessage(Print &out, MessageView &m,
+        MessageView::iter &group, const DeltaValues *abs) {
+    out.write('{');
+    printHeader(out, m);
+    printPayload(out, m, group, m.getType() == Message::PUBLISH_BATCH, true,
+            abs);
+    out.write('}');
+}
+
+/* Move @group to the next group of a PUBLISH_BATCH, or to 0 */
+static void skipGroup(MessageView &m, MessageView::iter &group, bool batch) {
+    Type t;
+
+    if (!batch) {
+        group = 0;
+        return;
     }
 
-    return 0;
+    for (m.iterAdvance(group); group; m.iterAdvance(group)) {
+        m.iterGetTypeValue(group, &t, NULL);
+        if (t == SERVICE_ID)
+            break;
+    }
 }
 
-Message *MessageJsonConverter::jsonToMessage(aJsonObject &obj) {
-    Message *msg;
-    aJsonObject *val;
-    uint8_t from, to;
+/* printFrame() and trackFrame(), the frame is printed if @out is set */
+static int handleFrame(Print *out, MessageView &m, DeltaCache &cache,
+        bool newlines, ValueCache *values) {
+    MessageView::iter group = m.begin();
+    bool batch = m.getType() == Message::PUBLISH_BATCH;
+    int resyncSvc = -1;
 
-    if (obj.type != aJson_Object)
-        return NULL;
+    /* A PUBLISH_BATCH is printed as one object per service */
+    do {
+        DeltaValues abs;
+        int delta = cache.resolve(m, group, batch, abs);
 
-    val = aJson.getObjectItem(&obj, "to");
-    if (!val || val->type != aJson_Int)
-        return NULL;
-    to = val->valueint;
+        /* Lost track of the delta coding, print what's left */
+        if (delta < 0) {
+            Type t;
+
+            m.iterGetTypeValue(group, &t, &resyncSvc);
+            abs.count = 0;
+        }
 
-    val = aJson.getObjectItem(&obj, "from");
-    if (val && val->type != aJson_Int)
-        return NULL;
-    from = val ? val->valueint : 0;
+        if (values && (batch || m.getType() == Message::PUBLISH))
+            values->update(m, group, batch, delta ? &abs : NULL);
+        if (!out) {
+            skipGroup(m, group, batch);
+            continue;
+        }
 
-    msg = new Message(from, to);
+        MessageJsonConverter::printMessage(*out, m, group,
+                delta ? &abs : NULL);
+        if (newlines)
+            printP(*out, PSTR("\r\n"));
+    } while (group);
 
-    val = aJson.getObjectItem(&obj, "type");
-    if (!val || val->type != aJson_String)
-        goto err;
+    return resyncSvc;
+}
 
-    if (!strcmp(val->valuestring, "publish"))
-        msg->setType(Message::PUBLISH);
-    else if (!strcmp(val->valuestring, "set"))
-        msg->setType(Message::SET);
-    else if (!strcmp(val->valuestring, "request"))
-        msg->setType(Message::REQUEST);
-    else if (!strcmp(val->valuestring, "err"))
-        msg->setType(Message::ERR);
-    else
-        goto err;
+int MessageJsonConverter::printFrame(Print &out, MessageView &m,
+        DeltaCache &cache, bool newlines, ValueCache *values) {
+    return handleFrame(&out, m, cache, newlines, values);
+}
 
-    if (!jsonToPayload(*msg, obj))
-        goto err;
+int MessageJsonConverter::trackFrame(MessageView &m, DeltaCache &cache,
+        ValueCache *values) {
+    return handleFrame(NULL, m, cache, false, values);
+}
 
-    return msg;
+void MessageJsonConverter::printXmitResult(Print &out, uint8_t to, bool ok,
+        bool newlines) {
+    printP(out, ok ? PSTR("{\"ack\":\"xmit\",\"to\":") :
+            PSTR("{\"error\":\"xmitError\",\"to\":"));
+    printInt(out, to);
+    printP(out, PSTR("}"));
+    if (newlines)
+        printP(out, PSTR("\r\n"));
+}
 
-err:
-    delete msg;
-    return NULL;
+void MessageJsonConverter::printRateLimited(Print &out, uint8_t from,
+        uint16_t count, bool newlines) {
+    printP(out, PSTR("{\"error\":\"rateLimited\",\"from\":"));
+    printInt(out, from);
+    printP(out, PSTR(",\"count\":"));
+    printInt(out, count);
+    printP(out, PSTR("}"));
+    if (newlines)
+        printP(out, PSTR("\r\n"));
 }
 
-bool MessageJsonConverter::jsonToPayload(Message &msg, aJsonObject &obj) {
-    aJsonObject *val;
+void MessageJsonConverter::printHeader(Print &out, MessageView &m) {
+    const prog_char *typestr;
+
+    switch (m.getType()) {
+    case Message::PUBLISH:
+    case Message::PUBLISH_BATCH:
+        typestr = PSTR("publish");
+        break;
+    case Message::SET:
+        typestr = PSTR("set");
+        break;
+    case Message::REQUEST:
+        typestr = PSTR("request");
+        break;
+    case Message::ERR:
+        typestr = PSTR("err");
+        break;
+    case Message::GARBAGE:
+        typestr = PSTR("garbage");
+        break;
+    default:
+        typestr = PSTR("unknown");
+    }
+
+    printP(out, PSTR("\"type\":\""));
+    printP(out, typestr);
+    printP(out, PSTR("\",\"from\":"));
+    printInt(out, m.getSrcAddress());
+    if (m.getDstAddress() != 0) {
+        printP(out, PSTR(",\"to\":"));
+        printInt(out, m.getDstAddress());
+    }
+}
 
-    for (val = obj.child; val; val = val->next) {
-        if (!strcasecmp(val->name, "to") || !strcasecmp(val->name, "from") ||
-                !strcasecmp(val->name, "type")) {
-            /* Skip */
+/* With @oneGroup set, stop before the next SERVICE_ID and leave @i there.
+ * With @abs set the "fixed" coded values are taken from there in order,
+ * any beyond abs->count are left out.  @comma says whether anything was
+ * printed before in the same object.
+ */
+void MessageJsonConverter::printPayload(Print &out, MessageView &m,
+        MessageView::iter &i, bool oneGroup, bool comma,
+        const DeltaValues *abs) {
+    uint8_t pending[JSON_TYPE_BITS / 8], repeated[JSON_TYPE_BITS / 8];
+    MessageView::iter start = i, j, k;
+    uint8_t absNum = 0, num, kNum;
+    int8_t bit;
+    Type t;
+
+    memset(pending, 0, sizeof(pending));
+    memset(repeated, 0, sizeof(repeated));
+
+    for (; i; m.iterAdvance(i)) {
+        bit = elemBit(m, i, abs, absNum, t);
+
+        if (oneGroup && t == SERVICE_ID && i != start)
+            break;
+
+        if (bit < 0)
             continue;
-        }
 
-        if (val->type == aJson_Array) {
-            for (aJsonObject *elem = val->child; elem; elem = elem->next)
-                if (messageAddElem(msg, val->name, elem))
-                    return 0;
-        } else
-            if (messageAddElem(msg, val->name, val))
-                return 0;
+        if (BIT_TEST(pending, bit))
+            BIT_SET(repeated, bit);
+        BIT_SET(pending, bit);
     }
 
-    return 1;
+    /* @i now points at the next group or is 0 */
+    for (j = start, absNum = 0; j != i; m.iterAdvance(j)) {
+        num = absNum;
+        bit = elemBit(m, j, abs, absNum, t);
+
+        if (bit < 0 || !BIT_TEST(pending, bit))
+            continue;
+        BIT_CLEAR(pending, bit);
+
+        if (comma)
+            out.write(',');
+        comma = true;
+
+        out.write('"');
+        if (bit == JSON_UNKNOWN_BIT)
+            printP(out, PSTR("unknown"));
+        else {
+            const prog_char *name = Message::dataTypeToString(t, NULL);
+
+            out.write(lower(pgm_read_byte(name)));
+            printP(out, name + 1);
+        }
+        printP(out, PSTR("\":"));
+
+        if (!BIT_TEST(repeated, bit)) {
+            printValue(out, m, j, abs, num);
+            continue;
+        }
+
+        out.write('[');
+        for (k = j, kNum = num; k != i; m.iterAdvance(k)) {
+            uint8_t valNum = kNum;
+
+            if (elemBit(m, k, abs, kNum, t) != bit)
+                continue;
+
+            if (k != j)
+                out.write(',');
+            printValue(out, m, k, abs, valNum);
+        }
+        out.write(']');
+    }
 }
 
 /* TODO: pgmspace */
@@ -327,10 +368,10 @@ struct {
 } opTable[] PROGMEM = {
     { Expression::OP_EQ, '=', '=' },
     { Expression::OP_NE, '!', '=' },
-    { Expression::OP_LT, "<" },
-    { Expression::OP_GT, ">" },
     { Expression::OP_LE, '<', '=' },
     { Expression::OP_GE, '>', '=' },
+    { Expression::OP_LT, "<" },
+    { Expression::OP_GT, ">" },
     { Expression::OP_OR, '|', '|' },
     { Expression::OP_AND, '&', '&' },
     { Expression::OP_ADD, "+" },
@@ -342,21 +383,14 @@ struct {
     { 0, 0 },
 };
 
-static void numDigit(char *&str, int16_t val) {
+static void numDigit(char *&str, uint16_t val) {
     if (!val)
         return;
     numDigit(str, val / 10);
     *str++ = '0' + (val % 10);
 }
 
-static float numDigit(char *&str, float val) {
-    if (val >= 10.0f)
-        val = numDigit(str, val / 10.0f) * 10.0f;
-    *str++ = '0' + (int) val;
-    return val - (int) val;
-}
-
-static void numToStr(char *&str, int16_t val) {
+static void numToStr(char *&str, int val) {
     if (val == 0)
         *str++ = '0';
     else {
@@ -364,92 +398,126 @@ static void numToStr(char *&str, int16_t val) {
             *str++ = '-';
             val = -val;
         }
-        numDigit(str, val);
+        numDigit(str, (uint16_t) val);
     }
 }
 
-static void numToStr(char *&str, float val) {
-    uint16_t frac;
+/*
+ * Expression decompiler.  The text is written straight to the output as
+ * the bytecode is walked, no buffer, and stops as soon as the bytecode
+ * turns out to be malformed or the text goes over @budget characters.
+ */
+struct ExprPrinter {
+    Print &out;
+    const uint8_t *buf, *end;
+    uint16_t budget;
+};
 
-    if (val < 0.0f) {
-        *str++ = '-';
-        val = -val;
-    }
-    frac = numDigit(str, val) * 10000.0f;
-    if (frac) {
-        *str++ = '.';
-    }
-    while (frac) {
-        uint8_t dig = frac / 1000;
-        frac = (frac % 1000) * 10;
-        *str++ = '0' + dig;
-    }
+static bool exprWrite(ExprPrinter &p, const char *str, uint8_t len) {
+    if (len > p.budget)
+        return 0;
+
+    p.budget -= len;
+    p.out.write((const uint8_t *) str, len);
+    return 1;
 }
 
-void subexprToString(char *&str, const uint8_t *&buf, uint8_t &len) {
-    int intVal;
-    float floatVal;
-    uint8_t varServId, varType, varNum, num;
-    const char *name;
+static bool exprWriteP(ExprPrinter &p, const prog_char *str) {
+    char chr;
 
-    if (!len) {
-        memcpy_P(str, PSTR("fixme"), 5);
-        str += 5;
-        return;
-    }
+    while ((chr = pgm_read_byte(str++)))
+        if (!exprWrite(p, &chr, 1))
+            return 0;
 
-    len--;
-    uint8_t op = *buf++;
+    return 1;
+}
 
-    using namespace Expression;
+static bool exprGet(ExprPrinter &p, uint8_t &byte) {
+    if (p.buf >= p.end)
+        return 0;
 
-    if (op >= OP_EQ)
-        *str++ = '(';
+    byte = *p.buf++;
+    return 1;
+}
+
+static bool subexprPrint(ExprPrinter &p, uint8_t depth) {
+    char str[FLOAT_STR_SIZE], *ptr = str;
+    uint8_t op, num, bytes[4];
+    const prog_char *name;
 
-#define SPACE *str++ = ' '
+    if (!depth-- || !exprGet(p, op))
+        return 0;
+
+    using namespace Expression;
+
+    if (op >= OP_EQ && !exprWrite(p, "(", 1))
+        return 0;
 
     switch (op) {
     case VAL_INT8:
-        intVal = (int8_t) *buf++;
-        len--;
-        numToStr(str, intVal);
+        if (!exprGet(p, bytes[0]))
+            return 0;
+        numToStr(ptr, (int8_t) bytes[0]);
+        if (!exprWrite(p, str, ptr - str))
+            return 0;
         break;
 
     case VAL_INT16:
-        intVal = ((uint16_t) buf[0] << 8) | buf[1];
-        buf += 2;
-        len -= 2;
-        numToStr(str, intVal);
+        if (!exprGet(p, bytes[0]) || !exprGet(p, bytes[1]))
+            return 0;
+        numToStr(ptr, (int16_t) (((uint16_t) bytes[0] << 8) | bytes[1]));
+        if (!exprWrite(p, str, ptr - str))
+            return 0;
         break;
 
     case VAL_FLOAT:
-        *(uint32_t *) &floatVal =
-            ((uint32_t) buf[0] << 24) |
-            ((uint32_t) buf[1] << 16) |
-            ((uint32_t) buf[2] <<  8) |
-            ((uint32_t) buf[3] <<  0);
-        buf += 4;
-        len -= 4;
-        numToStr(str, floatVal);
+        {
+            union {
+                float f;
+                uint32_t bits;
+            } fl;
+
+            fl.bits = 0;
+            for (num = 0; num < 4; num++) {
+                if (!exprGet(p, bytes[num]))
+                    return 0;
+                fl.bits = (fl.bits << 8) | bytes[num];
+            }
+            /* formatFloat() has no text for these, write an expression
+             * that folds back into the same constant.
+             */
+            if (isnan(fl.f))
+                name = PSTR("(0 / 0)");
+            else if (isinf(fl.f))
+                name = fl.f > 0 ? PSTR("(1 / 0)") : PSTR("(-1 / 0)");
+            else
+                name = NULL;
+
+            if (name ? !exprWriteP(p, name) :
+                    !exprWrite(p, str, formatFloat(str, fl.f)))
+                return 0;
+        }
         break;
 
     case VAL_VARIABLE:
     case VAL_PREVIOUS:
-        varServId = *buf++;
-        varType = (Type) *buf++;
-        varNum = *buf++;
-        len -= 3;
-
-        memcpy_P(str, op == VAL_VARIABLE ? PSTR("data:") : PSTR("prev:"), 5);
-        str += 5;
+        /* Service ID, Data::Type and number */
+        for (num = 0; num < 3; num++)
+            if (!exprGet(p, bytes[num]))
+                return 0;
 
-        numToStr(str, varServId);
-        *str++ = ':';
-        name = Message::dataTypeToString((Type) varType, NULL) ?: PSTR("fixme");
-        strcpy_P(str, name);
-        str += strlen_P(name);
-        *str++ = ':';
-        numToStr(str, varNum);
+        name = Message::dataTypeToString((Type) bytes[1], NULL) ?:
+            PSTR("fixme");
+        numToStr(ptr, bytes[0]);
+        *ptr++ = ':';
+        if (!exprWriteP(p, op == VAL_VARIABLE ? PSTR("data:") : PSTR("prev:")) ||
+                !exprWrite(p, str, ptr - str) || !exprWriteP(p, name))
+            return 0;
+        ptr = str;
+        *ptr++ = ':';
+        numToStr(ptr, bytes[2]);
+        if (!exprWrite(p, str, ptr - str))
+            return 0;
         break;
 
     case OP_EQ:
@@ -464,83 +532,82 @@ void subexprToString(char *&str, const uint8_t *&buf, uint8_t &len) {
     case OP_SUB:
     case OP_MULT:
     case OP_DIV:
-        subexprToString(str, buf, len);
         for (num = 0; pgm_read_byte(&opTable[num].val) != op; num++);
-        SPACE;
-        *str++ = pgm_read_byte(&opTable[num].str[0]);
+        *ptr++ = ' ';
+        *ptr++ = pgm_read_byte(&opTable[num].str[0]);
         if (pgm_read_byte(&opTable[num].str[1]))
-            *str++ = pgm_read_byte(&opTable[num].str[1]);
-        SPACE;
-        subexprToString(str, buf, len);
+            *ptr++ = pgm_read_byte(&opTable[num].str[1]);
+        *ptr++ = ' ';
+        if (!subexprPrint(p, depth) || !exprWrite(p, str, ptr - str) ||
+                !subexprPrint(p, depth))
+            return 0;
         break;
 
     case OP_NOT:
     case OP_NEG:
-        *str++ = (op == OP_NOT) ? '!' : '-';
-        subexprToString(str, buf, len);
+        if (!exprWrite(p, op == OP_NOT ? "!" : "-", 1) ||
+                !subexprPrint(p, depth))
+            return 0;
         break;
 
     case OP_IN:
-        num = *buf++;
-        len--;
-        subexprToString(str, buf, len);
-        memcpy_P(str, PSTR(" in "), 4);
-        str += 4;
-
-        while (--num) {
-            subexprToString(str, buf, len);
-            *str++ = ',';
-        }
-        subexprToString(str, buf, len);
+        if (!exprGet(p, num) || !subexprPrint(p, depth) ||
+                !exprWriteP(p, PSTR(" in ")))
+            return 0;
+
+        while (num--)
+            if (!subexprPrint(p, depth) || (num && !exprWrite(p, ",", 1)))
+                return 0;
         break;
 
     case OP_IFELSE:
-        subexprToString(str, buf, len);
-        SPACE;
-        *str++ = '?';
-        SPACE;
-        subexprToString(str, buf, len);
-        SPACE;
-        *str++ = ':';
-        SPACE;
-        subexprToString(str, buf, len);
+        if (!subexprPrint(p, depth) || !exprWriteP(p, PSTR(" ? ")) ||
+                !subexprPrint(p, depth) || !exprWriteP(p, PSTR(" : ")) ||
+                !subexprPrint(p, depth))
+            return 0;
         break;
 
     case OP_BETWEEN:
-        subexprToString(str, buf, len);
-        memcpy_P(str, PSTR(" between "), 9);
-        str += 9;
-        subexprToString(str, buf, len);
-        *str++ = ',';
-        subexprToString(str, buf, len);
+        if (!subexprPrint(p, depth) || !exprWriteP(p, PSTR(" between ")) ||
+                !subexprPrint(p, depth) || !exprWrite(p, ",", 1) ||
+                !subexprPrint(p, depth))
+            return 0;
+        break;
+
+    default:
+        return 0;
     }
 
-    if (op >= OP_EQ)
-        *str++ = ')';
+    if (op >= OP_EQ && !exprWrite(p, ")", 1))
+        return 0;
+
+    return 1;
 }
 
-char *MessageJsonConverter::exprToString(const uint8_t *buf, uint8_t len) {
-    char *str = (char *) malloc(128); /* FIXME */
-    char *ptr = str;
+bool MessageJsonConverter::printExpr(Print &out, const uint8_t *buf,
+        uint8_t len, uint16_t budget) {
+    ExprPrinter p = { out, buf, buf + len, budget };
 
-    subexprToString(ptr, buf, len);
-    *ptr = '\0';
+    if (subexprPrint(p, EXPR_MAX_DEPTH) && p.buf == p.end)
+        return 1;
 
-    return str;
+    printP(out, PSTR("..."));
+    return 0;
 }
 
 #define isDigit(x) ((x) >= '0' && (x) <= '9')
 
 static uint8_t uint8FromString(const char *&str) {
-    uint8_t val;
+    uint8_t val = 0;
     while (isDigit(*str))
         val = val * 10 + (*str++ - '0');
     return val;
 }
 
-static void valueFromString(uint8_t *&buf, const char *&str) {
-    if (!memcmp_P(str, PSTR("data:"), 5) || !memcmp_P(str, PSTR("prev:"), 5)) {
-        char name[30], len = 0;
+static bool valueFromString(uint8_t *&buf, const char *&str) {
+    if (!strncmp_P(str, PSTR("data:"), 5) || !strncmp_P(str, PSTR("prev:"), 5)) {
+        char name[30];
+        uint8_t len = 0;
 
         /* Opcode byte */
         *buf++ = (*str == 'd') ?
@@ -551,7 +618,7 @@ static void valueFromString(uint8_t *&buf, const char *&str) {
         *buf++ = uint8FromString(str);
 
         if (*str++ != ':')
-            return;
+            return 0;
 
         /* Data::Type byte */
         while (*str != ':' && *str != '\0' && len < sizeof(name) - 1)
@@ -559,60 +626,94 @@ static void valueFromString(uint8_t *&buf, const char *&str) {
         name[len] = '\0';
         *buf = (int) Message::stringToDataType(name);
         if (*buf++ == 0xff)
-            return;
+            return 0;
 
         if (*str++ != ':')
-            return;
+            return 0;
 
         /* Data position byte */
         *buf++ = uint8FromString(str);
-        return;
+        return 1;
     }
 
-    float val = 0;
-    bool negative = 0;
+    /* Collect up to 9 significant digits, enough for any float, as an
+     * integer and scale once at the end so that the shortest text that
+     * printExpr() writes reads back as the same value.
+     */
+    uint32_t mant = 0;
+    int16_t exp = 0;
+    bool negative = 0, isFloat = 0;
 
     if (*str == '-') {
         str++;
         negative = 1;
     }
-    while (isDigit(*str))
-        val = val * 10 + (*str++ - '0');
-    if (*str != '.') {
-        int16_t intVal = negative ? -val : val;
+    for (; isDigit(*str); str++)
+        if (mant < 100000000UL)
+            mant = mant * 10 + (*str - '0');
+        else
+            exp++;
+    if (*str == '.') {
+        isFloat = 1;
+        for (str++; isDigit(*str); str++)
+            if (mant < 100000000UL) {
+                mant = mant * 10 + (*str - '0');
+                exp--;
+            }
+    }
+    if (*str == 'e' || *str == 'E') {
+        int16_t e = 0;
+        bool expNegative = 0;
+
+        isFloat = 1;
+        str++;
+        if (*str == '-' || *str == '+')
+            expNegative = *str++ == '-';
+        for (; isDigit(*str); str++)
+            if (e < 100)
+                e = e * 10 + (*str - '0');
+        exp += expNegative ? -e : e;
+    }
+
+    /* See if number is within integer range */
+    if (!isFloat && !exp) {
+        int16_t intVal = negative ? -(int16_t) mant : mant;
 
-        /* See if number is within integer range */
-        if (val <= 127.5f + negative) {
+        if (mant <= 127U + negative) {
             *buf++ = Expression::VAL_INT8;
             *buf++ = intVal;
-            return;
+            return 1;
         }
-        if (val <= 32767.5f + negative) {
+        if (mant <= 32767U + negative) {
             *buf++ = Expression::VAL_INT16;
             *buf++ = intVal >> 8;
             *buf++ = intVal;
-            return;
+            return 1;
         }
         /* Nope, encode it as a float anyway */
-    } else {
-        float fracUnit = 0.1f;
-
-        str++;
-        while (isDigit(*str)) {
-            val += fracUnit * (*str++ - '0');
-            fracUnit *= 0.1f;
-        }
     }
+
+    float val = decimalToFloat(mant, exp);
+
     if (negative)
         val = -val;
+    uint32_t bits;
+    memcpy(&bits, &val, sizeof(bits));
     *buf++ = Expression::VAL_FLOAT;
-    *buf++ = (*(uint32_t *) &val) >> 24;
-    *buf++ = (*(uint32_t *) &val) >> 16;
-    *buf++ = (*(uint32_t *) &val) >>  8;
-    *buf++ = (*(uint32_t *) &val) >>  0;
+    *buf++ = bits >> 24;
+    *buf++ = bits >> 16;
+    *buf++ = bits >>  8;
+    *buf++ = bits >>  0;
+    return 1;
 }
 
-static bool subexprFromString(uint8_t *&buf, const char *&str) {
+/* Longest value valueFromString() writes plus an operator inserted before
+ * it, the room subexprFromString() wants left in the buffer before each
+ * operand.
+ */
+#define EXPR_OPERAND_MAX 7
+
+static bool subexprFromString(uint8_t *&buf, uint8_t *end, const char *&str) {
     uint8_t *in_counter = NULL;
     bool ifelse = 0, between = 0;
 
@@ -621,17 +722,20 @@ static bool subexprFromString(uint8_t *&buf, const char *&str) {
 
         using namespace Expression;
 
+        if (end - buf < EXPR_OPERAND_MAX)
+            return 0;
+
         if (*str == '(') {
             str++;
-            if (!subexprFromString(buf, str) || *str != ')')
+            if (!subexprFromString(buf, end, str) || *str != ')')
                 return 0;
             str++;
         } else if (*str == '!' || (*str == '-' && !isDigit(str[1]))) {
             *buf ++ = (*str++ == '!') ? OP_NOT : OP_NEG;
-            if (!subexprFromString(buf, str))
+            if (!subexprFromString(buf, end, str))
                 return 0;
-        } else
-            valueFromString(buf, str);
+        } else if (!valueFromString(buf, str))
+            return 0;
 
         while (*str == ' ')
             str++;
@@ -652,22 +756,24 @@ static bool subexprFromString(uint8_t *&buf, const char *&str) {
                 str++;
             if (op == OP_IN)
                 space = 2;
-        } else if (!memcmp_P(str, PSTR("between"), 7)) {
+        } else if (!strncmp_P(str, PSTR("between"), 7)) {
             op = OP_BETWEEN;
             str += 7;
             between = 1;
         } else if (str[0] == ',') {
             if (in_counter)
-                *in_counter++;
+                (*in_counter)++;
             else if (between)
                 between = 0;
             else
                 break;
+            str++;
         } else if (str[0] == ':') {
             if (ifelse)
                 ifelse = 0;
             else
                 break;
+            str++;
         } else
             return 0;
 
@@ -678,6 +784,8 @@ static bool subexprFromString(uint8_t *&buf, const char *&str) {
             continue;
         if (op == OP_IN)
             space = 2;
+        if (end - buf < space)
+            return 0;
 
         for (uint8_t *ptr = buf - 1; ptr >= start; ptr--)
             ptr[space] = ptr[0];
@@ -697,65 +805,522 @@ static bool subexprFromString(uint8_t *&buf, const char *&str) {
     return 1;
 }
 
-uint8_t *MessageJsonConverter::exprFromString(const char *str, uint8_t *len) {
-    uint8_t *buf = (uint8_t *) malloc(128); /* FIXME */
-    uint8_t *ptr = buf;
+uint8_t MessageJsonConverter::exprCompile(const char *str, uint8_t *out,
+        uint8_t size) {
+    uint8_t code[EXPR_MAX_LEN];
+    uint8_t *ptr = code;
 
-    if (!subexprFromString(ptr, str) || *str != '\0') {
-        free(buf);
-        return NULL;
-    }
+    if (!subexprFromString(ptr, code + sizeof(code), str) || *str != '\0')
+        return 0;
 
-    *len = ptr - buf;
-    return buf;
+    return exprOptimize(code, ptr - code, out, size);
 }
 
+/*
+ * Incremental Json -> Message parser.  Each byte moves a small state
+ * machine along and values are added to the Message as soon as they're
+ * complete, so the text is never stored and no tree is built.  Only
+ * string tokens, i.e. keys, type names and expressions, are collected in
+ * @tok, and numbers are accumulated as they come.  @stack has an entry
+ * per open object or array with the key of the values inside.  After an
+ * error the rest of the object is still parsed, or just skipped after a
+ * syntax error, so that the next object is found correctly.
+ */
+enum {
+    JSON_IDLE,          /* Waiting for the top-level '{' */
+    JSON_KEY_OR_END,    /* After a '{' */
+    JSON_KEY,           /* After a ',' in an object */
+    JSON_KEY_STRING,
+    JSON_COLON,
+    JSON_VALUE_OR_END,  /* After a '[' */
+    JSON_VALUE,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_LITERAL,       /* true, false or null */
+    JSON_AFTER_VALUE,
+    JSON_SKIP,          /* Syntax error, wait for the end of the object */
+};
+
+/* Level::key values other than Data::Types */
+#define KEY_TYPE    -1
+#define KEY_TO      -2
+#define KEY_FROM    -3
+#define KEY_INVALID -4
+#define KEY_CACHED  -5
+
+/* numFlags */
+#define NUM_NEG         (1 << 0)
+#define NUM_DIGITS      (1 << 1)
+#define NUM_FRAC        (1 << 2)
+#define NUM_EXP         (1 << 3)
+#define NUM_EXP_NEG     (1 << 4)
+#define NUM_EXP_START   (1 << 5)
+
+static const char syntaxErrorStr[] = "syntaxError";
+static const char noTypeStr[] = "noType";
+static const char structErrorStr[] = "structError";
+static const char tooLongStr[] = "tooLong";
+
 MessageJsonConverter::MessageJsonConverter() {
-    obj_str_len = 0;
-    nest_depth = 0;
+    msg = NULL;
+    error = NULL;
+    statsRequest = 0;
+    syntaxErrors = 0;
+    structErrors = 0;
+    out = NULL;
+    reset();
+}
+
+void MessageJsonConverter::reset(void) {
+    if (out)
+        out->release();
+    out = NULL;
+
+    state = JSON_IDLE;
+    depth = 0;
+    escape = 0;
     quote = 0;
+}
+
+void MessageJsonConverter::startObject(void) {
+    out = Message::alloc(0, 0);
+    hasType = 0;
+    hasTo = 0;
+    isStats = 0;
+    cachedOk = 0;
+    status = out ? NULL : structErrorStr;
+
+    push(false);
+}
+
+bool MessageJsonConverter::push(bool array) {
+    if (depth >= JSON_MAX_DEPTH)
+        return 0;
+
+    stack[depth].key = depth ? stack[depth - 1].key : KEY_INVALID;
+    stack[depth].array = array;
+    depth++;
+    state = array ? JSON_VALUE_OR_END : JSON_KEY_OR_END;
+    return 1;
+}
+
+void MessageJsonConverter::pop(void) {
+    Level *level = &stack[--depth];
+
+    state = JSON_AFTER_VALUE;
+
+    if (depth) {
+        /* End of a nested MESSAGE, room for a long form length needed */
+        if (!level->array && !status) {
+            if (out->getRawLength() - level->start < 0x80 || room(2))
+                out->endBinaryValue(level->start);
+        }
+        return;
+    }
+
+    /* End of the top-level object, report the result.  Once there's an
+     * error the rest isn't looked at, "type" may have come after it.
+     */
+    if (!status && !hasType)
+        status = noTypeStr;
+    else if (!status && !hasTo && !isStats)
+        status = structErrorStr;
+
+    if (status == syntaxErrorStr)
+        syntaxErrors++;
+    else if (status)
+        structErrors++;
+
+    if (!status && !isStats)
+        msg = out;
+    else if (out)
+        out->release();
+    out = NULL;
+    error = status;
+    if (!status && isStats)
+        statsRequest = 1;
+
+    state = JSON_IDLE;
+}
+
+/* Count the nesting depth until the top-level object ends */
+void MessageJsonConverter::skip(uint8_t chr) {
+    state = JSON_SKIP;
+
+    if (escape)
+        escape = 0;
+    else if (quote) {
+        if (chr == '\\')
+            escape = 1;
+        else if (chr == '"')
+            quote = 0;
+    } else if (chr == '"')
+        quote = 1;
+    else if (chr == '{' || chr == '[')
+        depth++;
+    else if ((chr == '}' || chr == ']') && depth == 1)
+        pop();
+    else if (chr == '}' || chr == ']')
+        depth--;
+}
+
+void MessageJsonConverter::syntaxError(uint8_t chr) {
+    status = syntaxErrorStr;
     escape = 0;
+    quote = 0;
+    skip(chr);
+}
+
+/* Keep the first error, stop adding values */
+void MessageJsonConverter::fail(const char *err) {
+    if (!status)
+        status = err;
+}
+
+bool MessageJsonConverter::room(uint8_t len) {
+    if (out->getRawLength() + len <= MAX_MESSAGE_SIZE)
+        return 1;
+
+    fail(structErrorStr);
+    return 0;
+}
+
+void MessageJsonConverter::keyDone(void) {
+    Level *level = &stack[depth - 1];
+    Type t;
+
+    if (depth == 1 && !strcasecmp_P(tok, PSTR("type")))
+        level->key = KEY_TYPE;
+    else if (depth == 1 && !strcasecmp_P(tok, PSTR("to")))
+        level->key = KEY_TO;
+    else if (depth == 1 && !strcasecmp_P(tok, PSTR("from")))
+        level->key = KEY_FROM;
+    else if (depth == 1 && !strcasecmp_P(tok, PSTR("cachedOk")))
+        level->key = KEY_CACHED;
+    else if ((t = Message::stringToDataType(tok)) != (Type) __INT_MAX__)
+        level->key = t;
+    else {
+        level->key = KEY_INVALID;
+        fail(structErrorStr);
+    }
+}
+
+void MessageJsonConverter::stringDone(void) {
+    int key = stack[depth - 1].key;
+
+    if (status)
+        return;
+
+    if (key == KEY_TYPE && depth == 1) {
+        hasType = 1;
+
+        if (!strcmp_P(tok, PSTR("publish")))
+            out->setType(Message::PUBLISH);
+        else if (!strcmp_P(tok, PSTR("set")))
+            out->setType(Message::SET);
+        else if (!strcmp_P(tok, PSTR("request")))
+            out->setType(Message::REQUEST);
+        else if (!strcmp_P(tok, PSTR("err")))
+            out->setType(Message::ERR);
+        else if (!strcmp_P(tok, PSTR("stats")))
+            isStats = 1;
+        else
+            fail(structErrorStr);
+    } else if (key == DATATYPE) {
+        Type valuetype = Message::stringToDataType(tok);
+
+        if (valuetype == (Type) __INT_MAX__)
+            fail(structErrorStr);
+        else if (room(7))
+            out->addDataTypeValue(valuetype);
+    } else if (key == EXPRESSION) {
+        msglen_t start;
+        int size;
+        uint8_t len;
+
+        if (!room(5))
+            return;
+
+        /* Compile straight into the Message, leave a byte for a long
+         * form length.
+         */
+        start = out->beginBinaryValue(EXPRESSION);
+        size = MAX_MESSAGE_SIZE - out->getRawLength() - 1;
+        len = exprCompile(tok, out->getWriteBuffer(),
+                size < EXPR_MAX_LEN ? size : EXPR_MAX_LEN);
+        if (!len) {
+            fail(structErrorStr);
+            return;
+        }
+
+        out->writeLength(len);
+        out->endBinaryValue(start);
+    } else
+        fail(structErrorStr);
+}
+
+void MessageJsonConverter::numberDone(void) {
+    int key = stack[depth - 1].key;
+    Message::CodingType coding = (Message::CodingType) -1;
+    int16_t e = (numFlags & NUM_EXP_NEG ? -exp : exp) + scale;
+    bool isInt = !(numFlags & (NUM_FRAC | NUM_EXP)) && !scale &&
+        mant <= __INT_MAX__;
+    int intVal = numFlags & NUM_NEG ? -mant : mant;
+    float floatVal;
+
+    if (status)
+        return;
+
+    if (key == KEY_TO || key == KEY_FROM) {
+        if (!isInt || depth != 1)
+            fail(structErrorStr);
+        else if (key == KEY_TO) {
+            out->setDstAddress(intVal);
+            hasTo = 1;
+        } else
+            out->setSrcAddress(intVal);
+        return;
+    }
+
+    if (key < 0 || !Message::dataTypeToString((Type) key, &coding)) {
+        fail(structErrorStr);
+        return;
+    }
+
+    switch (coding) {
+    case Message::intCoding:
+        if (!isInt)
+            fail(structErrorStr);
+        else if (room(7))
+            out->addIntValue((Type) key, intVal);
+        break;
+
+    case Message::floatCoding:
+    case Message::fixedCoding:
+        floatVal = decimalToFloat(mant, e);
+
+        if (room(7))
+            out->addFloatValue((Type) key,
+                    numFlags & NUM_NEG ? -floatVal : floatVal);
+        break;
+
+    default:
+        fail(structErrorStr);
+    }
+}
+
+void MessageJsonConverter::literalDone(void) {
+    int key = stack[depth - 1].key;
+    Message::CodingType coding = (Message::CodingType) -1;
+
+    if (status)
+        return;
+
+    /* @tok[0] has the first letter */
+    if (key == KEY_CACHED && tok[0] != 'n')
+        cachedOk = tok[0] == 't';
+    else if (key < 0 || !Message::dataTypeToString((Type) key, &coding) ||
+            coding != Message::boolCoding || tok[0] == 'n')
+        fail(structErrorStr);
+    else if (room(7))
+        out->addBoolValue((Type) key, tok[0] == 't');
 }
 
 void MessageJsonConverter::putch(uint8_t chr) {
-    if (chr <= ' ') {
-        /* Reset parser state on a null-byte. TODO: also do this on a BREAK */
-        if (chr == '\0') {
-            obj_str_len = 0;
-            nest_depth = 0;
-            quote = 0;
-            escape = 0;
+    /* Reset parser state on a null-byte. TODO: also do this on a BREAK */
+    if (chr == '\0') {
+        reset();
+        return;
+    }
+
+    switch (state) {
+    case JSON_SKIP:
+        skip(chr);
+        return;
+
+    case JSON_KEY_STRING:
+    case JSON_STRING:
+        /* TODO: multibyte chars, escapes other than \" and \\ */
+        if (!escape && chr == '\\') {
+            escape = 1;
+            return;
+        }
+
+        if (!escape && chr == '"') {
+            if (tokLen >= sizeof(tok)) {
+                /* Too long, ignore the value */
+                fail(tooLongStr);
+                if (state == JSON_KEY_STRING)
+                    stack[depth - 1].key = KEY_INVALID;
+            } else {
+                tok[tokLen] = '\0';
+                if (state == JSON_KEY_STRING)
+                    keyDone();
+                else
+                    stringDone();
+            }
+
+            state = state == JSON_KEY_STRING ? JSON_COLON : JSON_AFTER_VALUE;
+            return;
+        }
+
+        escape = 0;
+        if (tokLen < sizeof(tok) - 1)
+            tok[tokLen++] = chr;
+        else
+            tokLen = sizeof(tok);
+        return;
+
+    case JSON_LITERAL:
+        if (chr != pgm_read_byte(literal)) {
+            syntaxError(chr);
+            return;
+        }
+
+        if (!pgm_read_byte(++literal)) {
+            literalDone();
+            state = JSON_AFTER_VALUE;
         }
-        if (!quote)
+        return;
+
+    case JSON_NUMBER:
+        if (chr >= '0' && chr <= '9') {
+            if (numFlags & NUM_EXP) {
+                if (exp < 100)
+                    exp = exp * 10 + chr - '0';
+            } else if (mant < 100000000L) {
+                mant = mant * 10 + chr - '0';
+                if (numFlags & NUM_FRAC)
+                    scale--;
+            } else if (!(numFlags & NUM_FRAC))
+                scale++;
+
+            numFlags |= NUM_DIGITS;
+            numFlags &= ~NUM_EXP_START;
+            return;
+        }
+
+        if (chr == '.' && !(numFlags & (NUM_FRAC | NUM_EXP))) {
+            numFlags |= NUM_FRAC;
+            return;
+        }
+
+        if ((chr == 'e' || chr == 'E') && (numFlags & NUM_DIGITS) &&
+                !(numFlags & NUM_EXP)) {
+            numFlags |= NUM_EXP | NUM_EXP_START;
+            return;
+        }
+
+        if ((chr == '-' || chr == '+') && (numFlags & NUM_EXP_START)) {
+            if (chr == '-')
+                numFlags |= NUM_EXP_NEG;
+            numFlags &= ~NUM_EXP_START;
             return;
+        }
+
+        /* Anything else ends the number and is then parsed on its own */
+        if (!(numFlags & NUM_DIGITS) || (numFlags & NUM_EXP_START)) {
+            syntaxError(chr);
+            return;
+        }
+
+        numberDone();
+        state = JSON_AFTER_VALUE;
+        break;
     }
 
-    if (obj_str_len < sizeof(obj_str) - 1)
-        obj_str[obj_str_len++] = chr;
-    /* TODO: multibyte chars */
-    if (quote && !escape && chr == '\\')
-        escape = 1;
-    else if (!escape && chr == '"')
-        quote = !quote;
-    else if (!quote) {
-        if (chr == '{' || chr == '[' || chr == '(')
-            nest_depth++;
-        if (chr == '}' || chr == ']' || chr == ')') {
-            nest_depth--;
-
-            if ((int8_t) nest_depth <= 0) {
-                /* End of JSON object detected */
-                obj_str[obj_str_len++] = 0;
-                if (!obj) {
-                    obj = aJson.parse((char *) obj_str);
-                    if (!obj)
-                        obj = aJson.parse("{\"error\":\"syntaxError\"}");
-                }
-
-                obj_str_len = 0;
-                nest_depth = 0;
-            }
+    /* Whitespace between tokens */
+    if (chr <= ' ')
+        return;
+
+    switch (state) {
+    case JSON_IDLE:
+        /* Anything outside of an object is ignored */
+        if (chr == '{')
+            startObject();
+        break;
+
+    case JSON_KEY_OR_END:
+        if (chr == '}') {
+            pop();
+            break;
+        }
+        /* Fall through */
+    case JSON_KEY:
+        if (chr != '"') {
+            syntaxError(chr);
+            break;
+        }
+
+        tokLen = 0;
+        state = JSON_KEY_STRING;
+        break;
+
+    case JSON_COLON:
+        if (chr != ':') {
+            syntaxError(chr);
+            break;
+        }
+
+        state = JSON_VALUE;
+        break;
+
+    case JSON_VALUE_OR_END:
+        if (chr == ']') {
+            pop();
+            break;
         }
+        /* Fall through */
+    case JSON_VALUE:
+        if (chr == '"') {
+            tokLen = 0;
+            state = JSON_STRING;
+        } else if (chr == '-' || (chr >= '0' && chr <= '9')) {
+            mant = 0;
+            exp = 0;
+            scale = 0;
+            numFlags = chr == '-' ? NUM_NEG : 0;
+            state = JSON_NUMBER;
+            if (chr != '-')
+                putch(chr);
+        } else if (chr == 't' || chr == 'f' || chr == 'n') {
+            tok[0] = chr;
+            literal = chr == 't' ? PSTR("rue") :
+                chr == 'f' ? PSTR("alse") : PSTR("ull");
+            state = JSON_LITERAL;
+        } else if (chr == '[') {
+            /* Arrays hold values of the same key, but not other arrays */
+            if (stack[depth - 1].array)
+                fail(structErrorStr);
+            if (!push(true))
+                syntaxError(chr);
+        } else if (chr == '{') {
+            /* Only nested MESSAGEs are objects */
+            int key = stack[depth - 1].key;
+
+            if (key != MESSAGE)
+                fail(structErrorStr);
+            if (!push(false)) {
+                syntaxError(chr);
+                break;
+            }
+
+            stack[depth - 1].start = 0;
+            if (!status && room(5))
+                stack[depth - 1].start = out->beginBinaryValue(MESSAGE);
+        } else
+            syntaxError(chr);
+        break;
+
+    case JSON_AFTER_VALUE:
+        if (chr == ',')
+            state = stack[depth - 1].array ? JSON_VALUE : JSON_KEY;
+        else if (chr == (stack[depth - 1].array ? ']' : '}'))
+            pop();
+        else
+            syntaxError(chr);
+        break;
     }
 }
+
 /* vim: set sw=4 ts=4 et: */
@@ -1,32 +1,133 @@
 #ifndef MESSAGE_JSON_CONVERTER_H
 #define MESSAGE_JSON_CONVERTER_H
 
-#include <aJSON.h>
+#include <Arduino.h>
 
 #include "Message.h"
+#include "Delta.h"
+
+class ValueCache;
+
+/* Longest string, e.g. expression, in the Json input plus one.  A longer
+ * one, e.g. an expression of more than 63 characters, fails the object
+ * with {"error":"tooLong"}.  The token is in RAM for good, see the budget
+ * in Base.cpp before growing it.
+ */
+#ifndef JSON_TOKEN_SIZE
+#define JSON_TOKEN_SIZE 64
+#endif
+
+/* Longest Expression bytecode compiled from text */
+#define EXPR_MAX_LEN 128
+
+/* Longest expression text printed and deepest nesting decompiled */
+#ifndef EXPR_STR_MAX
+#define EXPR_STR_MAX 512
+#endif
+#define EXPR_MAX_DEPTH 32
+
+/* Max nesting of objects and arrays in the Json input */
+#define JSON_MAX_DEPTH 4
 
 class MessageJsonConverter {
 public:
-    /* Json parser support (stateful) */
+    /* Json parser support (stateful).  putch() takes the text one byte
+     * at a time and builds the Message as the tokens arrive, there's no
+     * text buffer other than for the current string token.  Once a whole
+     * object has been received either @msg is set, in which case the
+     * caller owns it and has to release() it, or @error names the
+     * problem.  The caller resets them to NULL when done.  @cachedOk
+     * says whether the object had "cachedOk":true, i.e. the server is
+     * fine with an answer from a ValueCache.  {"type":"stats"} is not a
+     * Message, it sets @statsRequest instead, also reset by the caller.
+     * The errors are counted in @syntaxErrors and @structErrors.
+     */
     MessageJsonConverter();
     void putch(uint8_t chr);
-    aJsonObject *obj;
-
-    /* Message -> Json conversion (stateless) */
-    static aJsonObject *messageToJson(Message &m);
+    Message *msg;
+    const char *error;
+    bool cachedOk, statsRequest;
+    uint16_t syntaxErrors, structErrors;
 
-    /* Json -> Message conversion (stateless) */
-    static Message *jsonToMessage(aJsonObject &obj);
+    /* Message -> Json conversion (stateless), writes the text straight
+     * to @out without building a tree or using the heap.  For a
+     * PUBLISH_BATCH message converts only the service's group starting at
+     * @group, a plain "publish" per group.  Start with @group = m.begin(),
+     * @group is then moved to the next group or to 0 after the last one.
+     * For a delta coded group pass the absolute values from
+     * DeltaCache::resolve() in @abs, they replace the deltas.
+     */
+    static void printMessage(Print &out, MessageView &m,
+            MessageView::iter &group, const DeltaValues *abs = NULL);
+    /* Print all of @m, resolving delta coded groups through @cache, one
+     * object per group of a PUBLISH_BATCH, each followed by a line break
+     * if @newlines is set.  @return the SERVICE_ID of a service whose
+     * delta reference was lost and which should be sent a REQUEST, or -1.
+     * The values printed are also stored in @values if given.
+     */
+    static int printFrame(Print &out, MessageView &m, DeltaCache &cache,
+            bool newlines, ValueCache *values = NULL);
+    /* Same as printFrame() without the printing, for frames that are
+     * dropped but whose delta coding and values still need following.
+     */
+    static int trackFrame(MessageView &m, DeltaCache &cache,
+            ValueCache *values = NULL);
+    /* Print the fate of a Message sent to node @to, {"ack":"xmit",...}
+     * once it's been delivered or {"error":"xmitError",...} if not.
+     */
+    static void printXmitResult(Print &out, uint8_t to, bool ok,
+            bool newlines);
+    /* Print {"error":"rateLimited",...} with the number of PUBLISHes from
+     * node @from that have been dropped.
+     */
+    static void printRateLimited(Print &out, uint8_t from, uint16_t count,
+            bool newlines);
 
     /* Helpers */
-    static void headerToJson(aJsonObject *obj, Message &m);
-    static void payloadToJson(aJsonObject *obj, Message &m);
-    static bool jsonToPayload(Message &msg, aJsonObject &obj);
-    static char *exprToString(const uint8_t *buf, uint8_t len);
-    static uint8_t *exprFromString(const char *str, uint8_t *len);
+    static void printHeader(Print &out, MessageView &m);
+    static void printPayload(Print &out, MessageView &m,
+            MessageView::iter &i, bool oneGroup, bool comma,
+            const DeltaValues *abs = NULL);
+    /* Decompile the @len bytes of Expression bytecode at @buf straight
+     * to @out, writing at most @budget characters.  @return false if the
+     * bytecode is malformed or the text too long, the text then ends
+     * with "...".
+     */
+    static bool printExpr(Print &out, const uint8_t *buf, uint8_t len,
+            uint16_t budget);
+    /* Compile and optimise (see ExprOptimizer.h) the expression in @str
+     * into at most @size bytes at @out.  @return the bytecode length or
+     * 0 if @str is not a valid expression or the result is too long.
+     */
+    static uint8_t exprCompile(const char *str, uint8_t *out, uint8_t size);
 
 private:
-    uint8_t obj_str[128], obj_str_len, nest_depth, escape, quote;
+    struct Level {
+        int key;
+        bool array;
+        msglen_t start;
+    } stack[JSON_MAX_DEPTH];
+    Message *out;
+    const char *status;
+    const prog_char *literal;
+    char tok[JSON_TOKEN_SIZE];
+    int32_t mant;
+    int16_t exp, scale;
+    uint8_t state, depth, tokLen, numFlags;
+    bool escape, quote, hasType, hasTo, isStats;
+
+    void reset(void);
+    void startObject(void);
+    bool push(bool array);
+    void pop(void);
+    void skip(uint8_t chr);
+    void syntaxError(uint8_t chr);
+    void fail(const char *err);
+    bool room(uint8_t len);
+    void keyDone(void);
+    void stringDone(void);
+    void numberDone(void);
+    void literalDone(void);
 };
 
 #endif // whole file
@@ -0,0 +1,98 @@
+/*
+ * Flood protection of the Base, see RateLimit.h.
+ */
+#include <stddef.h>
+
+#include "RateLimit.h"
+
+/* allow() doesn't get this far without an interval, avoid dividing by 0 */
+#if RATE_LIMIT_INTERVAL_MS
+# define INTERVAL RATE_LIMIT_INTERVAL_MS
+#else
+# define INTERVAL 1
+#endif
+
+void RateLimit::refill(Bucket *b, uint16_t now) {
+    uint16_t n = (uint16_t) (now - b->refilled) / INTERVAL;
+
+    if (b->tokens + n >= RATE_LIMIT_BURST) {
+        b->tokens = RATE_LIMIT_BURST;
+        b->refilled = now;
+    } else {
+        b->tokens += n;
+        b->refilled += n * INTERVAL;
+    }
+}
+
+/*
+ * The bucket of @node.  A new node takes over the bucket of the quietest
+ * one, i.e. the one with the most tokens, preferably one with no drops
+ * left to report.
+ */
+RateLimit::Bucket *RateLimit::get(uint8_t node, uint16_t now) {
+    Bucket *b = NULL;
+    uint8_t i;
+
+    for (i = 0; i < used; i++) {
+        refill(&buckets[i], now);
+        if (buckets[i].node == node)
+            return &buckets[i];
+
+        if (!b || (b->dropped && !buckets[i].dropped) ||
+                (!b->dropped == !buckets[i].dropped &&
+                 buckets[i].tokens > b->tokens))
+            b = &buckets[i];
+    }
+
+    if (used < RATE_LIMIT_NODES)
+        b = &buckets[used++];
+
+    b->node = node;
+    b->tokens = RATE_LIMIT_BURST;
+    b->refilled = now;
+    b->dropped = 0;
+    return b;
+}
+
+bool RateLimit::allow(uint8_t node, uint16_t now) {
+    Bucket *b;
+
+    if (!RATE_LIMIT_INTERVAL_MS)
+        return 1;
+
+    b = get(node, now);
+    if (b->tokens) {
+        b->tokens--;
+        return 1;
+    }
+
+    if (b->dropped < 0xffff)
+        b->dropped++;
+    return 0;
+}
+
+bool RateLimit::report(uint16_t now, uint8_t *node, uint16_t *count) {
+    if (!reportPos) {
+        if ((uint16_t) (now - lastReport) < RATE_LIMIT_REPORT_MS)
+            return 0;
+        lastReport = now;
+        reportPos = 1;
+    }
+
+    for (; reportPos <= used; reportPos++) {
+        Bucket *b = &buckets[reportPos - 1];
+
+        if (b->dropped) {
+            *node = b->node;
+            *count = b->dropped;
+            b->dropped = 0;
+            reportPos++;
+            return 1;
+        }
+    }
+
+    reportPos = 0;
+    return 0;
+}
+
+/* vim: set sw=4 ts=4 et: */
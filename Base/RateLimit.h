@@ -0,0 +1,75 @@
+/*
+ * Flood protection of the Base.  Every node that publishes gets a token
+ * bucket: each PUBLISH takes a token, a token comes back every
+ * RATE_LIMIT_INTERVAL_MS and up to RATE_LIMIT_BURST can be saved up.
+ * A PUBLISH from a node with no tokens left is dropped instead of being
+ * passed to the server, so one chattering node, e.g. a bouncing switch,
+ * can't hog the serial link and the others still get through.  How many
+ * were dropped is reported for each node every RATE_LIMIT_REPORT_MS.
+ * The radio has acked a dropped PUBLISH so the Base still follows its
+ * delta coding, see Delta.h.  In binary mode that's up to the server
+ * so delta coded PUBLISHes are always passed on there.
+ *
+ * Times are in milliseconds, 16-bit, same as in XmitQueue.  Rate and
+ * burst are set at build time, a zero RATE_LIMIT_INTERVAL_MS turns the
+ * limit off.
+ */
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+
+/* Nodes tracked at a time, at most 255 */
+#ifndef RATE_LIMIT_NODES
+# ifdef __AVR__
+#  define RATE_LIMIT_NODES 8
+# else
+#  define RATE_LIMIT_NODES 64
+# endif
+#endif
+
+/* Average PUBLISH rate allowed per node, one per interval */
+#ifndef RATE_LIMIT_INTERVAL_MS
+#define RATE_LIMIT_INTERVAL_MS 200
+#endif
+
+/* PUBLISHes a node may send in a row after having been quiet */
+#ifndef RATE_LIMIT_BURST
+#define RATE_LIMIT_BURST 10
+#endif
+
+#ifndef RATE_LIMIT_REPORT_MS
+#define RATE_LIMIT_REPORT_MS 10000
+#endif
+
+class RateLimit {
+public:
+    RateLimit() : used(0), reportPos(0), lastReport(0) {}
+
+    /* Take a token for a PUBLISH from @node.  @return false if it has
+     * none left and the PUBLISH is to be dropped.
+     */
+    bool allow(uint8_t node, uint16_t now);
+    /* Once every RATE_LIMIT_REPORT_MS, hand out the number of PUBLISHes
+     * dropped since the last report, one node per call.  @return false
+     * when there's no more to report for now.
+     */
+    bool report(uint16_t now, uint8_t *node, uint16_t *count);
+
+private:
+    struct Bucket {
+        uint8_t node;
+        uint8_t tokens;
+        uint16_t refilled;  /* When the last token was added */
+        uint16_t dropped;   /* Not reported yet */
+    } buckets[RATE_LIMIT_NODES];
+    uint8_t used;
+    uint8_t reportPos;      /* Next bucket to report plus one, or zero */
+    uint16_t lastReport;
+
+    Bucket *get(uint8_t node, uint16_t now);
+    void refill(Bucket *b, uint16_t now);
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,177 @@
+/*
+ * Radio layer of the Base that stops received payloads from piling up in
+ * the nRF24's 3-deep Rx FIFO while the main loop is busy.  pump(), called
+ * from the radio's pin-change interrupt, moves every payload the chip has
+ * into a RAM ring and the layer above, FragmentedDatagram, reads them
+ * from there at its own pace.  The ring holds radio payloads rather than
+ * whole Messages because the fragments of a Message arrive one interrupt
+ * at a time, a Message of up to 27 bytes is a single payload.  When the
+ * ring is full the new payload is read out and counted as dropped, so a
+ * slow loop loses frames visibly instead of the chip silently ignoring
+ * them.
+ *
+ * Everything that talks to the chip from outside the interrupt does so
+ * with interrupts off, the SPI transactions are short.
+ */
+#ifndef RX_QUEUE_DATAGRAM_H
+#define RX_QUEUE_DATAGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/interrupt.h>
+
+/* Number of payloads waiting, at most 255 */
+#ifndef RADIO_RX_RING_LEN
+#define RADIO_RX_RING_LEN 4
+#endif
+
+/* nRF24L01+ payload size */
+#define RADIO_PAYLOAD_MAX 32
+
+template <typename T>
+class RxQueueDatagram : public T {
+public:
+    RxQueueDatagram(RHGenericDriver &driver, uint8_t thisAddress = 0) :
+        T(driver, thisAddress), head(0), count(0), drops(0), peak(0) {}
+
+    /* Interrupt side: move what the chip has received into the ring */
+    void pump(void) {
+        fill(1);
+    }
+
+    bool init() {
+        uint8_t sreg = SREG;
+        bool ret;
+
+        cli();
+        ret = T::init();
+        SREG = sreg;
+        return ret;
+    }
+
+    void setThisAddress(uint8_t new_addr) {
+        uint8_t sreg = SREG;
+
+        cli();
+        T::setThisAddress(new_addr);
+        SREG = sreg;
+    }
+
+    /* Also picks up anything the interrupt hasn't, e.g. on the host */
+    bool available() {
+        uint8_t sreg = SREG;
+
+        cli();
+        if (!count)
+            fill(0);
+        SREG = sreg;
+        return count;
+    }
+
+    bool recvfromAck(uint8_t *buf, uint8_t *len, uint8_t *from = NULL,
+            uint8_t *to = NULL, uint8_t *id = NULL, uint8_t *flags = NULL) {
+        uint8_t sreg;
+
+        if (!available())
+            return 0;
+
+        /* The interrupt only adds after the head, it's ours to read */
+        *len = ring[head].len;
+        memcpy(buf, ring[head].buf, *len);
+
+        sreg = SREG;
+        cli();
+        head = (head + 1) % RADIO_RX_RING_LEN;
+        count--;
+        SREG = sreg;
+        return 1;
+    }
+
+    bool sendtoWait(uint8_t *buf, uint8_t len, uint8_t address) {
+        uint8_t sreg = SREG;
+        bool ret;
+
+        /* Blocks with interrupts off, use sendtoStart() instead */
+        cli();
+        ret = T::sendtoWait(buf, len, address);
+        SREG = sreg;
+        return ret;
+    }
+
+    bool sendtoWait(const uint8_t *buf, uint8_t len, uint8_t trailer,
+            uint8_t address) {
+        uint8_t sreg = SREG;
+        bool ret;
+
+        cli();
+        ret = T::sendtoWait(buf, len, trailer, address);
+        SREG = sreg;
+        return ret;
+    }
+
+    void sendtoStart(const uint8_t *buf, uint8_t len, uint8_t trailer,
+            uint8_t address) {
+        uint8_t sreg = SREG;
+
+        cli();
+        T::sendtoStart(buf, len, trailer, address);
+        SREG = sreg;
+    }
+
+    int8_t sendtoPoll() {
+        uint8_t sreg = SREG;
+        int8_t ret;
+
+        cli();
+        ret = T::sendtoPoll();
+        SREG = sreg;
+        return ret;
+    }
+
+    struct RxStats {
+        uint16_t drops;         /* Payloads lost to a full ring */
+        uint8_t peak;           /* Most payloads ever waiting */
+    };
+    /* A consistent copy of the counters */
+    void getRxStats(RxStats &stats) {
+        uint8_t sreg = SREG;
+
+        cli();
+        stats.drops = drops;
+        stats.peak = peak;
+        SREG = sreg;
+    }
+
+private:
+    struct Slot {
+        uint8_t buf[RADIO_PAYLOAD_MAX];
+        uint8_t len;
+    };
+
+    /* With @drop unset the payloads that don't fit stay in the chip */
+    void fill(bool drop) {
+        while ((drop || count < RADIO_RX_RING_LEN) && T::available()) {
+            Slot *s = &ring[(uint8_t) (head + count) % RADIO_RX_RING_LEN];
+
+            if (count == RADIO_RX_RING_LEN) {
+                Slot dummy;
+
+                T::recvfromAck(dummy.buf, &dummy.len);
+                drops++;
+                continue;
+            }
+
+            T::recvfromAck(s->buf, &s->len);
+            if (++count > peak)
+                peak = count;
+        }
+    }
+
+    Slot ring[RADIO_RX_RING_LEN];
+    volatile uint8_t head, count;
+    volatile uint16_t drops;
+    uint8_t peak;
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,75 @@
+/*
+ * Lock-free single-producer single-consumer byte ring, for bytes that an
+ * interrupt handler receives and the main loop consumes.  Only the
+ * producer writes @head and only the consumer writes @tail so neither
+ * side needs to disable interrupts, the compiler barriers make sure a
+ * byte is in the buffer before @head says so and read out before @tail
+ * gives its slot back.  One slot stays empty to tell full from empty.
+ */
+#ifndef RX_RING_H
+#define RX_RING_H
+
+#include <stdint.h>
+
+#define RX_RING_BARRIER() __asm__ __volatile__ ("" : : : "memory")
+
+/* @size is a power of two, 256 at most */
+template <int size>
+class RxRing {
+public:
+    RxRing() : overflows(0), head(0), tail(0) {}
+
+    /* Producer side.  @return false and count the byte as lost if the
+     * ring is full.
+     */
+    bool put(uint8_t chr) {
+        uint8_t next = (head + 1) & (size - 1);
+
+        if (next == tail) {
+            overflows++;
+            return 0;
+        }
+
+        buf[head] = chr;
+        RX_RING_BARRIER();
+        head = next;
+        return 1;
+    }
+
+    uint8_t space(void) {
+        return (tail - head - 1) & (size - 1);
+    }
+
+    /* Consumer side */
+    uint8_t count(void) {
+        return (head - tail) & (size - 1);
+    }
+
+    bool empty(void) {
+        return head == tail;
+    }
+
+    /* Only when not empty() */
+    uint8_t peek(void) {
+        RX_RING_BARRIER();
+        return buf[tail];
+    }
+
+    uint8_t get(void) {
+        uint8_t chr = peek();
+
+        RX_RING_BARRIER();
+        tail = (tail + 1) & (size - 1);
+        return chr;
+    }
+
+    /* Bytes dropped because the ring was full, written by the producer */
+    volatile uint16_t overflows;
+
+private:
+    uint8_t buf[size];
+    volatile uint8_t head, tail;
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
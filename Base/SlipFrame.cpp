@@ -0,0 +1,134 @@
+/*
+ * SLIP framing of raw Messages on the serial link, see SlipFrame.h.
+ */
+#include <Arduino.h>
+#include <util/crc16.h>
+
+#include "SlipFrame.h"
+
+#define CRC_INIT 0xffff
+
+void SlipDecoder::takeBuffer(void) {
+    Message *m = Message::alloc(0, 0);
+
+    /* No pool slot, frames with a payload count as too long until then */
+    if (!m)
+        return;
+
+    /* The frame overwrites the header too */
+    m->writeLength(-HEADERS_LENGTH);
+    buf = m->getWriteBuffer();
+}
+
+int SlipDecoder::putch(uint8_t chr) {
+    if (chr == SLIP_END) {
+        uint16_t crc = CRC_INIT;
+
+        /* Opening delimiter or an empty frame between two delimiters */
+        if (!active || (!len && !escape && !overflow)) {
+            active = 1;
+            len = 0;
+            escape = overflow = 0;
+            if (unlikely(!buf))
+                takeBuffer();
+            return SLIP_MORE;
+        }
+
+        if (overflow || escape || len < 2) {
+            int ret = overflow ? SLIP_TOO_LONG : SLIP_BAD_CRC;
+
+            len = 0;
+            escape = overflow = 0;
+            return ret;
+        }
+
+        len -= 2;
+        for (uint16_t i = 0; i < len; i++)
+            crc = _crc_ccitt_update(crc, buf[i]);
+        if (tail[0] != (crc & 0xff) || tail[1] != (crc >> 8)) {
+            len = 0;
+            return SLIP_BAD_CRC;
+        }
+
+        active = 0;
+        return len;
+    }
+
+    if (unlikely(!active) || overflow)
+        return SLIP_MORE;
+
+    if (chr == SLIP_ESC) {
+        escape = 1;
+        return SLIP_MORE;
+    }
+
+    if (escape) {
+        escape = 0;
+        if (chr == SLIP_ESC_END)
+            chr = SLIP_END;
+        else if (chr == SLIP_ESC_ESC)
+            chr = SLIP_ESC;
+    }
+
+    /* The last two bytes are the CRC if the frame ends here */
+    if (len >= 2) {
+        if (len - 2 >= MAX_MESSAGE_SIZE || !buf) {
+            overflow = 1;
+            return SLIP_MORE;
+        }
+        buf[len - 2] = tail[0];
+    }
+    tail[0] = tail[1];
+    tail[1] = chr;
+    len++;
+
+    return SLIP_MORE;
+}
+
+static void writeByte(Print &out, uint8_t chr) {
+    if (chr == SLIP_END) {
+        out.write(SLIP_ESC);
+        out.write(SLIP_ESC_END);
+    } else if (chr == SLIP_ESC) {
+        out.write(SLIP_ESC);
+        out.write(SLIP_ESC_ESC);
+    } else
+        out.write(chr);
+}
+
+void SlipDecoder::write(Print &out, const uint8_t *data, int len) {
+    uint16_t crc = CRC_INIT;
+
+    out.write(SLIP_END);
+    while (len--) {
+        crc = _crc_ccitt_update(crc, *data);
+        writeByte(out, *data++);
+    }
+    writeByte(out, crc & 0xff);
+    writeByte(out, crc >> 8);
+    out.write(SLIP_END);
+}
+
+void SlipDecoder::writeControl(Print &out, uint8_t err) {
+    write(out, &err, err ? 1 : 0);
+}
+
+void SlipDecoder::writeXmitResult(Print &out, uint8_t addr, bool ok) {
+    uint8_t frame[2];
+
+    frame[0] = ok ? SLIP_XMIT_OK : SLIP_ERR_XMIT;
+    frame[1] = addr;
+    write(out, frame, 2);
+}
+
+void SlipDecoder::writeRateLimited(Print &out, uint8_t addr,
+        uint16_t count) {
+    uint8_t frame[3];
+
+    frame[0] = SLIP_RATE_LIMITED;
+    frame[1] = addr;
+    frame[2] = count < 0xff ? count : 0xff;
+    write(out, frame, 3);
+}
+
+/* vim: set sw=4 ts=4 et: */
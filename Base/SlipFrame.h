@@ -0,0 +1,95 @@
+/*
+ * Binary mode of the Base <-> server serial link.  Each frame carries the
+ * raw bytes of one Message (see Message.h) followed by their CRC-CCITT
+ * (initial value 0xffff, low byte first), framed with SLIP (RFC 1055):
+ * every frame starts and ends with SLIP_END and SLIP_END / SLIP_ESC
+ * bytes inside the frame are escaped.  The framing costs 4 bytes plus
+ * escapes per Message, a fraction of the Json text.
+ *
+ * Since SLIP_END never appears in Json text both modes can share the
+ * link, the receiver tells them apart by the first byte.  Frames shorter
+ * than a Message header are link control:
+ *  - an empty frame (just the CRC) asks the Base to switch to binary
+ *    mode, the Base answers with an empty frame,
+ *  - a frame with a single SLIP_ERR_* byte reports an error,
+ *  - SLIP_XMIT_OK or SLIP_ERR_XMIT followed by a node address reports
+ *    whether a Message for that node got through,
+ *  - SLIP_RATE_LIMITED followed by a node address and a count reports
+ *    PUBLISHes from that node dropped by the RateLimit, 255 standing for
+ *    255 or more.
+ * Any complete Json object received switches the Base back to Json.
+ */
+#ifndef SLIP_FRAME_H
+#define SLIP_FRAME_H
+
+#include <stdint.h>
+
+#include "Message.h"
+
+class Print;
+
+#define SLIP_END        0xc0
+#define SLIP_ESC        0xdb
+#define SLIP_ESC_END    0xdc
+#define SLIP_ESC_ESC    0xdd
+
+/* Error codes in the link control frames */
+#define SLIP_ERR_CRC    1 /* Corrupt or truncated frame received */
+#define SLIP_ERR_SIZE   2 /* Frame too long */
+#define SLIP_ERR_XMIT   3 /* Can't send the Message over the radio */
+#define SLIP_XMIT_OK    4 /* Message acked by the node, not an error */
+#define SLIP_RATE_LIMITED 5 /* PUBLISHes dropped, see RateLimit.h */
+
+/* Return values of SlipDecoder::putch() other than the frame length */
+#define SLIP_MORE       -1
+#define SLIP_BAD_CRC    -2
+#define SLIP_TOO_LONG   -3
+
+/*
+ * The frame is built in a Message taken from the pool (see
+ * Message::alloc()) at the first frame and kept for good, rather than in
+ * a buffer of its own.  The Base and the bridge only ever use one pool
+ * slot otherwise, for the Json parser, so this one was idle anyway.  Each
+ * SlipDecoder takes a slot, mind MESSAGE_POOL_SIZE when adding one.  The
+ * CRC is held back in tail[] until the frame ends so that
+ * MAX_MESSAGE_SIZE bytes are enough.
+ */
+class SlipDecoder {
+public:
+    SlipDecoder() : buf(NULL), active(0) {}
+
+    /* Feed the next byte received.  @return the length of the frame
+     * (without the CRC) once a whole frame with a good CRC is available
+     * from getFrame(), SLIP_MORE if more bytes are needed or a
+     * negative error if a frame was dropped.  The frame stays valid
+     * until the next putch().
+     */
+    int putch(uint8_t chr);
+    const uint8_t *getFrame(void) { return buf; }
+    /* True while in the middle of a frame, all bytes received while
+     * inFrame() is true belong to the SLIP decoder, so does SLIP_END.
+     * After a bad frame the decoder stays inFrame() because the closing
+     * SLIP_END may as well have been the start of the next frame.
+     */
+    bool inFrame(void) { return active; }
+
+    /* Write one frame with @len bytes from @data to @out */
+    static void write(Print &out, const uint8_t *data, int len);
+    /* Write a link control frame, @err is zero or a SLIP_ERR_* code */
+    static void writeControl(Print &out, uint8_t err);
+    /* Write a SLIP_XMIT_OK / SLIP_ERR_XMIT frame for node @addr */
+    static void writeXmitResult(Print &out, uint8_t addr, bool ok);
+    /* Write a SLIP_RATE_LIMITED frame for node @addr */
+    static void writeRateLimited(Print &out, uint8_t addr, uint16_t count);
+
+private:
+    uint8_t *buf;
+    uint8_t tail[2];
+    uint16_t len;
+    bool active, escape, overflow;
+
+    void takeBuffer(void);
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,82 @@
+/*
+ * ATmega USART driver of the Base, see Uart.h.
+ */
+#include <Arduino.h>
+#include <avr/interrupt.h>
+
+#include "Uart.h"
+
+Uart uart;
+
+Uart::Uart() : errors(0) {}
+
+void Uart::begin(unsigned long baud) {
+    /* Double speed mode, same divider as Arduino's Serial picks */
+    UCSR0A = 1 << U2X0;
+    UBRR0 = (F_CPU / 4 / baud - 1) / 2;
+    /* 8N1 */
+    UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+    UCSR0B = (1 << RXEN0) | (1 << TXEN0) | (1 << RXCIE0);
+}
+
+int Uart::available(void) {
+    return rx.count();
+}
+
+int Uart::read(void) {
+    return rx.empty() ? -1 : rx.get();
+}
+
+int Uart::peek(void) {
+    return rx.empty() ? -1 : rx.peek();
+}
+
+/* Only waits for the last byte to leave the data register */
+void Uart::flush(void) {
+    while (!(UCSR0A & (1 << UDRE0)));
+}
+
+size_t Uart::write(uint8_t chr) {
+    flush();
+    UDR0 = chr;
+    return 1;
+}
+
+size_t Uart::write(const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        write(buf[i]);
+    return len;
+}
+
+void Uart::getStats(Stats &stats) {
+    uint8_t sreg = SREG;
+
+    cli();
+    stats.overflows = rx.overflows;
+    stats.errors = errors;
+    SREG = sreg;
+}
+
+void Uart::rxInterrupt(void) {
+    /* The status goes with the byte in UDR0, read it first */
+    uint8_t status = UCSR0A;
+    uint8_t chr = UDR0;
+
+    /* On an overrun the bytes before this one were lost, this one is
+     * fine.  Framing and parity errors make this one garbage.
+     */
+    if (status & ((1 << FE0) | (1 << DOR0) | (1 << UPE0)))
+        errors++;
+    if (!(status & ((1 << FE0) | (1 << UPE0))))
+        rx.put(chr);
+}
+
+#ifdef USART_RX_vect
+ISR(USART_RX_vect) {
+#else
+ISR(USART0_RX_vect) {
+#endif
+    uart.rxInterrupt();
+}
+
+/* vim: set sw=4 ts=4 et: */
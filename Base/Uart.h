@@ -0,0 +1,57 @@
+/*
+ * The Base's serial port to the server.  The USART Rx interrupt puts
+ * every byte received in a ring buffer as soon as it arrives and
+ * Base::loop() reads them at its own pace, so bursts of commands aren't
+ * lost while the loop is busy printing or talking to the radio.  Sending
+ * is polled, write() returns once the last byte is in the USART.
+ *
+ * Arduino's Serial isn't used at all since it owns the Rx interrupt.
+ * The host build has its own implementation in host/Uart.cpp.
+ */
+#ifndef UART_H
+#define UART_H
+
+#include <Arduino.h>
+
+#include "RxRing.h"
+
+/* Enough for a command line at 115200 baud while the loop is busy */
+#ifndef UART_RX_RING_SIZE
+#define UART_RX_RING_SIZE 128
+#endif
+
+class Uart : public Stream {
+public:
+    Uart();
+    void begin(unsigned long baud);
+
+    int available(void);
+    int read(void);
+    int peek(void);
+    void flush(void);
+    size_t write(uint8_t chr);
+    size_t write(const uint8_t *buf, size_t len);
+    using Print::write;
+
+    struct Stats {
+        uint16_t overflows;     /* Bytes lost to a full ring */
+        uint16_t errors;        /* Framing, parity or USART overrun */
+    };
+    /* A consistent copy of the counters */
+    void getStats(Stats &stats);
+
+    /* Called by the Rx interrupt handler */
+    void rxInterrupt(void);
+
+private:
+    RxRing<UART_RX_RING_SIZE> rx;
+    volatile uint16_t errors;
+#ifndef __AVR__
+    int fd;
+#endif
+};
+
+extern Uart uart;
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
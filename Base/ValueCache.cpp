@@ -0,0 +1,198 @@
+/*
+ * Last-value cache of the Base, see ValueCache.h.
+ */
+#include "ValueCache.h"
+#include "MessageJsonConverter.h"
+#include "FloatFormat.h"
+#include "SensorinoUtils.h"
+
+using namespace Data;
+
+/* Longest element add() may append */
+#define ELEM_MAX 7
+
+ValueCache::ValueCache() : used(0) {}
+
+ValueCache::Entry *ValueCache::find(uint8_t node, uint8_t service,
+        uint8_t type, uint8_t num) {
+    for (uint16_t i = 0; i < used; i++) {
+        Entry *e = &entries[i];
+
+        if (e->node == node && e->service == service && e->type == type &&
+                e->num == num)
+            return e;
+    }
+
+    return NULL;
+}
+
+/* A free entry or the least recently updated one */
+ValueCache::Entry *ValueCache::alloc(void) {
+    uint32_t now = millis();
+    Entry *oldest = entries;
+
+    if (used < VALUE_CACHE_SIZE)
+        return &entries[used++];
+
+    for (uint16_t i = 1; i < used; i++)
+        if (now - entries[i].time > now - oldest->time)
+            oldest = &entries[i];
+
+    return oldest;
+}
+
+void ValueCache::update(MessageView &m, MessageView::iter i, bool oneGroup,
+        const DeltaValues *abs) {
+    MessageView::iter j, k, end;
+    union {
+        bool b;
+        int i;
+        float f;
+        Message::BinaryValue bin;
+    } val;
+    int service = -1;
+    uint8_t absNum = 0, num;
+    uint32_t now = millis();
+    Type t, u;
+
+    /* The group's SERVICE_ID and where the group ends */
+    for (end = i; end; m.iterAdvance(end)) {
+        m.iterGetTypeValue(end, &t, &val);
+        if (t != SERVICE_ID)
+            continue;
+        if (oneGroup && end != i)
+            break;
+        if (service < 0)
+            service = val.i;
+    }
+
+    if (service < 0)
+        return;
+
+    for (j = i; j != end; m.iterAdvance(j)) {
+        Message::CodingType coding = (Message::CodingType) -1;
+        Entry *e;
+
+        m.iterGetTypeValue(j, &t, &val);
+        if (t == (Type) -1 || t == SERVICE_ID || t == DELTA_REF ||
+                !Message::dataTypeToString(t, &coding))
+            continue;
+
+        /* Same "fixed" value lookup as printValue() */
+        if (coding == Message::fixedCoding && abs) {
+            if (absNum >= abs->count) {
+                absNum++;
+                continue;
+            }
+
+            val.f = (float) abs->units[absNum++] / Message::getFixedScale(t);
+        }
+
+        if (coding == Message::binaryCoding)
+            continue;
+
+        for (k = i, num = 0; k != j; m.iterAdvance(k)) {
+            m.iterGetTypeValue(k, &u, NULL);
+            if (u == t)
+                num++;
+        }
+
+        e = find(m.getSrcAddress(), service, t, num);
+        if (!e)
+            e = alloc();
+
+        e->node = m.getSrcAddress();
+        e->service = service;
+        e->type = t;
+        e->num = num;
+        e->time = now;
+        if (coding == Message::boolCoding)
+            e->val.b = val.b;
+        else if (coding == Message::intCoding)
+            e->val.i = val.i;
+        else
+            e->val.f = val.f;
+    }
+}
+
+/* Append the value of @e to @reply, @return 0 if there's no room */
+bool ValueCache::addValue(Message &reply, const Entry *e) {
+    Message::CodingType coding = (Message::CodingType) -1;
+
+    if (reply.getRawLength() + ELEM_MAX > MAX_MESSAGE_SIZE)
+        return 0;
+
+    Message::dataTypeToString((Type) e->type, &coding);
+    if (e->type == DATATYPE)
+        reply.addDataTypeValue((Type) e->val.i);
+    else if (coding == Message::boolCoding)
+        reply.addBoolValue((Type) e->type, e->val.b);
+    else if (coding == Message::intCoding)
+        reply.addIntValue((Type) e->type, e->val.i);
+    else
+        reply.addFloatValue((Type) e->type, e->val.f);
+
+    return 1;
+}
+
+bool ValueCache::answer(Print &out, MessageView &req, bool newlines) {
+    Message reply(req.getDstAddress(), 0);
+    uint8_t node = req.getDstAddress();
+    uint32_t now = millis(), age = 0;
+    MessageView::iter i;
+    char buf[FLOAT_STR_SIZE];
+    int service, t;
+    uint16_t n, count = 0;
+    uint8_t num;
+    bool listed;
+    Entry *e;
+
+    if (!req.find(SERVICE_ID, 0, &service))
+        return 0;
+
+    reply.setType(Message::PUBLISH);
+    reply.addIntValue(SERVICE_ID, service);
+
+    /* The types asked for, or every type with a first value cached */
+    listed = req.find(DATATYPE, 0, &t);
+    for (n = 0; ; n++) {
+        if (listed) {
+            if (!req.find(DATATYPE, n, &t))
+                break;
+        } else if (n < used) {
+            if (entries[n].node != node || entries[n].service != service ||
+                    entries[n].num)
+                continue;
+            t = entries[n].type;
+        } else
+            break;
+
+        if (!find(node, service, t, 0))
+            return 0;
+
+        for (num = 0; (e = find(node, service, t, num)); num++) {
+            if (!addValue(reply, e))
+                return 0;
+            count++;
+            if (now - e->time > age)
+                age = now - e->time;
+        }
+    }
+
+    if (!count)
+        return 0;
+
+    out.write('{');
+    MessageJsonConverter::printHeader(out, reply);
+    i = reply.begin();
+    MessageJsonConverter::printPayload(out, reply, i, false, true);
+    pgmWrite(out, PSTR(",\"age\":"));
+    out.write((const uint8_t *) buf, formatFloat(buf, age / 1000.0f));
+    out.write('}');
+    if (newlines)
+        pgmWrite(out, PSTR("\r\n"));
+
+    return 1;
+}
+
+/* vim: set sw=4 ts=4 et: */
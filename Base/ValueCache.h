@@ -0,0 +1,65 @@
+/*
+ * Last known values of the nodes' services, as seen in the PUBLISHes
+ * passing through the Base, so that a REQUEST the server marks with
+ * "cachedOk" can be answered right away instead of over the radio.  Each
+ * value is keyed by node address, SERVICE_ID, Data::Type and index among
+ * the values of that type, the least recently updated one makes room for
+ * a new one.  Binary values aren't kept.
+ *
+ * printFrame() in MessageJsonConverter fills the cache with the same,
+ * delta decoded, values it prints, on the Base in Json mode and in
+ * BaseLink on the server side in binary mode.
+ */
+#ifndef VALUE_CACHE_H
+#define VALUE_CACHE_H
+
+#include <Arduino.h>
+
+#include "Message.h"
+#include "Delta.h"
+
+#ifndef VALUE_CACHE_SIZE
+# ifdef __AVR__
+#  define VALUE_CACHE_SIZE 8
+# else
+#  define VALUE_CACHE_SIZE 256
+# endif
+#endif
+
+class ValueCache {
+public:
+    ValueCache();
+
+    /* Remember the values of the group of @m starting at @i, or of all of
+     * it unless @oneGroup is set, same as printPayload() prints them.
+     */
+    void update(MessageView &m, MessageView::iter i, bool oneGroup,
+            const DeltaValues *abs);
+
+    /* Print the cached values asked for by REQUEST @req as a "publish"
+     * from the node with an "age" in seconds, that of the oldest value,
+     * followed by a line break if @newlines is set.  Without DATATYPE
+     * elements in @req all the service's values are printed.  @return
+     * false, printing nothing, if any of them is not in the cache.
+     */
+    bool answer(Print &out, MessageView &req, bool newlines);
+
+private:
+    struct Entry {
+        uint8_t node, service, type, num;
+        union {
+            int i;
+            bool b;
+            float f;
+        } val;
+        uint32_t time;
+    } entries[VALUE_CACHE_SIZE];
+    uint16_t used;
+
+    Entry *find(uint8_t node, uint8_t service, uint8_t type, uint8_t num);
+    Entry *alloc(void);
+    static bool addValue(Message &reply, const Entry *e);
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,94 @@
+/*
+ * Outbound radio queue of the Base, see XmitQueue.h.
+ */
+#include <string.h>
+
+#include "XmitQueue.h"
+
+XmitEntry *XmitQueue::push(const uint8_t *raw, uint8_t len, uint16_t now) {
+    XmitEntry *e;
+    uint8_t i, free = XMIT_QUEUE_LEN, lane = 0, dst;
+
+    if (len > MAX_RADIO_MESSAGE_SIZE)
+        return NULL;
+    dst = MessageView(raw, len).getDstAddress();
+
+    for (i = 0; i < XMIT_QUEUE_LEN; i++)
+        if (!(usedMask & (1 << i)))
+            free = i;
+        else if (entries[i].dst == dst)
+            lane++;
+    if (free == XMIT_QUEUE_LEN || lane >= XMIT_LANE_MAX)
+        return NULL;
+
+    i = free;
+    e = &entries[i];
+    memcpy(e->raw, raw, len);
+    e->len = len;
+    e->dst = dst;
+    e->seq = seq++;
+    e->tries = 0;
+    e->quiet = 0;
+    e->deadline = now + XMIT_DEADLINE_MS;
+    e->retryAt = now;
+
+    usedMask |= 1 << i;
+    return e;
+}
+
+/* No older message for the same node is waiting */
+bool XmitQueue::isLaneHead(uint8_t i) {
+    for (uint8_t j = 0; j < XMIT_QUEUE_LEN; j++)
+        if ((usedMask & (1 << j)) && entries[j].dst == entries[i].dst &&
+                (int8_t) (entries[j].seq - entries[i].seq) < 0)
+            return 0;
+
+    return 1;
+}
+
+XmitEntry *XmitQueue::pick(uint16_t now) {
+    XmitEntry *best = NULL;
+    uint8_t bestDist = 0;
+
+    for (uint8_t i = 0; i < XMIT_QUEUE_LEN; i++) {
+        XmitEntry *e = &entries[i];
+        /* How far after the last lane served, the same lane comes last */
+        uint8_t dist = e->dst - lastDst - 1;
+
+        if (!(usedMask & (1 << i)) || !timeReached(e->retryAt, now) ||
+                !isLaneHead(i))
+            continue;
+
+        if (!best || dist < bestDist) {
+            best = e;
+            bestDist = dist;
+        }
+    }
+
+    if (best)
+        lastDst = best->dst;
+    return best;
+}
+
+XmitEntry *XmitQueue::expired(uint16_t now) {
+    for (uint8_t i = 0; i < XMIT_QUEUE_LEN; i++)
+        if ((usedMask & (1 << i)) &&
+                timeReached(entries[i].deadline, now))
+            return &entries[i];
+
+    return NULL;
+}
+
+void XmitQueue::backOff(XmitEntry *e, uint16_t now) {
+    uint8_t shift = e->tries < XMIT_BACKOFF_MAX_SHIFT ?
+        e->tries : XMIT_BACKOFF_MAX_SHIFT;
+
+    e->tries++;
+    e->retryAt = now + (XMIT_BACKOFF_MS << shift);
+}
+
+void XmitQueue::remove(XmitEntry *e) {
+    usedMask &= ~(1 << (e - entries));
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,87 @@
+/*
+ * Outbound radio queue of the Base.  Messages from the server wait here
+ * until the radio is free instead of the serial loop blocking on each
+ * send.  Every destination address is a lane: messages to one node go out
+ * in the order received, lanes take turns, and a lane whose last attempt
+ * failed backs off without holding up the others.  A message that hasn't
+ * been acked by its deadline is dropped.
+ *
+ * The queue only does the bookkeeping, Base::loop() does the sending and
+ * tells the queue how it went.  Times are in milliseconds, 16-bit, so
+ * deadlines can be up to 32s ahead.
+ */
+#ifndef XMIT_QUEUE_H
+#define XMIT_QUEUE_H
+
+#include <stdint.h>
+
+#include "Message.h"
+
+/* Number of messages waiting or being sent, at most 8.  Each entry holds
+ * a whole radio frame, around 90 bytes of RAM on the AVR.
+ */
+#ifndef XMIT_QUEUE_LEN
+#define XMIT_QUEUE_LEN 3
+#endif
+
+/* Messages a single destination may have queued, so that a node that
+ * doesn't ack only fills its own lane and the others keep going.
+ */
+#ifndef XMIT_LANE_MAX
+#define XMIT_LANE_MAX 2
+#endif
+
+/* How long a message may take to get through, retries included */
+#ifndef XMIT_DEADLINE_MS
+#define XMIT_DEADLINE_MS 2000
+#endif
+
+/* Delay before retrying a lane, doubles with every failed attempt */
+#define XMIT_BACKOFF_MS 16
+#define XMIT_BACKOFF_MAX_SHIFT 4
+
+struct XmitEntry {
+    uint8_t raw[MAX_RADIO_MESSAGE_SIZE];
+    uint8_t len;
+    uint8_t dst;
+    uint8_t seq;        /* Order within the lane */
+    uint8_t tries;
+    bool quiet;         /* The Base's own, nobody to tell how it went */
+    uint16_t deadline;
+    uint16_t retryAt;
+};
+
+class XmitQueue {
+public:
+    XmitQueue() : usedMask(0), seq(0), lastDst(0) {}
+
+    /* Copy the @len bytes of Message @raw to the end of its destination's
+     * lane.  @return the entry or NULL if the queue or the lane is full.
+     */
+    XmitEntry *push(const uint8_t *raw, uint8_t len, uint16_t now);
+    /* The first message of the next lane after the one picked last time
+     * that's not backing off, NULL if there's none.
+     */
+    XmitEntry *pick(uint16_t now);
+    /* An entry past its deadline, NULL if there's none */
+    XmitEntry *expired(uint16_t now);
+    /* Put @e back after a failed attempt to be retried later */
+    void backOff(XmitEntry *e, uint16_t now);
+    void remove(XmitEntry *e);
+
+    bool empty(void) { return !usedMask; }
+
+private:
+    XmitEntry entries[XMIT_QUEUE_LEN];
+    uint8_t usedMask, seq, lastDst;
+
+    bool isLaneHead(uint8_t i);
+};
+
+/* True if @time has come at @now */
+static inline bool timeReached(uint16_t time, uint16_t now) {
+    return (int16_t) (now - time) >= 0;
+}
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
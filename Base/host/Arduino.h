@@ -0,0 +1,110 @@
+/*
+ * Just enough of the Arduino core for the Base's Message and Json code to
+ * build on Linux, see BaseLink.h, and for the whole Base firmware, see
+ * gateway.cpp.
+ */
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <avr/pgmspace.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#define DEC 10
+#define HEX 16
+
+/* Pin setup does nothing, the radio's interrupt pin is a socket here */
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+static inline void pinMode(uint8_t pin, uint8_t mode) {}
+#define digitalPinToPCICR(p) (&PCICR)
+#define digitalPinToPCICRbit(p) 0
+#define digitalPinToPCMSK(p) (&PCMSK0)
+#define digitalPinToPCMSKbit(p) 0
+
+static inline unsigned long millis(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline unsigned long micros(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+typedef uint8_t boolean;
+typedef uint8_t byte;
+
+class Print {
+public:
+    virtual size_t write(uint8_t chr) = 0;
+    virtual size_t write(const uint8_t *buf, size_t len) {
+        size_t n = 0;
+
+        while (len--)
+            n += write(*buf++);
+        return n;
+    }
+    size_t write(const char *str) {
+        return write((const uint8_t *) str, strlen(str));
+    }
+    size_t write(const char *buf, size_t len) {
+        return write((const uint8_t *) buf, len);
+    }
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(char chr) { return write((uint8_t) chr); }
+    size_t print(long val, int base = DEC) {
+        char buf[24];
+
+        snprintf(buf, sizeof(buf), base == HEX ? "%lx" : "%ld", val);
+        return write(buf);
+    }
+    size_t print(int val, int base = DEC) { return print((long) val, base); }
+    size_t print(unsigned int val, int base = DEC) {
+        return print((long) val, base);
+    }
+    size_t print(double val, int digits = 2) {
+        char buf[48];
+
+        snprintf(buf, sizeof(buf), "%.*f", digits, val);
+        return write(buf);
+    }
+    size_t println(void) { return write("\r\n"); }
+};
+
+class Stream : public Print {
+public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+    virtual void flush(void) {}
+};
+
+/* A Print writing to a stdio file */
+class FilePrint : public Print {
+public:
+    FilePrint(FILE *file) : f(file) {}
+    size_t write(uint8_t chr) { return fputc(chr, f) == EOF ? 0 : 1; }
+    size_t write(const uint8_t *buf, size_t len) {
+        return fwrite(buf, 1, len, f);
+    }
+    using Print::write;
+
+private:
+    FILE *f;
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
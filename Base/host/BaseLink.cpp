@@ -0,0 +1,105 @@
+/*
+ * Linux side of the Base's binary serial mode, see BaseLink.h.
+ */
+#include "BaseLink.h"
+
+BaseLink::BaseLink(Print &base, Print &json) :
+    base(base), json(json), garbageCnt(0), binary(0) {}
+
+void BaseLink::start(void) {
+    SlipDecoder::writeControl(base, 0);
+}
+
+void BaseLink::putBaseCh(uint8_t chr) {
+    int len;
+
+    /* Anything outside of the frames is the Base's own text */
+    if (chr != SLIP_END && !slip.inFrame()) {
+        json.write(chr);
+        return;
+    }
+
+    len = slip.putch(chr);
+    if (len == SLIP_MORE)
+        return;
+
+    if (len < 0)
+        printError("linkError");
+    else if (len >= HEADERS_LENGTH)
+        frameToJson(slip.getFrame(), len);
+    else if (len == 0)
+        binary = 1;
+    else if (len == 2 && (slip.getFrame()[0] == SLIP_XMIT_OK ||
+                slip.getFrame()[0] == SLIP_ERR_XMIT))
+        MessageJsonConverter::printXmitResult(json, slip.getFrame()[1],
+                slip.getFrame()[0] == SLIP_XMIT_OK, 1);
+    else if (len == 3 && slip.getFrame()[0] == SLIP_RATE_LIMITED)
+        MessageJsonConverter::printRateLimited(json, slip.getFrame()[1],
+                slip.getFrame()[2], 1);
+    else if (slip.getFrame()[0] == SLIP_ERR_XMIT)
+        printError("xmitError");
+    else
+        printError("linkError");
+}
+
+void BaseLink::putJsonCh(uint8_t chr) {
+    conv.putch(chr);
+
+    if (conv.msg) {
+        Message *msg = conv.msg;
+
+        conv.msg = NULL;
+        if (!(msg->getType() == Message::REQUEST && conv.cachedOk &&
+                    valueCache.answer(json, *msg, 1)))
+            SlipDecoder::write(base, msg->getRawData(), msg->getRawLength());
+        msg->release();
+    } else if (conv.error) {
+        printError(conv.error);
+        conv.error = NULL;
+    } else if (conv.statsRequest) {
+        /* Only the Base has them.  It answers in Json, the text is passed
+         * on like any outside the frames, then goes back to binary mode.
+         */
+        base.write("{\"type\":\"stats\"}");
+        start();
+        conv.statsRequest = 0;
+    }
+}
+
+/* Same as what Base::loop() does with the radio frames in Json mode */
+void BaseLink::frameToJson(const uint8_t *frame, int len) {
+    MessageView msg(frame, len);
+    Message::Type type = msg.getType();
+    bool garbage = type == Message::GARBAGE ||
+        type > Message::PUBLISH_BATCH;
+    int resyncSvc;
+
+    if (garbage && garbageCnt < 3) {
+        garbageCnt++;
+        garbage = false;
+    } else if (!garbage)
+        garbageCnt = 0;
+
+    if (garbage)
+        return;
+
+    resyncSvc = MessageJsonConverter::printFrame(json, msg, deltaCache, 1,
+            &valueCache);
+
+    /* The Base leaves the keyframe REQUEST to us in binary mode */
+    if (resyncSvc >= 0) {
+        Message req(0, msg.getSrcAddress());
+
+        req.setType(Message::REQUEST);
+        req.addIntValue(Data::SERVICE_ID, resyncSvc);
+        SlipDecoder::write(base, req.getRawData(), req.getRawLength());
+    }
+}
+
+void BaseLink::printError(const char *err) {
+    json.write("{\"error\":\"");
+    json.write(err);
+    json.write("\"}\r\n");
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,49 @@
+/*
+ * Server side of the Base's binary serial mode (see SlipFrame.h) for
+ * Linux hosts.  BaseLink sits between the Base's serial port and a server
+ * that speaks the Base's Json protocol: it switches the Base to binary
+ * mode and does the Message <-> Json conversion that the Base does in Json
+ * mode, with the same MessageJsonConverter and DeltaCache code, so the
+ * server sees exactly the same text, and answers "cachedOk" REQUESTs from
+ * its own ValueCache.  Bytes the Base sends outside of frames, e.g. before
+ * it has switched or when it panics, are passed on as they are.
+ */
+#ifndef BASE_LINK_H
+#define BASE_LINK_H
+
+#include <Arduino.h>
+
+#include "../MessageJsonConverter.h"
+#include "../SlipFrame.h"
+#include "../ValueCache.h"
+
+class BaseLink {
+public:
+    /* Frames for the Base get written to @base, the Json text to @json */
+    BaseLink(Print &base, Print &json);
+
+    /* Ask the Base to switch to binary mode, can be repeated any time */
+    void start(void);
+    /* True once the Base has acknowledged the switch */
+    bool isBinary(void) { return binary; }
+
+    /* Feed the next byte read from the Base */
+    void putBaseCh(uint8_t chr);
+    /* Feed the next byte of Json text from the server */
+    void putJsonCh(uint8_t chr);
+
+private:
+    Print &base, &json;
+    SlipDecoder slip;
+    MessageJsonConverter conv;
+    DeltaCache deltaCache;
+    ValueCache valueCache;
+    uint8_t garbageCnt;
+    bool binary;
+
+    void frameToJson(const uint8_t *frame, int len);
+    void printError(const char *err);
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,123 @@
+/*
+ * Uart (see ../Uart.h) of the host build of the Base, see gateway.cpp:
+ * the master side of a pseudo-terminal.  The slave side's name is printed on start
+ * and, if BASE_PTY is set in the environment, a symlink with that name
+ * points to it, e.g. BASE_PTY=/tmp/base lets the server or bridge.cpp
+ * open /tmp/base instead of /dev/ttyUSB0.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <avr/sleep.h>
+
+#include "../Uart.h"
+
+Uart uart;
+
+Uart::Uart() : errors(0), fd(-1) {}
+
+void Uart::begin(unsigned long baud) {
+    struct termios tio;
+    const char *name, *link;
+    int slave;
+
+    /* Sensorino::die() calls begin() again */
+    if (fd >= 0)
+        return;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) || unlockpt(fd) || !(name = ptsname(fd))) {
+        perror("pty");
+        exit(1);
+    }
+
+    /* Raw mode like a real UART.  Keep the slave open so that reads
+     * don't fail with EIO while the server has it closed.
+     */
+    slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave < 0 || tcgetattr(slave, &tio)) {
+        perror(name);
+        exit(1);
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    link = getenv("BASE_PTY");
+    if (link) {
+        unlink(link);
+        if (symlink(name, link))
+            perror(link);
+    }
+    fprintf(stderr, "Serial port at %s\n", link ?: name);
+
+    hostWakeOn(fd);
+}
+
+/* There's no interrupt, this is called before looking at the ring.  The
+ * kernel buffers what doesn't fit, no overflows here.
+ */
+void Uart::rxInterrupt(void) {
+    uint8_t buf[UART_RX_RING_SIZE];
+    ssize_t len;
+
+    if (fd < 0 || !rx.space())
+        return;
+
+    len = ::read(fd, buf, rx.space());
+    for (ssize_t i = 0; i < len; i++)
+        rx.put(buf[i]);
+}
+
+int Uart::available(void) {
+    rxInterrupt();
+    return rx.count();
+}
+
+int Uart::read(void) {
+    return available() ? rx.get() : -1;
+}
+
+int Uart::peek(void) {
+    return available() ? rx.peek() : -1;
+}
+
+void Uart::flush(void) {
+}
+
+void Uart::getStats(Stats &stats) {
+    stats.overflows = rx.overflows;
+    stats.errors = errors;
+}
+
+size_t Uart::write(uint8_t chr) {
+    return write(&chr, 1);
+}
+
+size_t Uart::write(const uint8_t *data, size_t len) {
+    size_t done = 0;
+    uint16_t wait = 0;
+
+    /* Block like the AVR's polled Tx does, but a UART never stalls for
+     * long even with nobody listening, drop the rest if the server
+     * hasn't read anything for 100ms.
+     */
+    while (fd >= 0 && done < len) {
+        ssize_t ret = ::write(fd, data + done, len - done);
+
+        if (ret > 0) {
+            done += ret;
+            wait = 0;
+        } else if ((ret < 0 && errno != EAGAIN) || ++wait > 1000)
+            break;
+        else
+            usleep(100);
+    }
+
+    return done;
+}
+
+/* vim: set sw=4 ts=4 et: */
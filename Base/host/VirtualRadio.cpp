@@ -0,0 +1,146 @@
+/*
+ * Virtual radio for the host build of the Base (see gateway.cpp), takes
+ * the place of mini-radiohead.cpp behind the same mini-radiohead.h API.
+ * Every nRF24 payload is a UDP datagram on the loopback interface and
+ * every node address has its own port, VRADIO_PORT (environment,
+ * default 24100) plus the address.  Nodes, or loadgen.cpp pretending to
+ * be nodes, just bind their port.  There are no acks but a datagram
+ * sent to a port that nobody has bound bounces back as an ICMP port
+ * unreachable, which a connected socket reports as ECONNREFUSED, so a
+ * send fails the way it would to a node that's asleep or out of range.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <avr/sleep.h>
+
+#include "mini-radiohead.h"
+
+/* nRF24L01+ payload size, fragments never exceed it */
+#define VRADIO_PAYLOAD_MAX 32
+#define VRADIO_DEFAULT_PORT 24100
+
+static int sock = -1, txSock = -1;
+static int8_t txResult;
+
+static void addrToSockaddr(uint8_t addr, struct sockaddr_in *sa) {
+    const char *port = getenv("VRADIO_PORT");
+
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa->sin_port = htons((port ? atoi(port) : VRADIO_DEFAULT_PORT) + addr);
+}
+
+/* Listen on @addr's port, keeping the same descriptor number so that
+ * hostSleep() still watches it after setThisAddress().
+ */
+static bool listenOn(uint8_t addr) {
+    struct sockaddr_in sa;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    addrToSockaddr(addr, &sa);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &sa, sizeof(sa))) {
+        perror("radio");
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    if (sock < 0) {
+        sock = fd;
+        hostWakeOn(sock);
+    } else {
+        dup2(fd, sock);
+        close(fd);
+    }
+
+    return 1;
+}
+
+RH_NRF24::RH_NRF24(uint8_t chipEnablePin, uint8_t slaveSelectPin) {
+}
+
+RHReliableDatagram::RHReliableDatagram(RHGenericDriver &driver,
+        uint8_t thisAddress) {
+    addr = thisAddress;
+}
+
+bool RHReliableDatagram::init() {
+    return listenOn(addr);
+}
+
+void RHReliableDatagram::setThisAddress(uint8_t new_addr) {
+    addr = new_addr;
+    listenOn(addr);
+}
+
+bool RHReliableDatagram::available() {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+
+    return sock >= 0 && poll(&pfd, 1, 0) > 0;
+}
+
+void RHReliableDatagram::sendtoStart(const uint8_t *buf, uint8_t len,
+        uint8_t trailer, uint8_t address) {
+    uint8_t payload[VRADIO_PAYLOAD_MAX];
+    struct sockaddr_in sa;
+
+    txResult = RH_TX_FAILED;
+    if (len >= VRADIO_PAYLOAD_MAX)
+        return;
+
+    if (txSock < 0)
+        txSock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    memcpy(payload, buf, len);
+    payload[len] = trailer;
+    addrToSockaddr(address, &sa);
+    if (!connect(txSock, (struct sockaddr *) &sa, sizeof(sa)) &&
+            send(txSock, payload, len + 1, 0) == len + 1)
+        txResult = RH_TX_PENDING;
+}
+
+/* The port unreachable arrives as soon as the datagram hits loopback */
+int8_t RHReliableDatagram::sendtoPoll() {
+    uint8_t chr;
+
+    if (txResult == RH_TX_PENDING)
+        txResult = recv(txSock, &chr, 1, MSG_DONTWAIT) < 0 &&
+            errno == ECONNREFUSED ? RH_TX_FAILED : RH_TX_OK;
+
+    return txResult;
+}
+
+bool RHReliableDatagram::sendtoWait(uint8_t *buf, uint8_t len,
+        uint8_t address) {
+    /* The last byte goes in as the trailer */
+    return len && sendtoWait(buf, len - 1, buf[len - 1], address);
+}
+
+bool RHReliableDatagram::sendtoWait(const uint8_t *buf, uint8_t len,
+        uint8_t trailer, uint8_t address) {
+    sendtoStart(buf, len, trailer, address);
+    return sendtoPoll() == RH_TX_OK;
+}
+
+bool RHReliableDatagram::recvfromAck(uint8_t *buf, uint8_t *len,
+        uint8_t *from, uint8_t *to, uint8_t *id, uint8_t *flags) {
+    ssize_t ret = recv(sock, buf, VRADIO_PAYLOAD_MAX, 0);
+
+    if (ret < 0)
+        return 0;
+
+    *len = ret;
+    return 1;
+}
+
+/* vim: set sw=4 ts=4 et: */
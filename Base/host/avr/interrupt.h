@@ -0,0 +1,20 @@
+/*
+ * Linux stand-in for avr-libc's interrupt.h.  There are no interrupts on
+ * the host, the status register only gets saved and restored and the
+ * handlers are plain functions nobody calls, see sleep.h for how the
+ * Base still wakes up.
+ */
+#ifndef HOST_INTERRUPT_H
+#define HOST_INTERRUPT_H
+
+#include <stdint.h>
+
+static uint8_t SREG __attribute__((unused));
+#define cli()
+#define sei()
+
+#define ISR(vector, ...) void vector(void)
+#define EMPTY_INTERRUPT(vector) void vector(void) {}
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
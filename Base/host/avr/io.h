@@ -0,0 +1,22 @@
+/*
+ * Linux stand-in for avr-libc's io.h, just the registers the Base writes
+ * during setup.  They're plain variables, nothing reads them back.
+ */
+#ifndef HOST_IO_H
+#define HOST_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+static uint8_t WDTCSR __attribute__((unused));
+#define WDCE 4
+#define WDE 3
+
+static uint8_t PCMSK0 __attribute__((unused));
+static uint8_t PCMSK1 __attribute__((unused));
+static uint8_t PCMSK2 __attribute__((unused));
+static uint8_t PCICR __attribute__((unused));
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
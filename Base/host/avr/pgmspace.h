@@ -0,0 +1,30 @@
+/*
+ * Linux stand-in for avr-libc's pgmspace.h, program memory is just memory.
+ */
+#ifndef HOST_PGMSPACE_H
+#define HOST_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+typedef char prog_char;
+
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+#define pgm_read_word(addr) (*(const uint16_t *) (addr))
+#define pgm_read_dword(addr) (*(const uint32_t *) (addr))
+#define pgm_read_float(addr) (*(const float *) (addr))
+
+#define memcpy_P memcpy
+#define memcmp_P memcmp
+#define strncmp_P strncmp
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strcmp_P strcmp
+#define strcasecmp_P strcasecmp
+#define strlen_P strlen
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,17 @@
+/*
+ * Linux stand-in for avr-libc's sleep.h.  What wakes the CPU on the
+ * ATmega are the UART, radio and timer interrupts, on the host
+ * sleep_cpu() blocks until one of the file descriptors that the Uart and
+ * the virtual radio registered with hostWakeOn() is readable or a tick
+ * has passed.
+ */
+#ifndef HOST_SLEEP_H
+#define HOST_SLEEP_H
+
+void hostWakeOn(int fd);
+void hostSleep(void);
+
+#define sleep_cpu() hostSleep()
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
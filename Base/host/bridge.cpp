@@ -0,0 +1,128 @@
+/*
+ * Serial bridge for Linux hosts: talks to the Base in binary mode over
+ * the serial port given on the command line and to the server in Json
+ * over stdin / stdout, see BaseLink.h.  For example to use it in place of
+ * the serial port with a server that reads and writes a pty:
+ * socat PTY,link=/tmp/base,raw EXEC:"./bridge /dev/ttyUSB0"
+ *
+ * Built by the Makefile here.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "BaseLink.h"
+#include "../../Sensorino/Sensorino.h"
+
+/* Message.cpp references these */
+void Sensorino::die(const prog_char *err) {
+    fprintf(stderr, "Panic because: %s\n", err);
+    exit(2);
+}
+
+bool Sensorino::sendMessage(Message &m) {
+    return 0;
+}
+
+Sensorino *sensorino;
+
+class FdPrint : public Print {
+public:
+    FdPrint(int fd) : fd(fd) {}
+    size_t write(uint8_t chr) { return write(&chr, 1); }
+    size_t write(const uint8_t *buf, size_t len) {
+        size_t done = 0;
+
+        while (done < len) {
+            ssize_t ret = ::write(fd, buf + done, len - done);
+
+            if (ret <= 0)
+                return done;
+            done += ret;
+        }
+        return done;
+    }
+    using Print::write;
+
+private:
+    int fd;
+};
+
+static int openSerial(const char *path) {
+    struct termios tio;
+    int fd = open(path, O_RDWR | O_NOCTTY);
+
+    if (fd < 0 || tcgetattr(fd, &tio)) {
+        perror(path);
+        exit(1);
+    }
+
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    if (tcsetattr(fd, TCSANOW, &tio)) {
+        perror(path);
+        exit(1);
+    }
+
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    struct pollfd fds[2];
+    int serialFd;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <serial-port>\n", argv[0]);
+        return 1;
+    }
+
+    serialFd = openSerial(argv[1]);
+
+    FdPrint base(serialFd), json(1);
+    BaseLink link(base, json);
+
+    link.start();
+
+    fds[0].fd = serialFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = 0;
+    fds[1].events = POLLIN;
+
+    /* The Base may have missed the first request while rebooting, keep
+     * asking every second until it switches.
+     */
+    while (1) {
+        uint8_t buf[256];
+        ssize_t len;
+
+        if (poll(fds, 2, link.isBinary() ? -1 : 1000) < 0) {
+            perror("poll");
+            return 1;
+        }
+
+        if (!link.isBinary())
+            link.start();
+
+        if (fds[0].revents) {
+            len = read(serialFd, buf, sizeof(buf));
+            if (len <= 0)
+                return 1;
+            for (ssize_t i = 0; i < len; i++)
+                link.putBaseCh(buf[i]);
+        }
+
+        if (fds[1].revents) {
+            len = read(0, buf, sizeof(buf));
+            if (len <= 0)
+                return 0;
+            for (ssize_t i = 0; i < len; i++)
+                link.putJsonCh(buf[i]);
+        }
+    }
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,64 @@
+/*
+ * The Base firmware built for Linux, for profiling the gateway path and
+ * running it next to the server without hardware.  Base.cpp runs
+ * unmodified on top of a pseudo-terminal for its UART, see Uart.cpp, and
+ * a UDP based radio, see VirtualRadio.cpp.  loadgen.cpp drives it with
+ * recorded traffic.  For example:
+ * BASE_PTY=/tmp/base ./gateway &
+ * ./loadgen /tmp/base sample.trace
+ *
+ * Built by the Makefile here.  Traces replayed at full speed exceed the
+ * nodes' PUBLISH rate limit (see RateLimit.h), build with
+ * CPPFLAGS=-DRATE_LIMIT_INTERVAL_MS=0 to measure the raw path.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <avr/sleep.h>
+
+#include "Base.h"
+#include "../../Sensorino/Sensorino.h"
+
+/* The "interrupt sources" sleep_cpu() waits on */
+#define WAKE_FDS_MAX 4
+
+/* The ATmega's timer interrupt also ends the sleep, every millisecond,
+ * so that timed work gets done.  A coarser tick does here.
+ */
+#define HOST_TICK_MS 100
+
+static struct pollfd wakeFds[WAKE_FDS_MAX];
+static int wakeFdsNum;
+
+void hostWakeOn(int fd) {
+    if (wakeFdsNum == WAKE_FDS_MAX) {
+        fprintf(stderr, "Too many wake-up sources\n");
+        exit(1);
+    }
+
+    wakeFds[wakeFdsNum].fd = fd;
+    wakeFds[wakeFdsNum++].events = POLLIN;
+}
+
+void hostSleep(void) {
+    if (poll(wakeFds, wakeFdsNum, HOST_TICK_MS) < 0) {
+        perror("poll");
+        exit(1);
+    }
+}
+
+/* Message.cpp references this, the Base never sends through it */
+bool Sensorino::sendMessage(Message &m) {
+    return 0;
+}
+
+Sensorino *sensorino;
+
+int main(int argc, char **argv) {
+    Base::setup();
+
+    while (1)
+        Base::loop();
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,331 @@
+/*
+ * Load generator for the host build of the Base, see gateway.cpp.  Plays
+ * the server on the Base's serial port and the nodes on the virtual
+ * radio (VirtualRadio.cpp) and replays a trace, one message at a time,
+ * timing how long the Base takes to pass each one on.  Then reports the
+ * message rate and latency distribution for each direction.
+ *
+ * Each line of the trace is one of:
+ *  json <object>  sent by the server, done when the Base reports that
+ *                 the node in "to" acked the Message, or an error,
+ *  radio <hex>    a raw Message sent by a node, done when the Base has
+ *                 written the Json line,
+ *  # comment
+ * see sample.trace.  Built by the Makefile here.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Same as in VirtualRadio.cpp and FragmentedDatagram.h */
+#define VRADIO_DEFAULT_PORT 24100
+#define FRAG_PAYLOAD_MAX 27
+#define FRAG_CONTINUE_FLAG 0x80
+
+/* Longer than the Base's XMIT_DEADLINE_MS */
+#define TIMEOUT_MS 3000
+#define LINE_MAX 2048
+
+enum { KIND_JSON, KIND_RADIO, KIND_NUM };
+
+struct Entry {
+    uint8_t kind;
+    uint8_t to;         /* Node expected to receive a json entry */
+    uint16_t len;
+    uint8_t *data;
+};
+
+struct Stats {
+    uint32_t *us;       /* Latency of every message answered */
+    uint32_t count, lost;
+};
+
+static int serialFd, txSock, nodeSock[256];
+static uint16_t basePort = VRADIO_DEFAULT_PORT;
+static char lineBuf[LINE_MAX];
+static int lineLen;
+
+static uint64_t nowUs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void addrToSockaddr(uint8_t addr, struct sockaddr_in *sa) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa->sin_port = htons(basePort + addr);
+}
+
+/* Pretend to be node @addr on the virtual radio */
+static void listenAsNode(uint8_t addr) {
+    struct sockaddr_in sa;
+    int fd;
+
+    if (nodeSock[addr])
+        return;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    addrToSockaddr(addr, &sa);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &sa, sizeof(sa))) {
+        perror("node socket");
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    nodeSock[addr] = fd;
+}
+
+static int hexDigit(char chr) {
+    if (chr >= '0' && chr <= '9')
+        return chr - '0';
+    if (chr >= 'a' && chr <= 'f')
+        return chr - 'a' + 10;
+    if (chr >= 'A' && chr <= 'F')
+        return chr - 'A' + 10;
+    return -1;
+}
+
+static bool parseEntry(char *line, Entry &e) {
+    char *end = line + strlen(line);
+
+    while (end > line && (end[-1] == '\n' || end[-1] == '\r'))
+        *--end = '\0';
+
+    if (!strncmp(line, "json ", 5)) {
+        const char *to = strstr(line, "\"to\"");
+
+        e.kind = KIND_JSON;
+        e.len = end - line - 5;
+        e.data = (uint8_t *) strdup(line + 5);
+        if (!to || !(to = strchr(to, ':')))
+            return 0;
+        e.to = atoi(to + 1);
+        listenAsNode(e.to);
+        return 1;
+    }
+
+    if (!strncmp(line, "radio ", 6)) {
+        e.kind = KIND_RADIO;
+        e.len = 0;
+        e.data = (uint8_t *) malloc((end - line) / 2);
+        for (line += 6; line[0] && line[1]; line += 2) {
+            if (hexDigit(line[0]) < 0 || hexDigit(line[1]) < 0)
+                return 0;
+            e.data[e.len++] = hexDigit(line[0]) << 4 | hexDigit(line[1]);
+        }
+        return e.len >= 4 && !*line;
+    }
+
+    return 0;
+}
+
+/* Send like FragmentedDatagram::sendtoWait() does, to the Base */
+static void sendRadio(const uint8_t *buf, uint16_t len) {
+    static uint8_t msgId;
+    struct sockaddr_in sa;
+    uint8_t frag[FRAG_PAYLOAD_MAX + 1];
+
+    addrToSockaddr(0, &sa);
+    while (len) {
+        uint8_t fragLen = len < FRAG_PAYLOAD_MAX ? len : FRAG_PAYLOAD_MAX;
+
+        len -= fragLen;
+        memcpy(frag, buf, fragLen);
+        frag[fragLen] = (msgId++ & ~FRAG_CONTINUE_FLAG) |
+            (len ? FRAG_CONTINUE_FLAG : 0);
+        sendto(txSock, frag, fragLen + 1, 0,
+                (struct sockaddr *) &sa, sizeof(sa));
+        buf += fragLen;
+    }
+}
+
+/* Bit 1 << kind is set once a whole line came from the Base that answers
+ * an entry of that kind: an ack or an error for a json entry, anything
+ * else for a radio entry.
+ */
+static int readSerial(void) {
+    char buf[256];
+    ssize_t len = read(serialFd, buf, sizeof(buf));
+    int done = 0;
+
+    for (ssize_t i = 0; i < len; i++) {
+        if (buf[i] == '\n') {
+            bool status;
+
+            lineBuf[lineLen] = '\0';
+            status = !strncmp(lineBuf, "{\"ack\"", 6) ||
+                !strncmp(lineBuf, "{\"error\"", 8);
+            done |= 1 << (status ? KIND_JSON : KIND_RADIO);
+            lineLen = 0;
+        } else if (lineLen < LINE_MAX - 1)
+            lineBuf[lineLen++] = buf[i];
+    }
+
+    return done;
+}
+
+/* Drop whatever node @addr received, its ack is what counts */
+static void readRadio(uint8_t addr) {
+    uint8_t buf[64];
+
+    while (recv(nodeSock[addr], buf, sizeof(buf), 0) > 0);
+}
+
+/* Send @e and wait for the Base to pass it on */
+static bool replay(const Entry &e) {
+    uint64_t deadline = nowUs() + TIMEOUT_MS * 1000;
+    struct pollfd fds[2];
+    int nfds = 1;
+
+    fds[0].fd = serialFd;
+    fds[0].events = POLLIN;
+    if (e.kind == KIND_JSON) {
+        fds[1].fd = nodeSock[e.to];
+        fds[1].events = POLLIN;
+        nfds = 2;
+        if (write(serialFd, e.data, e.len) != e.len)
+            return 0;
+    } else
+        sendRadio(e.data, e.len);
+
+    while (1) {
+        int64_t left = deadline - nowUs();
+
+        if (left <= 0 || poll(fds, nfds, left / 1000 + 1) <= 0)
+            return 0;
+
+        if ((fds[0].revents & POLLIN) && (readSerial() & (1 << e.kind)))
+            return 1;
+        if (nfds > 1 && (fds[1].revents & POLLIN))
+            readRadio(e.to);
+    }
+}
+
+static int cmpU32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, Stats &s) {
+    uint64_t sum = 0;
+
+    if (!s.count && !s.lost)
+        return;
+
+    printf("%-5s %8u sent %6u lost", name, s.count + s.lost, s.lost);
+    if (s.count) {
+        qsort(s.us, s.count, sizeof(*s.us), cmpU32);
+        for (uint32_t i = 0; i < s.count; i++)
+            sum += s.us[i];
+        printf("  latency us: min %u avg %u p50 %u p99 %u max %u",
+                s.us[0], (uint32_t) (sum / s.count), s.us[s.count / 2],
+                s.us[s.count * 99 / 100], s.us[s.count - 1]);
+    }
+    printf("\n");
+}
+
+static int openSerial(const char *path) {
+    struct termios tio;
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+    if (fd < 0 || tcgetattr(fd, &tio)) {
+        perror(path);
+        exit(1);
+    }
+
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    tcsetattr(fd, TCSANOW, &tio);
+
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    Entry *entries = NULL;
+    Stats stats[KIND_NUM];
+    int num = 0, repeat = 1;
+    const char *port = getenv("VRADIO_PORT");
+    char line[LINE_MAX];
+    uint64_t start, elapsed;
+    FILE *trace;
+
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        repeat = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc != 3 || repeat < 1) {
+        fprintf(stderr, "Usage: %s [-n <repeat>] <serial-port> <trace>\n",
+                argv[0]);
+        return 1;
+    }
+
+    if (port)
+        basePort = atoi(port);
+    serialFd = openSerial(argv[1]);
+    txSock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    trace = fopen(argv[2], "r");
+    if (!trace) {
+        perror(argv[2]);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), trace)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        entries = (Entry *) realloc(entries, (num + 1) * sizeof(*entries));
+        if (!parseEntry(line, entries[num])) {
+            fprintf(stderr, "Bad trace line %i: %s\n", num + 1, line);
+            return 1;
+        }
+        num++;
+    }
+    fclose(trace);
+
+    for (int k = 0; k < KIND_NUM; k++) {
+        stats[k].us = (uint32_t *) malloc(num * repeat * sizeof(uint32_t));
+        stats[k].count = stats[k].lost = 0;
+    }
+
+    /* Skip whatever the Base printed before we started */
+    while (readSerial());
+    for (int addr = 0; addr < 256; addr++)
+        if (nodeSock[addr])
+            readRadio(addr);
+
+    start = nowUs();
+    for (int r = 0; r < repeat; r++)
+        for (int i = 0; i < num; i++) {
+            Stats &s = stats[entries[i].kind];
+            uint64_t sent = nowUs();
+
+            if (replay(entries[i]))
+                s.us[s.count++] = nowUs() - sent;
+            else
+                s.lost++;
+        }
+    elapsed = nowUs() - start;
+
+    printf("%i messages in %.3fs, %.1f messages/s\n", num * repeat,
+            elapsed / 1e6, num * repeat * 1e6 / elapsed);
+    report("json", stats[KIND_JSON]);
+    report("radio", stats[KIND_RADIO]);
+
+    return 0;
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,19 @@
+/*
+ * Linux stand-in for avr-libc's util/crc16.h, only the CRC-CCITT that
+ * the SLIP framing uses.  Same code as the avr-libc C version.
+ */
+#ifndef HOST_CRC16_H
+#define HOST_CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data) {
+    data ^= crc & 0xff;
+    data ^= data << 4;
+
+    return (((uint16_t) data << 8) | (crc >> 8)) ^ (uint8_t) (data >> 4) ^
+        ((uint16_t) data << 3);
+}
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
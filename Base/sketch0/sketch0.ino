@@ -1,4 +1,3 @@
-#include <aJSON.h>
 //#include <RadioHead.h>
 //#include <SPI.h>
 #include <Base.h>
@@ -2,6 +2,7 @@
 
 #include "Service.h"
 #include "Timers.h"
+#include "WorkQueue.h"
 
 using namespace Data;
 
@@ -35,13 +36,13 @@ protected:
         msg->send();
     }
 
-    virtual void onRequest(Message *message) {
+    virtual void onRequest(MessageView *message) {
         Type req;
 
         /* If the request has no DataType value, or it's asking for the
          * VOLTAGE value, just send the last voltage measured.
          */
-        if (!message->find(DATATYPE, 0, &req) || req == VOLTAGE) {
+        if (!message->get<DATATYPE>(0, req) || req == VOLTAGE) {
             publishValue();
             return;
         }
@@ -69,7 +70,21 @@ protected:
         publishValue();
     }
 
+    /* Top half, runs from the timer interrupt.  The sampling busy-waits
+     * and the PUBLISH goes out on the radio, leave both to sampleWork().
+     * Should the queue be full try again a little later.
+     */
     void getSample(void) {
+        if (!WorkQueue::schedule(sampleWork, this))
+            Timers::setObjTimeout(ADCService::getSample, 1);
+    }
+
+    /* Bottom half, runs from WorkQueue::run() */
+    static void sampleWork(void *arg) {
+        ((ADCService *) arg)->takeSample();
+    }
+
+    void takeSample(void) {
         uint8_t i;
 
         if (sampleCount == 0)
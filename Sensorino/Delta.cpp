@@ -0,0 +1,171 @@
+/*
+ * Delta coding of PUBLISH payloads, see Delta.h.
+ */
+#include <string.h>
+
+#include "Delta.h"
+
+using namespace Data;
+
+/* Room needed on top of the original payload for the DELTA_REF element
+ * and for deltas that end up longer than the absolute values.
+ */
+#define DELTA_OVERHEAD (4 + 2 * DELTA_MAX_VALUES)
+
+/* Deltas must fit in 3 bytes just like the absolute values */
+#define FITS_FIXED(v) ((v) >= -0x800000L && (v) < 0x800000L)
+
+bool DeltaValues::load(MessageView &m, MessageView::iter i, bool oneGroup) {
+    count = 0;
+
+    for (bool first = 1; i; m.iterAdvance(i), first = 0) {
+        Type t;
+        int32_t value;
+
+        m.iterGetTypeValue(i, &t, NULL);
+        if (oneGroup && t == SERVICE_ID && !first)
+            break;
+
+        if (!MessageView::getFixedScale(t))
+            continue;
+
+        if (count >= DELTA_MAX_VALUES || !m.iterGetFixedValue(i, &value)) {
+            count = DELTA_INVALID;
+            return 0;
+        }
+
+        types[count] = t;
+        units[count++] = value;
+    }
+
+    return 1;
+}
+
+bool DeltaValues::sameTypes(const DeltaValues &other) {
+    return count == other.count && count != DELTA_INVALID &&
+        !memcmp(types, other.types, count);
+}
+
+void DeltaEncoder::encode(MessageView &in, Message &out) {
+    MessageView::iter i = in.begin(), next;
+    const uint8_t *raw = in.getRawData();
+    bool delta;
+    uint8_t k = 0;
+
+    if (in.getRawLength() + DELTA_OVERHEAD <= MAX_MESSAGE_SIZE)
+        pending.load(in, i, false);
+    else
+        pending.count = DELTA_INVALID;
+
+    delta = pending.sameTypes(ref) && sinceKeyframe < interval;
+    for (; delta && k < pending.count; k++)
+        delta = FITS_FIXED(pending.units[k] - ref.units[k]);
+    sinceKeyframe = delta ? sinceKeyframe + 1 : 0;
+
+    for (k = 0; i; i = next) {
+        int32_t units;
+        Type t;
+
+        next = i;
+        in.iterAdvance(next);
+
+        in.iterGetTypeValue(i, &t, NULL);
+        if (delta && in.iterGetFixedValue(i, &units))
+            out.addFixedValue(t, units - ref.units[k++]);
+        else {
+            /* Copy the element as is */
+            int len = (next ?: in.getRawLength()) - i;
+
+            memcpy(out.getWriteBuffer(), raw + i, len);
+            out.writeLength(len);
+        }
+
+        /* The reference goes right after the SERVICE_ID */
+        if (i == in.begin() && pending.count != DELTA_INVALID)
+            out.addIntValue(DELTA_REF, delta ? ref.id : DELTA_KEYFRAME);
+    }
+}
+
+void DeltaEncoder::sent(uint8_t frameId, bool acked) {
+    /* The Base may or may not have received it, keep using the old
+     * reference, the Base remembers both.
+     */
+    if (!acked)
+        return;
+
+    ref = pending;
+    ref.id = frameId;
+}
+
+int DeltaCache::resolve(MessageView &m, MessageView::iter i, bool oneGroup,
+        DeltaValues &abs) {
+    MessageView::iter j = i;
+    Entry *e, *entry = NULL;
+    DeltaValues *ref = NULL;
+    int svcId, refId;
+    Type t;
+
+    /* Delta coded groups start with SERVICE_ID, DELTA_REF */
+    if (!i || (m.getType() != Message::PUBLISH &&
+                m.getType() != Message::PUBLISH_BATCH))
+        return 0;
+
+    m.iterGetTypeValue(i, &t, &svcId);
+    if (t != SERVICE_ID)
+        return 0;
+
+    m.iterAdvance(j);
+    if (!j)
+        return 0;
+    m.iterGetTypeValue(j, &t, &refId);
+    if (t != DELTA_REF)
+        return 0;
+
+    /* Find the service's entry, or else a free or the least recently
+     * used one.
+     */
+    for (e = entries; e < entries + DELTA_CACHE_SIZE; e++) {
+        if (e->used && e->addr == m.getSrcAddress() && e->svcId == svcId)
+            break;
+
+        if (!entry || (entry->used && (!e->used ||
+                        (uint8_t) (clock - e->used) >
+                        (uint8_t) (clock - entry->used))))
+            entry = e;
+    }
+
+    if (e < entries + DELTA_CACHE_SIZE)
+        entry = e;
+    else {
+        entry->addr = m.getSrcAddress();
+        entry->svcId = svcId;
+        entry->cur.count = DELTA_INVALID;
+        entry->prev.count = DELTA_INVALID;
+    }
+    entry->used = ++clock ?: ++clock;
+
+    if (!abs.load(m, i, oneGroup))
+        return -1;
+
+    if (refId != DELTA_KEYFRAME) {
+        if (entry->cur.count != DELTA_INVALID && entry->cur.id == refId)
+            ref = &entry->cur;
+        else if (entry->prev.count != DELTA_INVALID &&
+                entry->prev.id == refId)
+            ref = &entry->prev;
+
+        if (!ref || !ref->sameTypes(abs))
+            return -1;
+
+        for (uint8_t k = 0; k < abs.count; k++)
+            abs.units[k] += ref->units[k];
+    }
+
+    abs.id = m.getId();
+    entry->prev = entry->cur;
+    entry->cur = abs;
+
+    return 1;
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,100 @@
+/*
+ * Delta coding of PUBLISH payloads.  A Service that has delta coding
+ * enabled (see Service::setDeltaCoding()) sends its "fixed" coded values
+ * (see DATATYPE_LIST_APPLY) as differences against the values of its
+ * last PUBLISH that the Base has acknowledged.  A DELTA_REF element right
+ * after the SERVICE_ID carries the Message id of that reference frame,
+ * or DELTA_KEYFRAME if the values in the group are absolute and start a
+ * new reference.  All other elements are sent as they are.
+ *
+ * The node sends a keyframe every few PUBLISHes, whenever the values
+ * can't be delta coded and when the service receives a REQUEST.  The Base
+ * remembers the last two references per service so that a lost ACK
+ * doesn't break the chain.  If it doesn't know the reference it sends a
+ * REQUEST to the service which makes the node send a new keyframe.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+
+#include "Message.h"
+
+/* Max number of "fixed" coded values in one delta coded PUBLISH */
+#define DELTA_MAX_VALUES 4
+
+/* Number of services whose references the Base remembers */
+#ifndef DELTA_CACHE_SIZE
+#define DELTA_CACHE_SIZE 4
+#endif
+
+/* DELTA_REF value for absolute values */
+#define DELTA_KEYFRAME -1
+
+/* DeltaValues::count when there are no usable values */
+#define DELTA_INVALID 0xff
+
+/* The "fixed" coded values of one PUBLISH in the order of appearance */
+struct DeltaValues {
+    uint8_t id;
+    uint8_t count;
+    uint8_t types[DELTA_MAX_VALUES];
+    int32_t units[DELTA_MAX_VALUES];
+
+    DeltaValues() : count(DELTA_INVALID) {}
+
+    /* Collect the values from the group starting at @i, ending at the
+     * next SERVICE_ID if @oneGroup is set.  @return zero if there are
+     * too many or some were sent as floats.
+     */
+    bool load(MessageView &m, MessageView::iter i, bool oneGroup);
+    bool sameTypes(const DeltaValues &other);
+};
+
+/* Node side, one per Service using delta coding */
+class DeltaEncoder {
+public:
+    DeltaEncoder(uint8_t keyframeInterval) :
+        interval(keyframeInterval), sinceKeyframe(0) {}
+
+    /* Write the on-air version of @in's payload into @out, which should
+     * contain only the header.
+     */
+    void encode(MessageView &in, Message &out);
+    /* To be called with the frame that carried the last encode()d
+     * payload, once it's known whether the Base got it.
+     */
+    void sent(uint8_t frameId, bool acked);
+    /* Make the next PUBLISH a keyframe */
+    void reset(void) { ref.count = DELTA_INVALID; }
+
+private:
+    DeltaValues ref, pending;
+    uint8_t interval, sinceKeyframe;
+};
+
+/* Base side, remembers the references of the last few services seen */
+class DeltaCache {
+public:
+    DeltaCache() : clock(0) {}
+
+    /* Work out the absolute values of the group starting at @i in @m.
+     * @return 0 if the group is not delta coded, 1 if @abs now contains
+     * the values, or -1 if the reference is not known and the service
+     * needs to be sent a REQUEST.
+     */
+    int resolve(MessageView &m, MessageView::iter i, bool oneGroup,
+            DeltaValues &abs);
+
+private:
+    struct Entry {
+        uint8_t addr;
+        uint8_t svcId;
+        uint8_t used;
+        DeltaValues cur, prev;
+    } entries[DELTA_CACHE_SIZE];
+    uint8_t clock;
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -1,3 +1,13 @@
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include <math.h>
+
+#include "SensorinoUtils.h"
+
+#define IS_TRUE(flt) (flt > 0.5f)
+#define IS_ZERO(flt) ((flt) < EPSILON && -(flt) < EPSILON)
+
 namespace Expression {
     enum Op {
         VAL_INT8,
@@ -27,6 +37,54 @@ namespace Expression {
         OP_IFELSE,
         OP_BETWEEN,
     };
+
+    /* The binary operators' results.  Evaluation is JavaScript-like,
+     * everything is a float and NaN operands give NaN.  The rule
+     * evaluator and the Base's constant folding both use these so that
+     * folding never changes a rule's result.
+     */
+    static inline float evalBinary(uint8_t op, float op1, float op2) {
+        float diff = op1 - op2;
+
+        if (isnan(diff))
+            return NAN;
+
+        switch (op) {
+        case OP_EQ:
+            return IS_ZERO(diff);
+        case OP_NE:
+            return !IS_ZERO(diff);
+        case OP_GT:
+            return diff > EPSILON;
+        case OP_LE:
+            return !(diff > EPSILON);
+        case OP_LT:
+            return diff < -EPSILON;
+        case OP_GE:
+            return !(diff < -EPSILON);
+        case OP_OR:
+            return IS_TRUE(op1) || IS_TRUE(op2);
+        case OP_AND:
+            return IS_TRUE(op1) && IS_TRUE(op2);
+        case OP_ADD:
+            return op1 + op2;
+        case OP_SUB:
+            return diff;
+        case OP_MULT:
+            return op1 * op2;
+        case OP_DIV:
+            return op1 / op2;
+        }
+
+        return NAN;
+    }
+
+    static inline float evalBetween(float val, float lim1, float lim2) {
+        if (lim1 < lim2)
+            return val > lim1 && val < lim2;
+        else
+            return val > lim2 && val < lim1;
+    }
 }
 
 /* Helper macros for inline expressions */
@@ -50,3 +108,6 @@ namespace Expression {
     op, subexpr0, subexpr1, subexpr2
 
 #define DEF_IN(num, params) OP_IN, num, params
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
@@ -6,30 +6,65 @@ public:
 
 #define FRAG_CONTINUE_FLAG	0x80
 	bool sendtoWait(uint8_t *buf, uint8_t len, uint8_t address) {
+#ifndef RH_HAVE_SENDTO_TRAILER
 		uint8_t fragBuf[fragMax];
-		uint8_t fragLen;
+#endif
+		uint8_t fragLen, trailer;
 
 		while (len) {
 			fragLen = len < fragMax - 1 ? len : (fragMax - 1);
 			len -= fragLen;
 
-			/* Fragment header */
-			memcpy(fragBuf, buf, fragLen);
-			fragBuf[fragLen] = msgId++;
+			/* Fragment trailer */
+			trailer = msgId++;
 			if (len)
-				fragBuf[fragLen] |= FRAG_CONTINUE_FLAG;
+				trailer |= FRAG_CONTINUE_FLAG;
 			else
-				fragBuf[fragLen] &= ~FRAG_CONTINUE_FLAG;
+				trailer &= ~FRAG_CONTINUE_FLAG;
 
-			buf += fragLen;
+#ifdef RH_HAVE_SENDTO_TRAILER
+			/* The driver streams the slice straight from @buf */
+			if (!T::sendtoWait(buf, fragLen, trailer, address))
+				return 0;
+#else
+			memcpy(fragBuf, buf, fragLen);
+			fragBuf[fragLen] = trailer;
 
 			if (!T::sendtoWait(fragBuf, fragLen + 1, address))
 				return 0;
+#endif
+
+			buf += fragLen;
 		}
 
 		return 1;
 	}
 
+#ifdef RH_HAVE_SENDTO_START
+	/* Non-blocking sendtoWait(): sendStart() uploads the first fragment,
+	 * sendPoll() starts each next one as the previous one is acked and
+	 * returns RH_TX_PENDING until the whole datagram is sent (RH_TX_OK)
+	 * or a fragment isn't acked (RH_TX_FAILED).  @buf must stay
+	 * untouched until then and nothing else may be sent.
+	 */
+	void sendStart(const uint8_t *buf, uint8_t len, uint8_t address) {
+		txBuf = buf;
+		txLen = len;
+		txAddr = address;
+		sendNextFragment();
+	}
+
+	int8_t sendPoll(void) {
+		int8_t ret = T::sendtoPoll();
+
+		if (ret != RH_TX_OK || !txLen)
+			return ret;
+
+		sendNextFragment();
+		return RH_TX_PENDING;
+	}
+#endif
+
 	bool recvfromAck(uint8_t *buf, uint8_t *len, uint8_t *from = NULL,
 			uint8_t *to = NULL, uint8_t *id = NULL,
 			uint8_t *flags = NULL) {
@@ -80,4 +115,23 @@ public:
 
 protected:
 	uint8_t msgId;
+
+#ifdef RH_HAVE_SENDTO_START
+	const uint8_t *txBuf;
+	uint8_t txLen, txAddr;
+
+	void sendNextFragment(void) {
+		uint8_t fragLen = txLen < fragMax - 1 ? txLen : (fragMax - 1);
+		uint8_t trailer = msgId++;
+
+		txLen -= fragLen;
+		if (txLen)
+			trailer |= FRAG_CONTINUE_FLAG;
+		else
+			trailer &= ~FRAG_CONTINUE_FLAG;
+
+		T::sendtoStart(txBuf, fragLen, trailer, txAddr);
+		txBuf += fragLen;
+	}
+#endif
 };
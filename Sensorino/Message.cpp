@@ -28,61 +28,159 @@ enum BERClass {
 const uint8_t extendedType = BER_APPLICATION | 0b011111;
 #endif
 
-#define NAME_PGM_STR(x, y, Camel, z) \
+#define NAME_PGM_STR(x, y, Camel, z, scale) \
     const char glue(Camel, _pgm_name)[] PROGMEM = #Camel;
 DATATYPE_LIST_APPLY(NAME_PGM_STR)
 
 using namespace Data;
 
-static const struct TypeInfo {
-    Data::Type val;
+/*
+ * Type metadata lookups are generated from DATATYPE_LIST_APPLY as switch
+ * statements which the compiler turns into jump tables indexed by the
+ * type value, so no table scanning and no shared buffers are involved.
+ */
+const char *MessageView::dataTypeToString(Data::Type type,
+        CodingType *coding) {
     const prog_char *name;
-    Message::CodingType coding;
-} typeTable[] PROGMEM = {
-#define TYPEINFO_INITIALISER(intval, CAPS, Camel, coding) \
-    { CAPS, glue(Camel, _pgm_name), Message::glue(coding, Coding) },
-DATATYPE_LIST_APPLY(TYPEINFO_INITIALISER)
-    { (Data::Type) __INT_MAX__, NULL,
-        (enum Message::CodingType) -1 }, /* Sentinel */
-};
+    CodingType c;
+
+    switch (type) {
+#define TYPEINFO_CASE(intval, CAPS, Camel, coding, scale) \
+    case CAPS: \
+        name = glue(Camel, _pgm_name); \
+        c = Message::glue(coding, Coding); \
+        break;
+DATATYPE_LIST_APPLY(TYPEINFO_CASE)
+    default:
+        return NULL;
+    }
+
+    if (coding)
+        *coding = c;
+
+    return name;
+}
 
-#define pgm_read_enum(addr) ((int) pgm_read_word(addr))
-#define pgm_read_cptr(addr) ((const char *) pgm_read_word(addr))
+/*
+ * Only compare the full names of types whose name length and initial
+ * (case-insensitively) match, which is at most two for the current
+ * type list.
+ */
+Data::Type MessageView::stringToDataType(const char *str) {
+    uint8_t len = strlen(str);
+
+#define NAME_MATCH(intval, CAPS, Camel, coding, scale) \
+    if (len == sizeof(#Camel) - 1 && (str[0] | 0x20) == (#Camel[0] | 0x20) && \
+            !strcasecmp_P(str, glue(Camel, _pgm_name))) \
+        return CAPS;
+DATATYPE_LIST_APPLY(NAME_MATCH)
+
+    return (Data::Type) __INT_MAX__;
+}
+
+uint16_t MessageView::getFixedScale(Data::Type type) {
+    switch (type) {
+#define FIXED_SCALE_int(CAPS, scale)
+#define FIXED_SCALE_bool(CAPS, scale)
+#define FIXED_SCALE_float(CAPS, scale)
+#define FIXED_SCALE_binary(CAPS, scale)
+#define FIXED_SCALE_fixed(CAPS, scale) \
+    case CAPS: \
+        return scale;
+#define FIXED_SCALE_CASE(intval, CAPS, Camel, coding, scale) \
+    glue(FIXED_SCALE_, coding)(CAPS, scale)
+DATATYPE_LIST_APPLY(FIXED_SCALE_CASE)
+    default:
+        return 0;
+    }
+}
 
-/* Note: non-threadsafe */
-static TypeInfo typeInfoBuf;
-static const struct TypeInfo *getTypeInfo(Data::Type type) {
-    const struct TypeInfo PROGMEM *i = typeTable;
+/* Decode a 1 to 4 byte big-endian signed value, "int" or "fixed" coded.
+ * The bytes are put together unsigned and sign-extended at the end, left
+ * shifts of negative values are undefined.
+ */
+static int32_t decodeSigned(const uint8_t *value, uint8_t len) {
+    uint32_t val = 0, sign = (uint32_t) 0x80 << (len - 1) * 8;
+
+    while (len--)
+        val = val << 8 | *value++;
 
-    while (type > pgm_read_enum(&i->val))
-        i++;
+    if (val & sign)
+        val |= -(sign << 1);
 
-    memcpy_P(&typeInfoBuf, i, sizeof(typeInfoBuf));
-    return type == typeInfoBuf.val ? &typeInfoBuf : NULL;
+    return (int32_t) val;
 }
 
-const char *Message::dataTypeToString(Data::Type type, CodingType *coding) {
-    const struct TypeInfo *i = getTypeInfo(type);
+/*
+ * Read a BER definite length at @pos and move @pos past it.  The short
+ * form is a single byte below 0x80, the long form is 0x80 | n followed by
+ * n bytes of big-endian length, we only need n of 1 or 2.  For anything
+ * else, including the indefinite form, return a length that overruns any
+ * message so that callers' bounds checks reject the element.
+ */
+template<typename Pos>
+static inline int readLength(const uint8_t *raw, Pos &pos) {
+    int len = raw[pos++];
+
+    if (likely(len < 0x80))
+        return len;
 
-    if (coding && i)
-        *coding = i->coding;
+    if (len == 0x81)
+        return raw[pos++];
+
+    if (len == 0x82) {
+        len = raw[pos++] << 8;
+        return len | raw[pos++];
+    }
 
-    return i ? i->name : NULL;
+    return MAX_MESSAGE_SIZE;
 }
 
-Data::Type Message::stringToDataType(const char *str) {
-    const struct TypeInfo PROGMEM *i = typeTable;
+MessageView::MessageView(const uint8_t *raw, int len) {
+    MessageView::raw = raw;
+    rawLen = len;
+    start = HEADERS_LENGTH;
+    dropIndex();
+
+    if (len > HEADERS_LENGTH + PAYLOAD_LENGTH || len < HEADERS_LENGTH) {
+        /* Show as an empty GARBAGE message, see Message() */
+        static const uint8_t garbage[HEADERS_LENGTH] = { 0, 0, GARBAGE, 0 };
+
+        MessageView::raw = garbage;
+        rawLen = HEADERS_LENGTH;
+    }
+}
+
+MessageView::MessageView(const MessageView &outer,
+        const BinaryValue &payload) {
+    raw = outer.raw;
+    start = payload.value - outer.raw;
+    rawLen = start + payload.len;
+    dropIndex();
+}
 
-    while (pgm_read_enum(&i->val) < __INT_MAX__ &&
-            strcasecmp_P(str, pgm_read_cptr(&i->name)))
-        i++;
+MessageView::MessageView(const MessageView &m) :
+        raw(m.raw), rawLen(m.rawLen), start(m.start) {
+    dropIndex();
+}
 
-    return (Data::Type) pgm_read_enum(&i->val);
+MessageView &MessageView::operator=(const MessageView &m) {
+    raw = m.raw;
+    rawLen = m.rawLen;
+    start = m.start;
+    dropIndex();
+    return *this;
 }
 
 uint8_t Message::staticId;
 
 Message::Message(uint8_t src, uint8_t dst) {
+    init(src, dst);
+}
+
+void Message::init(uint8_t src, uint8_t dst) {
+    raw = buf;
+
     staticId++;
     if (staticId >= MAX_MESSAGE_ID)
         staticId -= MAX_MESSAGE_ID;
@@ -92,9 +190,13 @@ Message::Message(uint8_t src, uint8_t dst) {
     setDstAddress(dst);
 
     rawLen = HEADERS_LENGTH;
+    dropIndex();
 }
 
 Message::Message(const uint8_t *raw, int len) {
+    MessageView::raw = buf;
+    dropIndex();
+
     if (len > HEADERS_LENGTH + PAYLOAD_LENGTH || len < HEADERS_LENGTH) {
         /* Can't Sensorino::die here because this may be a network error */
         rawLen = HEADERS_LENGTH;
@@ -103,83 +205,288 @@ Message::Message(const uint8_t *raw, int len) {
     }
 
     rawLen = len;
-    for (len = 0; len < rawLen; len++)
-        Message::raw[len] = raw[len];
+    memcpy(buf, raw, len);
 }
 
 Message::Message() {
+    raw = buf;
     setType(GARBAGE);
     rawLen = 0;
+    dropIndex();
+}
+
+/* The base class' pointer must keep pointing at our own buffer */
+Message::Message(const Message &m) : MessageView(m) {
+    raw = buf;
+    memcpy(buf, m.buf, sizeof(buf));
+}
+
+Message &Message::operator=(const Message &m) {
+    MessageView::operator=(m);
+    raw = buf;
+    memcpy(buf, m.buf, sizeof(buf));
+    return *this;
+}
+
+/*
+ * Outgoing messages come from a small static pool rather than the heap so
+ * that publishing never has to call malloc and can't fragment the few
+ * bytes of RAM we have.  A bit set in poolMask marks a slot as taken.
+ */
+static Message pool[MESSAGE_POOL_SIZE];
+static Message discard;
+
+uint8_t Message::poolMask;
+uint8_t Message::keepMask;
+Message::PoolStats Message::poolStats;
+
+Message *Message::alloc(uint8_t src, uint8_t dst) {
+    Message *m = NULL;
+    uint8_t sreg, i;
+
+    sreg = SREG;
+    cli();
+
+    for (i = 0; i < MESSAGE_POOL_SIZE; i++)
+        if (!(poolMask & (1 << i)))
+            break;
+
+    if (likely(i < MESSAGE_POOL_SIZE)) {
+        poolMask |= 1 << i;
+        m = &pool[i];
+
+        if (++poolStats.inUse > poolStats.peak)
+            poolStats.peak = poolStats.inUse;
+    } else
+        poolStats.exhausted++;
+
+    SREG = sreg;
+
+    if (m)
+        m->init(src, dst);
+    return m;
+}
+
+Message *Message::allocOrDiscard(uint8_t src, uint8_t dst) {
+    Message *m = alloc(src, dst);
+
+    if (unlikely(!m)) {
+        uint8_t sreg = SREG;
+
+        cli();
+        poolStats.discarded++;
+        SREG = sreg;
+
+        m = &discard;
+        m->init(src, dst);
+    }
+
+    return m;
+}
+
+void Message::release(void) {
+    uint8_t sreg, i;
+
+    /* Messages on the stack or elsewhere are not ours to free */
+    if (this < pool || this >= pool + MESSAGE_POOL_SIZE)
+        return;
+    i = this - pool;
+
+    sreg = SREG;
+    cli();
+
+    if (keepMask & (1 << i))
+        keepMask &= ~(1 << i);
+    else if (poolMask & (1 << i)) {
+        poolMask &= ~(1 << i);
+        poolStats.inUse--;
+    }
+
+    SREG = sreg;
+}
+
+bool Message::keep(void) {
+    uint8_t sreg;
+
+    if (this < pool || this >= pool + MESSAGE_POOL_SIZE)
+        return 0;
+
+    sreg = SREG;
+    cli();
+    keepMask |= 1 << (this - pool);
+    SREG = sreg;
+
+    return 1;
+}
+
+const Message::PoolStats &Message::getPoolStats(void) {
+    return poolStats;
 }
 
 bool Message::send(void) {
-    bool ret = sensorino->sendMessage(*this);
+    bool ret = false;
 
-    /* This is a bit of a hack, we can probably do this in a callback set
-     * by whoever allocated this message (e.g. Service::startBaseMessage) */
-    delete this;
+    /* The pool was exhausted when this was allocated, drop it */
+    if (likely(this != &discard))
+        ret = sensorino->sendMessage(*this);
+
+    release();
 
     return ret;
 }
 
-uint8_t Message::getId(){
+uint8_t MessageView::getId(){
     return raw[3];
 }
 
 void Message::setId(uint8_t i){
-    raw[3] = i;
+    buf[3] = i;
 }
 
-uint8_t Message::getSrcAddress() {
+uint8_t MessageView::getSrcAddress() {
     return raw[0];
 }
 
 void Message::setSrcAddress(uint8_t addr) {
-    raw[0] = addr;
+    buf[0] = addr;
 }
 
-uint8_t Message::getDstAddress() {
+uint8_t MessageView::getDstAddress() {
     return raw[1];
 }
 
 void Message::setDstAddress(uint8_t addr) {
-    raw[1] = addr;
+    buf[1] = addr;
 }
 
-Message::Type Message::getType(void){
-    return (Message::Type) raw[2];
+MessageView::Type MessageView::getType(void){
+    return (MessageView::Type) raw[2];
 }
 
 void Message::setType(Message::Type t){
-    raw[2] = t;
+    buf[2] = t;
 }
 
-const uint8_t *Message::getRawData(void) {
+const uint8_t *MessageView::getRawData(void) {
     return raw;
 }
 
-int Message::getRawLength(void) {
+int MessageView::getRawLength(void) {
     return rawLen;
 }
 
 uint8_t *Message::getWriteBuffer(void) {
-    return raw + rawLen;
+    return buf + rawLen;
 }
 
 void Message::writeLength(int len) {
     rawLen += len;
+    dropIndex();
 }
 
 /* For now use the handcrafted macros to avoid dependency on the big table */
 #define BOOL_TYPE(t) (t == PRESENCE || t == SWITCH)
-#define INT_TYPE(t) (t == DATATYPE || t == COUNT || t == SERVICE_ID)
+#define INT_TYPE(t) (t == DATATYPE || t == COUNT || t == SERVICE_ID || \
+        t == DELTA_REF)
 #define FLOAT_TYPE(t) (t >= ACCELERATION && t < COUNT)
 #define BINARY_TYPE(t) (t == EXPRESSION || t == MESSAGE)
 
-int Message::find(Data::Type t, int num, void *value) {
-    int pos = HEADERS_LENGTH, len;
+int MessageView::find(Data::Type t, int num, void *value) {
+    int pos = locate(t, num);
+
+    return pos && decode(t, pos, value);
+}
+
+/*
+ * The rule engine resolving the variables of a PUBLISH, the Base's value
+ * cache and the like look up several TLVs of one message, walking the
+ * BER chain from the start for each is quadratic.  Instead the second
+ * lookup in a row on the same view indexes the whole payload.  Entries
+ * are sorted by type, in payload order within a type, and slot[] hashes a
+ * type to its first entry so that the @num'th TLV of a type is found in a
+ * probe or two.
+ *
+ * There's only one index, for the last view looked into twice, so that
+ * the RAM cost doesn't grow with the number of messages.  Appending to a
+ * message changes its length, which makes the index stale.  Any other
+ * change to the payload and any view constructed over the same object
+ * drop it, see dropIndex().  An interrupt handler that looks into a
+ * message while the index is in use scans the payload instead.
+ */
+#define INDEX_SLOTS 16          /* Power of 2, >= MESSAGE_INDEX_SIZE */
+#define INDEX_TOO_BIG 0xff      /* Payload has too many TLVs, scan it */
+
+static struct {
+    const MessageView *view;    /* Whose payload is indexed, or NULL */
+    const MessageView *last;    /* The view of the last lookup */
+    msglen_t len;               /* view's rawLen when it was indexed */
+    uint8_t count;
+    bool busy;
+    uint8_t type[MESSAGE_INDEX_SIZE];   /* 0xff if it doesn't fit */
+    msglen_t pos[MESSAGE_INDEX_SIZE];   /* Of the length byte */
+    uint8_t slot[INDEX_SLOTS];  /* First entry of a type plus one */
+} tlvIndex;
+
+void MessageView::dropIndex(void) {
+    if (tlvIndex.view == this)
+        tlvIndex.view = NULL;
+    if (tlvIndex.last == this)
+        tlvIndex.last = NULL;
+}
+
+/* @return the position of the length byte of the @num'th TLV of type @t
+ * or 0 if there's no such TLV.
+ */
+int MessageView::locate(Data::Type t, int num) {
+    uint8_t h, i, e;
+    int pos = 0;
+
+    if (unlikely(tlvIndex.busy))
+        return scan(t, num);
+    tlvIndex.busy = 1;
+
+    if (tlvIndex.view != this || tlvIndex.len != rawLen) {
+        if (tlvIndex.last != this && tlvIndex.view != this) {
+            tlvIndex.last = this;
+            tlvIndex.busy = 0;
+            return scan(t, num);
+        }
+
+        buildIndex();
+    }
+
+    if (unlikely(tlvIndex.count == INDEX_TOO_BIG ||
+                (unsigned int) t >= 0xff)) {
+        tlvIndex.busy = 0;
+        return scan(t, num);
+    }
+
+    for (i = 0, h = t; i < INDEX_SLOTS; i++, h++) {
+        e = tlvIndex.slot[h & (INDEX_SLOTS - 1)];
+        if (!e)
+            break;
+
+        if (tlvIndex.type[--e] == t) {
+            if ((unsigned int) num < (unsigned int) tlvIndex.count - e &&
+                    tlvIndex.type[e + num] == t)
+                pos = tlvIndex.pos[e + num];
+            break;
+        }
+    }
+
+    tlvIndex.busy = 0;
+    return pos;
+}
+
+void MessageView::buildIndex(void) {
+    uint8_t n = 0, i, h;
+    int pos = start, len;
     unsigned int tval;
 
+    tlvIndex.view = this;
+    tlvIndex.len = rawLen;
+    tlvIndex.count = INDEX_TOO_BIG;
+
     while (pos < rawLen - 2) {
 #ifdef BER_COMPAT
         if (raw[pos++] != extendedType)
@@ -194,65 +501,194 @@ int Message::find(Data::Type t, int num, void *value) {
             }
             tval |= raw[pos++];
         }
+        if (tval > 0xff)
+            tval = 0xff;
+
+        if (n == MESSAGE_INDEX_SIZE)
+            return;
+
+        /* Insertion sort, after the TLVs of the same type seen so far */
+        for (i = n++; i && tlvIndex.type[i - 1] > tval; i--) {
+            tlvIndex.type[i] = tlvIndex.type[i - 1];
+            tlvIndex.pos[i] = tlvIndex.pos[i - 1];
+        }
+        tlvIndex.type[i] = tval;
+        tlvIndex.pos[i] = pos;
+
+        /* A bad long form length ends the walk, same as in scan() */
+        len = readLength(raw, pos);
+        if (len > rawLen - pos)
+            break;
+        pos += len;
+    }
+
+    memset(tlvIndex.slot, 0, sizeof(tlvIndex.slot));
+    for (i = 0; i < n; i++) {
+        if (i && tlvIndex.type[i] == tlvIndex.type[i - 1])
+            continue;
+
+        for (h = tlvIndex.type[i]; tlvIndex.slot[h & (INDEX_SLOTS - 1)]; h++);
+        tlvIndex.slot[h & (INDEX_SLOTS - 1)] = i + 1;
+    }
+    tlvIndex.count = n;
+}
+
+/* Walk the TLVs from the start of the payload, see locate() */
+int MessageView::scan(Data::Type t, int num) {
+    const uint8_t *p = raw;
+    int pos = start, end = rawLen, len;
+    unsigned int tval;
+
+    while (pos < end - 2) {
+#ifdef BER_COMPAT
+        if (p[pos++] != extendedType)
+            tval = -1;
+        else
+#endif
+        {
+            tval = 0;
+            while (p[pos] & 0x80 && pos < end - 2) {
+                tval |= p[pos++] & 0x7f;
+                tval <<= 7;
+            }
+            tval |= p[pos++];
+        }
         if ((Data::Type) tval != t || num--) {
-            /* Skip this TLV */
-            len = raw[pos++];
+            /* Skip this TLV, a bad long form length ends the walk */
+            len = readLength(p, pos);
+            if (len > end - pos)
+                break;
             pos += len;
             continue;
         }
 
-        len = raw[pos++];
-#define CHECK_LENGTH(n) (pos + n > HEADERS_LENGTH + PAYLOAD_LENGTH || \
-        len < n)
+        return pos;
+    }
+
+    return 0;
+}
 
-        /* Is this type serialised as a boolean, int, float or binary? */
-        if (!value) {
-            /* Nothing to do */
-        } else if (BOOL_TYPE(t)) {
-            int bool_val;
+/* Decode the value of a TLV of type @t whose length byte is at @pos */
+int MessageView::decode(Data::Type t, int pos, void *value) {
+    int len = readLength(raw, pos);
 
-            if (CHECK_LENGTH(1))
-                return 0;
+#define CHECK_LENGTH(n) (pos + n > rawLen || len < n)
 
-            bool_val = raw[pos] != 0;
-            *(bool *) value = bool_val;
-        } else if (FLOAT_TYPE(t)) {
-            uint32_t float_val;
+    /* Is this type serialised as a boolean, int, float or binary? */
+    if (!value) {
+        /* Nothing to do */
+    } else if (BOOL_TYPE(t)) {
+        int bool_val;
 
-            if (CHECK_LENGTH(4))
-                return 0;
+        if (CHECK_LENGTH(1))
+            return 0;
 
-            float_val = raw[pos++];
-            float_val |= (uint16_t) raw[pos++] << 8;
-            float_val |= (uint32_t) raw[pos++] << 16;
-            float_val |= (uint32_t) raw[pos++] << 24;
-            *(uint32_t *) value = float_val;
-        } else if (INT_TYPE(t)) {
-            int int_val;
+        bool_val = raw[pos] != 0;
+        *(bool *) value = bool_val;
+    } else if (FLOAT_TYPE(t) && len < 4) {
+        /* Scaled fixed-point, no fallback for other float types */
+        uint16_t scale = getFixedScale(t);
 
-            if (len < 1 || CHECK_LENGTH(len))
-                return 0;
+        if (len < 1 || !scale || CHECK_LENGTH(len))
+            return 0;
 
-            int_val = (int8_t) raw[pos++]; /* Sign-extend */
-            while (--len) {
-                int_val <<= 8;
-                int_val |= raw[pos++];
-            }
-            *(int *) value = int_val;
-        } else if (BINARY_TYPE(t)) {
-            if (CHECK_LENGTH(len))
-                return 0;
+        *(float *) value = (float) decodeSigned(raw + pos, len) / scale;
+    } else if (FLOAT_TYPE(t)) {
+        uint32_t float_val;
 
-            ((BinaryValue *) value)->value = raw + pos;
-            ((BinaryValue *) value)->len = len;
-        }
+        if (CHECK_LENGTH(4))
+            return 0;
+
+        float_val = raw[pos++];
+        float_val |= (uint16_t) raw[pos++] << 8;
+        float_val |= (uint32_t) raw[pos++] << 16;
+        float_val |= (uint32_t) raw[pos++] << 24;
+        memcpy(value, &float_val, sizeof(float));
+    } else if (INT_TYPE(t)) {
+        if (len < 1 || len > 4 || CHECK_LENGTH(len))
+            return 0;
+
+        *(int *) value = decodeSigned(raw + pos, len);
+    } else if (BINARY_TYPE(t)) {
+        if (CHECK_LENGTH(len))
+            return 0;
+
+        ((BinaryValue *) value)->value = raw + pos;
+        ((BinaryValue *) value)->len = len;
+    }
+
+    return 1;
+}
+
+/* Typed versions of decode() for get<T>(), the coding is known from the
+ * argument type so only the lengths need checking.
+ */
+int MessageView::decodeValue(int pos, int &value) {
+    int len = readLength(raw, pos);
+
+    if (len < 1 || len > 4 || CHECK_LENGTH(len))
+        return 0;
+
+    value = decodeSigned(raw + pos, len);
+    return 1;
+}
+
+int MessageView::decodeValue(int pos, Data::Type &value) {
+    int val;
+
+    if (!decodeValue(pos, val))
+        return 0;
 
+    value = (Data::Type) val;
+    return 1;
+}
+
+int MessageView::decodeValue(int pos, bool &value) {
+    int len = readLength(raw, pos);
+
+    if (CHECK_LENGTH(1))
+        return 0;
+
+    value = raw[pos] != 0;
+    return 1;
+}
+
+int MessageView::decodeValue(int pos, float &value, uint16_t scale) {
+    int len = readLength(raw, pos);
+    uint32_t float_val;
+
+    if (len < 4) {
+        if (len < 1 || !scale || CHECK_LENGTH(len))
+            return 0;
+
+        value = (float) decodeSigned(raw + pos, len) / scale;
         return 1;
     }
 
-    return 0;
+    if (CHECK_LENGTH(4))
+        return 0;
+
+    float_val = raw[pos++];
+    float_val |= (uint16_t) raw[pos++] << 8;
+    float_val |= (uint32_t) raw[pos++] << 16;
+    float_val |= (uint32_t) raw[pos++] << 24;
+    memcpy(&value, &float_val, sizeof(value));
+    return 1;
+}
+
+int MessageView::decodeValue(int pos, BinaryValue &value) {
+    int len = readLength(raw, pos);
+
+    if (CHECK_LENGTH(len))
+        return 0;
+
+    value.value = raw + pos;
+    value.len = len;
+    return 1;
 }
 
+#undef CHECK_LENGTH
+
 void Message::checkIntegrity(void) {
     if (unlikely(rawLen > HEADERS_LENGTH + PAYLOAD_LENGTH)) {
         /* We should stop adding stuff or we'll crash */
@@ -281,6 +717,41 @@ static uint8_t appendTypePart(uint8_t *buffer, Data::Type t) {
     return ret;
 }
 
+/* Same as below for up to 3 bytes of a "fixed" coded value */
+static uint8_t appendFixedValuePart(uint8_t *buffer, int32_t value) {
+    uint8_t len, ret;
+    int32_t i = value >> 7;
+
+    for (len = 1; i && ~i; len++, i >>= 8);
+    ret = len;
+
+    while (len--) {
+        buffer[len] = value;
+        value >>= 8;
+    }
+
+    return ret;
+}
+
+/* BER definite length, see readLength() */
+static uint8_t appendLengthPart(uint8_t *buffer, int len) {
+    if (likely(len < 0x80)) {
+        buffer[0] = len;
+        return 1;
+    }
+
+    if (len < 0x100) {
+        buffer[0] = 0x81;
+        buffer[1] = len;
+        return 2;
+    }
+
+    buffer[0] = 0x82;
+    buffer[1] = len >> 8;
+    buffer[2] = len;
+    return 3;
+}
+
 static uint8_t appendIntValuePart(uint8_t *buffer, int value) {
     uint8_t len, ret;
     int i = value >> 7;
@@ -298,28 +769,58 @@ static uint8_t appendIntValuePart(uint8_t *buffer, int value) {
 
 void Message::addIntValue(Data::Type t, int value){
     /* Type */
-    rawLen += appendTypePart(raw + rawLen, t);
+    rawLen += appendTypePart(buf + rawLen, t);
 
     /* Len + Value */
-    int length = appendIntValuePart(raw + rawLen + 1, value);
-    raw[rawLen] = length;
+    int length = appendIntValuePart(buf + rawLen + 1, value);
+    buf[rawLen] = length;
     rawLen += 1 + length;
 
     checkIntegrity();
 }
 
 void Message::addFloatValue(Data::Type t, float value){
+    addScaledValue(t, value, getFixedScale(t));
+}
+
+void Message::addScaledValue(Data::Type t, float value, uint16_t scale) {
+    /* Fixed-point values are rounded to the nearest unit, whatever would
+     * take 4 bytes, including NaNs, is sent as a float so that the length
+     * tells the two codings apart.
+     */
+    if (scale) {
+        float scaled = value * scale;
+
+        if (scaled > -8388608.0f && scaled < 8388607.5f) {
+            addFixedValue(t, scaled + (scaled < 0 ? -0.5f : 0.5f));
+            return;
+        }
+    }
+
     /* Type */
-    rawLen += appendTypePart(raw + rawLen, t);
+    rawLen += appendTypePart(buf + rawLen, t);
 
     /* Len + Value */
-    raw[rawLen++] = 4;
+    buf[rawLen++] = 4;
 
-    uint32_t d = *(uint32_t *) &value;
-    raw[rawLen++] = d >> 0;
-    raw[rawLen++] = d >> 8;
-    raw[rawLen++] = d >> 16;
-    raw[rawLen++] = d >> 24;
+    uint32_t d;
+    memcpy(&d, &value, sizeof(d));
+    buf[rawLen++] = d >> 0;
+    buf[rawLen++] = d >> 8;
+    buf[rawLen++] = d >> 16;
+    buf[rawLen++] = d >> 24;
+
+    checkIntegrity();
+}
+
+void Message::addFixedValue(Data::Type t, int32_t units) {
+    /* Type */
+    rawLen += appendTypePart(buf + rawLen, t);
+
+    /* Len + Value */
+    int length = appendFixedValuePart(buf + rawLen + 1, units);
+    buf[rawLen] = length;
+    rawLen += 1 + length;
 
     checkIntegrity();
 }
@@ -330,27 +831,54 @@ void Message::addDataTypeValue(Data::Type t) {
 
 void Message::addBoolValue(Data::Type t, bool value) {
     /* Type */
-    rawLen += appendTypePart(raw + rawLen, t);
+    rawLen += appendTypePart(buf + rawLen, t);
 
     /* Len + Value */
-    raw[rawLen++] = 1;
-    raw[rawLen++] = !!value;
+    buf[rawLen++] = 1;
+    buf[rawLen++] = !!value;
 
     checkIntegrity();
 }
 
-void Message::addBinaryValue(Data::Type t, const uint8_t *value, uint8_t len) {
+void Message::addBinaryValue(Data::Type t, const uint8_t *value,
+        msglen_t len) {
     /* Type */
-    rawLen += appendTypePart(raw + rawLen, t);
+    rawLen += appendTypePart(buf + rawLen, t);
 
     /* Len + Value */
-    raw[rawLen++] = len;
-    memcpy(raw + rawLen, value, len);
+    rawLen += appendLengthPart(buf + rawLen, len);
+    memcpy(buf + rawLen, value, len);
     rawLen += len;
 
     checkIntegrity();
 }
 
+msglen_t Message::beginBinaryValue(Data::Type t) {
+    /* Type */
+    rawLen += appendTypePart(buf + rawLen, t);
+
+    /* Len, a short form placeholder */
+    buf[rawLen++] = 0;
+
+    checkIntegrity();
+    return rawLen;
+}
+
+void Message::endBinaryValue(msglen_t start) {
+    int len = rawLen - start;
+    uint8_t lenLen = len < 0x80 ? 1 : len < 0x100 ? 2 : 3;
+
+    /* Make room for a long form length */
+    if (unlikely(lenLen > 1)) {
+        rawLen += lenLen - 1;
+        checkIntegrity();
+        memmove(buf + start + lenLen - 1, buf + start, len);
+    }
+
+    appendLengthPart(buf + start - 1, len);
+    dropIndex();
+}
+
 #define int(...)
 #define bool(...)
 #define float(CAPS_NAME, CamelName) \
@@ -362,19 +890,22 @@ void Message::glue(add, CamelName)(float val) { \
 void Message::glue(add, CamelName)(int val) { \
     addFloatValue(CAPS_NAME, val); \
 }
+#define fixed(CAPS_NAME, CamelName) float(CAPS_NAME, CamelName)
 #define binary(...)
-#define FLOAT_INT_ACCESSOR_IMPL(intval, CAPS, Camel, coding) coding(CAPS, Camel)
+#define FLOAT_INT_ACCESSOR_IMPL(intval, CAPS, Camel, coding, scale) \
+    coding(CAPS, Camel)
 DATATYPE_LIST_APPLY(FLOAT_INT_ACCESSOR_IMPL)
 #undef binary
+#undef fixed
 #undef float
 #undef bool
 #undef int
 
-Message::iter Message::begin() {
-    return rawLen > HEADERS_LENGTH ? HEADERS_LENGTH : 0;
+MessageView::iter MessageView::begin() {
+    return rawLen > start ? start : 0;
 }
 
-void Message::iterAdvance(Message::iter &i) {
+void MessageView::iterAdvance(MessageView::iter &i) {
     if (i > rawLen - 3)
         i = 0;
     else {
@@ -384,8 +915,7 @@ void Message::iterAdvance(Message::iter &i) {
         {
             while ((raw[i++] & 0x80) && i < rawLen - 2);
         }
-        int len = raw[i++];
-        /* TODO: "long" and "indefinite" forms support */
+        int len = readLength(raw, i);
         if (len + i >= rawLen)
             i = 0;
         else
@@ -393,10 +923,11 @@ void Message::iterAdvance(Message::iter &i) {
     }
 }
 
-void Message::iterGetTypeValue(Message::iter i, Data::Type *type, void *val) {
+void MessageView::iterGetTypeValue(MessageView::iter i, Data::Type *type,
+        void *val) {
     Data::Type t;
     unsigned int tval = 0;
-    uint8_t len;
+    int len;
 
     /* Read type */
 #ifdef BER_COMPAT
@@ -415,31 +946,30 @@ void Message::iterGetTypeValue(Message::iter i, Data::Type *type, void *val) {
     if (type)
         *type = t;
 
-    /* Skip length */
-    len = raw[i++];
+    /* Skip length, a bad one mustn't take us past the end */
+    len = readLength(raw, i);
+    if (unlikely(len > rawLen - i))
+        len = rawLen - i;
 
     /* Read value */
     if (val) {
         if (BOOL_TYPE(t))
             *(bool *) val = raw[i] != 0;
-        else if (FLOAT_TYPE(t)) {
+        else if (FLOAT_TYPE(t) && len < 4) {
+            uint16_t scale = getFixedScale(t);
+
+            *(float *) val = scale && len ?
+                (float) decodeSigned(raw + i, len) / scale : NAN;
+        } else if (FLOAT_TYPE(t)) {
             uint32_t float_val;
 
             float_val = raw[i++];
             float_val |= (uint16_t) raw[i++] << 8;
             float_val |= (uint32_t) raw[i++] << 16;
             float_val |= (uint32_t) raw[i++] << 24;
-            *(uint32_t *) val = float_val;
+            memcpy(val, &float_val, sizeof(float));
         } else if (INT_TYPE(t)) {
-            int int_val;
-
-            int_val = (int8_t) raw[i++]; /* Sign-extend */
-            while (--len && i < rawLen) {
-                int_val <<= 8;
-                int_val |= raw[i++];
-            }
-
-            *(int *) val = int_val;
+            *(int *) val = len ? decodeSigned(raw + i, len < 4 ? len : 4) : 0;
         } else if (BINARY_TYPE(t)) {
             ((BinaryValue *) val)->value = raw + i;
             ((BinaryValue *) val)->len = len;
@@ -447,7 +977,31 @@ void Message::iterGetTypeValue(Message::iter i, Data::Type *type, void *val) {
     }
 }
 
-float Message::toFloat(Data::Type t, void *val) {
+int MessageView::iterGetFixedValue(MessageView::iter i, int32_t *units) {
+    unsigned int tval = 0;
+    int len;
+
+#ifdef BER_COMPAT
+    if (raw[i++] != extendedType)
+        return 0;
+#endif
+
+    while ((raw[i] & 0x80) && i < rawLen - 2) {
+        tval |= raw[i++] & 0x7f;
+        tval <<= 7;
+    }
+    tval |= raw[i++];
+
+    len = readLength(raw, i);
+    if (!getFixedScale((Data::Type) tval) || len < 1 || len > 3 ||
+            i + len > rawLen)
+        return 0;
+
+    *units = decodeSigned(raw + i, len);
+    return 1;
+}
+
+float MessageView::toFloat(Data::Type t, void *val) {
     if (BOOL_TYPE(t))
         return (*(bool *) val) ? 1.0f : 0.0f;
     else if (INT_TYPE(t))
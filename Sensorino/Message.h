@@ -9,60 +9,109 @@
 
 #include "SensorinoUtils.h"
 
+/*
+ * The columns are: type value, enum name, CamelCase name, value coding and
+ * scale.  Types with the "fixed" coding are handled as floats by the API
+ * but sent as integers in units of 1 / scale, falling back to a full float
+ * for values that don't fit in 3 bytes.  The scale is unused otherwise.
+ */
 #define DATATYPE_LIST_APPLY(F)	\
     /* Metatypes */\
-    F(0, DATATYPE, DataType, int)\
-    F(1, SERVICE_ID, ServiceId, int)\
-    F(2, MESSAGE, Message, binary)\
-    F(3, EXPRESSION, Expression, binary)\
+    F(0, DATATYPE, DataType, int, 1)\
+    F(1, SERVICE_ID, ServiceId, int, 1)\
+    F(2, MESSAGE, Message, binary, 1)\
+    F(3, EXPRESSION, Expression, binary, 1)\
+    F(4, DELTA_REF, DeltaRef, int, 1)\
     /* ISO-defined physical dimensions */\
-    F(20, ACCELERATION, Acceleration, float)\
-    F(21, AMOUNT, Amount, float)\
-    F(22, ANGLE, Angle, float)\
-    F(23, ANGULAR_VELOCITY, AngularVelocity, float)\
-    F(24, AREA, Area, float)\
-    F(25, RADIOACTIVITY, Radioactivity, float)\
-    F(26, ELECTRICAL_CAPACITANCE, ElectricalCapacitance, float)\
-    F(27, ELECTRICAL_RESISTANCE, ElectricalResistance, float)\
-    F(28, ELECTRIC_CURRENT, ElectricCurrent, float)\
-    F(29, ENERGY, Energy, float)\
-    F(30, FORCE, Force, float)\
-    F(31, FREQUENCY, Frequency, float)\
-    F(32, ILLUMINANCE, Illuminance, float)\
-    F(33, INDUCTANCE, Inductance, float)\
-    F(34, LENGTH, Length, float)\
-    F(35, LUMINOUS_FLUX, LuminousFlux, float)\
-    F(36, LUMINOUS_INTENSITY, LuminousIntensity, float)\
-    F(37, MAGNETIC_FIELD_STRENGTH, MagneticFieldStrength, float)\
-    F(38, MASS, Mass, float)\
-    F(39, POWER, Power, float)\
-    F(40, PRESSURE, Pressure, float)\
-    F(41, RELATIVE_HUMIDITY, RelativeHumidity, float)\
-    F(42, SPEED, Speed, float)\
-    F(43, TEMPERATURE, Temperature, float)\
-    F(44, TIME, Time, float)\
-    F(45, VOLTAGE, Voltage, float)\
-    F(46, VOLUME, Volume, float)\
+    F(20, ACCELERATION, Acceleration, float, 1)\
+    F(21, AMOUNT, Amount, float, 1)\
+    F(22, ANGLE, Angle, float, 1)\
+    F(23, ANGULAR_VELOCITY, AngularVelocity, float, 1)\
+    F(24, AREA, Area, float, 1)\
+    F(25, RADIOACTIVITY, Radioactivity, float, 1)\
+    F(26, ELECTRICAL_CAPACITANCE, ElectricalCapacitance, float, 1)\
+    F(27, ELECTRICAL_RESISTANCE, ElectricalResistance, float, 1)\
+    F(28, ELECTRIC_CURRENT, ElectricCurrent, fixed, 1000)\
+    F(29, ENERGY, Energy, float, 1)\
+    F(30, FORCE, Force, float, 1)\
+    F(31, FREQUENCY, Frequency, float, 1)\
+    F(32, ILLUMINANCE, Illuminance, fixed, 10)\
+    F(33, INDUCTANCE, Inductance, float, 1)\
+    F(34, LENGTH, Length, float, 1)\
+    F(35, LUMINOUS_FLUX, LuminousFlux, float, 1)\
+    F(36, LUMINOUS_INTENSITY, LuminousIntensity, float, 1)\
+    F(37, MAGNETIC_FIELD_STRENGTH, MagneticFieldStrength, float, 1)\
+    F(38, MASS, Mass, float, 1)\
+    F(39, POWER, Power, float, 1)\
+    F(40, PRESSURE, Pressure, fixed, 1)\
+    F(41, RELATIVE_HUMIDITY, RelativeHumidity, fixed, 100)\
+    F(42, SPEED, Speed, float, 1)\
+    F(43, TEMPERATURE, Temperature, fixed, 100)\
+    F(44, TIME, Time, float, 1)\
+    F(45, VOLTAGE, Voltage, fixed, 1000)\
+    F(46, VOLUME, Volume, float, 1)\
     /* Other common types */\
-    F(50, COUNT, Count, int)\
-    F(51, PRESENCE, Presence, bool)\
-    F(52, SWITCH, Switch, bool)\
-    F(53, COLOR_COMPONENT, ColorComponent, float)
+    F(50, COUNT, Count, int, 1)\
+    F(51, PRESENCE, Presence, bool, 1)\
+    F(52, SWITCH, Switch, bool, 1)\
+    F(53, COLOR_COMPONENT, ColorComponent, float, 1)
 
 namespace Data {
     enum Type {
-#define CAPS_ENUM(intval, CAPS, Camel, coding) \
+#define CAPS_ENUM(intval, CAPS, Camel, coding, scale) \
         CAPS = intval,
 DATATYPE_LIST_APPLY(CAPS_ENUM)
     };
 };
 
 #define HEADERS_LENGTH 4
+
+/* Message capacity.  Nodes can't afford more than what fits in a few radio
+ * fragments but a gateway running on a bigger machine can be built with a
+ * bigger value, e.g. -DPAYLOAD_LENGTH=1020, to handle big batches, rule
+ * dumps and snapshots in one Message.  Element lengths of 128 and more use
+ * the BER long form.
+ */
+#ifndef PAYLOAD_LENGTH
 #define PAYLOAD_LENGTH 80
+#endif
 
 #define MAX_MESSAGE_SIZE (HEADERS_LENGTH + PAYLOAD_LENGTH)
 
-class Message {
+/* Radio frames have 8-bit lengths whatever the Message capacity */
+#define MAX_RADIO_MESSAGE_SIZE \
+    (MAX_MESSAGE_SIZE < 255 ? MAX_MESSAGE_SIZE : 255)
+
+/* Number of payload TLVs the lookup index holds, see MessageView::find().
+ * Bigger payloads are looked into by walking them.
+ */
+#ifndef MESSAGE_INDEX_SIZE
+#define MESSAGE_INDEX_SIZE 16
+#endif
+
+/* Lengths and offsets within a Message */
+#if MAX_MESSAGE_SIZE > 255
+typedef uint16_t msglen_t;
+#else
+typedef uint8_t msglen_t;
+#endif
+
+/* Number of outgoing messages that can be under construction or waiting
+ * to be sent at the same time, see Message::alloc().  At most 8.
+ */
+#ifndef MESSAGE_POOL_SIZE
+#define MESSAGE_POOL_SIZE 2
+#endif
+
+/* C++ type and coding parameters of each Data::Type, see below */
+template<Data::Type T> struct CodingOf;
+
+/*
+ * Read-only access to a Sensorino message stored in a buffer that someone
+ * else owns, e.g. a radio receive buffer.  Nothing is copied so the
+ * buffer must stay untouched for as long as the view is in use.
+ */
+class MessageView {
     public:
         enum Type {
             ERR     = 0,
@@ -70,6 +119,10 @@ class Message {
             PUBLISH = 2,
             SET     = 3,
             REQUEST = 4,
+            /* Several PUBLISHes merged into one frame, each starting
+             * with its SERVICE_ID, see Sensorino::setPublishCoalescing()
+             */
+            PUBLISH_BATCH = 5,
         };
 
         enum CodingType {
@@ -77,60 +130,195 @@ class Message {
             floatCoding,
             boolCoding,
             binaryCoding,
+            fixedCoding,
         };
 
         struct BinaryValue {
-            uint8_t *value;
-            uint8_t len;
+            const uint8_t *value;
+            msglen_t len;
         };
 
-        /* Use this when building a brand new message */
-        Message(uint8_t srcAddress, uint8_t dstAddress);
-
         /* Use this to grok a message you received */
-        Message(const uint8_t *raw, int len);
+        MessageView(const uint8_t *raw, int len);
+        /* View the payload of a nested MESSAGE value, @payload as found
+         * in @outer by find() or get<MESSAGE>().  The header accessors
+         * return @outer's headers, the payload accessors never go past
+         * the nested payload.
+         */
+        MessageView(const MessageView &outer, const BinaryValue &payload);
 
-        /* Use this to obtain a receive buffer for a new message */
-        Message();
+        MessageView(const MessageView &m);
+        MessageView &operator=(const MessageView &m);
 
         static const prog_char *dataTypeToString(Data::Type t,
                 CodingType *coding = NULL);
         static Data::Type stringToDataType(const char *str);
 
-        /* NOTE: this blocks */
-        bool send(void);
-
         /* Header accessors */
         uint8_t getId();
-        void setId(uint8_t id);
-
         uint8_t getSrcAddress();
-        void setSrcAddress(uint8_t addr);
         uint8_t getDstAddress();
-        void setDstAddress(uint8_t addr);
-
         Type getType(void);
-        void setType(Type t);
 
         /* Raw accessors */
         const uint8_t *getRawData(void);
         int getRawLength(void);
 
-        uint8_t *getWriteBuffer(void);
-        void writeLength(int len);
-
         /* Payload accessors */
 
         /* Find @num'th TLV of type @t, decode it and store in @value,
-         * @return non-zero on success.
+         * @return non-zero on success.  The second lookup in a row on
+         * the same view indexes its payload, after that lookups take
+         * the same time wherever the TLV is.
          */
         int find(Data::Type t, int num, void *value);
 
+        /* Same for a type known at compile time, e.g.:
+         *   float temp;
+         *   if (msg.get<TEMPERATURE>(0, temp)) ...
+         * @value has the right type for @T so nothing can get written
+         * past it and the decoding is picked by the compiler.
+         */
+        template<Data::Type T>
+        int get(uint8_t num, typename CodingOf<T>::type &value);
+
+        /* Payload C++-like iterator */
+        typedef msglen_t iter;
+        iter begin();
+        void iterAdvance(iter &i);
+        void iterGetTypeValue(iter i, Data::Type *type, void *val);
+        /* Get the raw value of a "fixed" coded element in units of
+         * 1 / scale, @return zero if the element is not "fixed" coded or
+         * was sent as a float.
+         */
+        int iterGetFixedValue(iter i, int32_t *units);
+
+        static float toFloat(Data::Type t, void *val);
+        /* Units per 1.0 of a "fixed" coded type, 0 for other types */
+        static uint16_t getFixedScale(Data::Type t);
+
+    protected:
+        MessageView() : start(HEADERS_LENGTH) {}
+
+        const uint8_t *raw;
+        msglen_t rawLen;
+        /* Where the payload starts in raw, after the headers unless this
+         * views a nested message.
+         */
+        msglen_t start;
+
+        int locate(Data::Type t, int num);
+        int scan(Data::Type t, int num);
+        int decode(Data::Type t, int pos, void *value);
+
+        /* The one shared payload index, see Message.cpp */
+        void buildIndex(void);
+        /* Call whenever the payload changes other than by appending, or a
+         * view is constructed.
+         */
+        void dropIndex(void);
+
+        /* Per-coding decoders for get(), @pos is at the length byte */
+        int decodeValue(int pos, int &value);
+        int decodeValue(int pos, Data::Type &value);
+        int decodeValue(int pos, bool &value);
+        int decodeValue(int pos, BinaryValue &value);
+        /* Floats need the type's "fixed" scale, see getFixedScale() */
+        int decodeValue(int pos, float &value, uint16_t scale);
+
+        /* get() passes the scale to every decoder, only floats use it */
+        template<typename V>
+        int decodeValue(int pos, V &value, uint16_t) {
+            return decodeValue(pos, value);
+        }
+};
+
+/*
+ * A message with its own storage, use this to build new messages.
+ */
+class Message : public MessageView {
+    public:
+        /* Use this when building a brand new message */
+        Message(uint8_t srcAddress, uint8_t dstAddress);
+
+        /* Use this to make a private copy of a message you received */
+        Message(const uint8_t *raw, int len);
+
+        /* Use this to obtain a receive buffer for a new message */
+        Message();
+
+        Message(const Message &m);
+        Message &operator=(const Message &m);
+
+        /*
+         * Take a brand new message from the static pool instead of the
+         * heap.  The caller owns it until it calls send() or release().
+         * Returns NULL when all MESSAGE_POOL_SIZE messages are in use.
+         * Safe to call from interrupt context.
+         */
+        static Message *alloc(uint8_t srcAddress, uint8_t dstAddress);
+        /* Same as alloc() but never fails, when the pool is exhausted a
+         * scratch message is returned whose send() drops it, so that
+         * callers can always build their message the usual way.  Those
+         * are counted in PoolStats::discarded.
+         */
+        static Message *allocOrDiscard(uint8_t srcAddress,
+                uint8_t dstAddress);
+        /* Return a message obtained from alloc() to the pool */
+        void release(void);
+        /* Make the next release() of this pool message do nothing, so
+         * that it can outlive the send() in progress and be handed to a
+         * WorkQueue item, which releases it.  @return false if this is
+         * not a pool message.
+         */
+        bool keep(void);
+
+        struct PoolStats {
+            uint8_t inUse;
+            uint8_t peak;
+            uint16_t exhausted;     /* alloc() calls that failed */
+            uint16_t discarded;     /* allocOrDiscard() messages dropped */
+        };
+        static const PoolStats &getPoolStats(void);
+
+        /* NOTE: this blocks.  Pool messages are released after sending */
+        bool send(void);
+
+        /* Header accessors */
+        void setId(uint8_t id);
+        void setSrcAddress(uint8_t addr);
+        void setDstAddress(uint8_t addr);
+        void setType(Type t);
+
+        /* Raw accessors */
+        uint8_t *getWriteBuffer(void);
+        void writeLength(int len);
+
+        /* Payload accessors */
         void addFloatValue(Data::Type t, float value);
         void addIntValue(Data::Type t, int value);
         void addDataTypeValue(Data::Type t);
         void addBoolValue(Data::Type t, bool value);
-        void addBinaryValue(Data::Type t, const uint8_t *value, uint8_t len);
+        void addBinaryValue(Data::Type t, const uint8_t *value,
+                msglen_t len);
+
+        /* Same for a type known at compile time, e.g. add<TEMPERATURE>(x) */
+        template<Data::Type T>
+        void add(typename CodingOf<T>::type value) {
+            addValue(T, value, CodingOf<T>::scale);
+        }
+
+        /* Add a "fixed" coded value in units of 1 / scale, must fit in
+         * 3 bytes.
+         */
+        void addFixedValue(Data::Type t, int32_t units);
+
+        /* Add a binary value whose contents are then appended with the
+         * usual add*Value() calls, e.g. a nested MESSAGE.  Pass the
+         * returned position to endBinaryValue() once done.
+         */
+        msglen_t beginBinaryValue(Data::Type t);
+        void endBinaryValue(msglen_t start);
 
         /* Accessors for types encoded as floats */
 #define int(...)
@@ -138,30 +326,97 @@ class Message {
 #define float(CamelName) \
         void glue(add, CamelName)(float val); \
         void glue(add, CamelName)(int val);
+#define fixed(CamelName) float(CamelName)
 #define binary(...)
-#define FLOAT_INT_ACCESSOR(intval, CAPS, Camel, coding) coding(Camel)
+#define FLOAT_INT_ACCESSOR(intval, CAPS, Camel, coding, scale) coding(Camel)
 DATATYPE_LIST_APPLY(FLOAT_INT_ACCESSOR)
 #undef binary
+#undef fixed
 #undef float
 #undef bool
 #undef int
 
-        /* Payload C++-like iterator */
-        typedef uint8_t iter;
-        iter begin();
-        void iterAdvance(iter &i);
-        void iterGetTypeValue(iter i, Data::Type *type, void *val);
-
-        static float toFloat(Data::Type t, void *val);
-
     protected:
-        uint8_t raw[HEADERS_LENGTH + PAYLOAD_LENGTH];
-        uint8_t rawLen;
+        uint8_t buf[HEADERS_LENGTH + PAYLOAD_LENGTH];
 
         static uint8_t staticId;
 
+        static uint8_t poolMask, keepMask;
+        static PoolStats poolStats;
+
+        void init(uint8_t srcAddress, uint8_t dstAddress);
         void checkIntegrity();
+
+        void addScaledValue(Data::Type t, float value, uint16_t scale);
+
+        /* Per-coding encoders for add() */
+        void addValue(Data::Type t, int value, uint16_t scale) {
+            addIntValue(t, value);
+        }
+        void addValue(Data::Type t, Data::Type value, uint16_t scale) {
+            addIntValue(t, value);
+        }
+        void addValue(Data::Type t, bool value, uint16_t scale) {
+            addBoolValue(t, value);
+        }
+        void addValue(Data::Type t, float value, uint16_t scale) {
+            addScaledValue(t, value, scale);
+        }
+        void addValue(Data::Type t, const BinaryValue &value,
+                uint16_t scale) {
+            addBinaryValue(t, value.value, value.len);
+        }
+};
+
+/*
+ * CodingOf<T>::type is the C++ type of the values of Data::Type T, and
+ * CodingOf<T>::scale the scale of "fixed" coded types or 0.
+ */
+template<Data::Type T, typename C>
+struct CodingValue {
+    typedef C type;
 };
 
+/* DataType values are themselves types */
+template<>
+struct CodingValue<Data::DATATYPE, int> {
+    typedef Data::Type type;
+};
+
+#define int_ctype int
+#define bool_ctype bool
+#define float_ctype float
+#define fixed_ctype float
+#define binary_ctype MessageView::BinaryValue
+#define int_scale(s) 0
+#define bool_scale(s) 0
+#define float_scale(s) 0
+#define fixed_scale(s) s
+#define binary_scale(s) 0
+#define CODING_OF(intval, CAPS, Camel, coding, sc) \
+    template<> \
+    struct CodingOf<Data::CAPS> { \
+        typedef CodingValue<Data::CAPS, glue(coding, _ctype)>::type type; \
+        static const uint16_t scale = glue(coding, _scale)(sc); \
+    };
+DATATYPE_LIST_APPLY(CODING_OF)
+#undef binary_scale
+#undef fixed_scale
+#undef float_scale
+#undef bool_scale
+#undef int_scale
+#undef binary_ctype
+#undef fixed_ctype
+#undef float_ctype
+#undef bool_ctype
+#undef int_ctype
+
+template<Data::Type T>
+int MessageView::get(uint8_t num, typename CodingOf<T>::type &value) {
+    int pos = locate(T, num);
+
+    return pos && decodeValue(pos, value, CodingOf<T>::scale);
+}
+
 #endif // whole file
 /* vim: set sw=4 ts=4 et: */
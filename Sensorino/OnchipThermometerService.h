@@ -20,13 +20,13 @@ protected:
         msg->send();
     }
 
-    void onRequest(Message *message) {
+    void onRequest(MessageView *message) {
         Type req;
 
         /* If the request has no DataType value, or it's asking for the
          * TEMPERATURE value, just send the last temperature measured.
          */
-        if (!message->find(DATATYPE, 0, &req) || req == TEMPERATURE) {
+        if (!message->get<DATATYPE>(0, req) || req == TEMPERATURE) {
             publishValue();
             return;
         }
@@ -17,20 +17,20 @@ protected:
     int pin;
     bool state;
 
-    void onSet(Message *message) {
+    void onSet(MessageView *message) {
         bool new_state;
 
-        if (!message->find(SWITCH, 0, &new_state))
+        if (!message->get<SWITCH>(0, new_state))
             new_state = !state;
 
         digitalWrite(pin, new_state);
         state = new_state;
     }
 
-    void onRequest(Message *message) {
+    void onRequest(MessageView *message) {
         Data::Type req;
 
-        if (!message->find(DATATYPE, 0, &req) || req == SWITCH) {
+        if (!message->get<DATATYPE>(0, req) || req == SWITCH) {
             Message *msg = publish(message);
             msg->addBoolValue(SWITCH, state);
             msg->send();
@@ -4,9 +4,6 @@
 #include "Service.h"
 #include "Expression.h"
 
-#define IS_TRUE(flt) (flt > 0.5f)
-#define IS_ZERO(flt) ((flt) < EPSILON && -(flt) < EPSILON)
-
 using namespace Data;
 
 /* Use EEPROM for rule storage, rather than RAM */
@@ -23,11 +20,16 @@ public:
             valueCache[i].serviceId = 0xff;
     }
 
-    void evalPublish(Message &message) {
+    /* Nothing for evalPublish() to do until a rule is added */
+    bool hasRules(void) {
+        return getByte(0) != 0xff;
+    }
+
+    void evalPublish(MessageView &message) {
         int servId;
         uint32_t useMask = 0;
 
-        if (!message.find(SERVICE_ID, 0, &servId))
+        if (!message.get<SERVICE_ID>(0, servId))
             return;
 
         int offset = 0;
@@ -143,11 +145,11 @@ protected:
     }
 #endif
 
-    void onSet(Message *message) {
+    void onSet(MessageView *message) {
         int ruleId, offset;
         Message::BinaryValue condition, action;
 
-        if (!message->find(COUNT, 0, &ruleId)) {
+        if (!message->get<COUNT>(0, ruleId)) {
             err(message, COUNT)->send();
             return;
         }
@@ -165,8 +167,8 @@ protected:
         }
 
         /* Create a new rule or update an existing one */
-        if (!message->find(EXPRESSION, 0, &condition) ||
-                !message->find(MESSAGE, 0, &action)) {
+        if (!message->get<EXPRESSION>(0, condition) ||
+                !message->get<MESSAGE>(0, action)) {
             if (offset < 0)
                 err(message, COUNT)->send();
 
@@ -184,13 +186,13 @@ protected:
         createRule(ruleId, condition, action);
     }
 
-    void onRequest(Message *message) {
+    void onRequest(MessageView *message) {
         int ruleId, offset;
         uint8_t num, typeExpr, typeMsg, typeType;
         Type dt;
 
         /* See what data types are being requested */
-        while (message->find(DATATYPE, num++, &dt))
+        while (message->get<DATATYPE>(num++, dt))
             if (dt == DATATYPE)
                 typeType = 1;
             else if (dt == EXPRESSION)
@@ -202,7 +204,7 @@ protected:
                 return;
             }
 
-        if (!message->find(COUNT, 0, &ruleId)) {
+        if (!message->get<COUNT>(0, ruleId)) {
             if (typeType) {
                 /* Send service description */
                 Message *m = publish(message);
@@ -311,13 +313,13 @@ protected:
      * by this expression and whose new value is available in @m.
      * @return expression's current value.
      */
-    float evalExpression(int &expr, uint8_t servId, Message &m,
+    float evalExpression(int &expr, uint8_t servId, MessageView &m,
             uint32_t &useMask) {
         uint8_t op = getByte(expr++);
 
         float op1, op2, diff, ret;
 
-        uint8_t varServId, varNum, i, b;
+        uint8_t varServId, varNum, i;
         Type varType;
         int16_t intVal;
 
@@ -363,35 +365,7 @@ protected:
         case OP_DIV:
             op1 = evalExpression(expr, servId, m, useMask);
             op2 = evalExpression(expr, servId, m, useMask);
-            diff = op1 - op2;
-            if (isnan(diff))
-                return NAN;
-            switch(op) {
-            case OP_EQ:
-            case OP_NE:
-                b = IS_ZERO(diff);
-                return (op == OP_EQ) ? b : !b;
-            case OP_LE:
-            case OP_GT:
-                b = diff > EPSILON;
-                return (op == OP_GT) ? b : !b;
-            case OP_LT:
-            case OP_GE:
-                b = diff < -EPSILON;
-                return (op == OP_LT) ? b : !b;
-            case OP_OR:
-                return IS_TRUE(op1) || IS_TRUE(op2);
-            case OP_AND:
-                return IS_TRUE(op1) && IS_TRUE(op2);
-            case OP_ADD:
-                return op1 + op2;
-            case OP_SUB:
-                return diff;
-            case OP_MULT:
-                return op1 * op2;
-            case OP_DIV:
-                return op1 / op2;
-            }
+            return evalBinary(op, op1, op2);
 
         case OP_NOT:
             op1 = evalExpression(expr, servId, m, useMask);
@@ -404,12 +378,14 @@ protected:
         case OP_IN:
             i = getByte(expr++);
             op1 = evalExpression(expr, servId, m, useMask);
+            /* Go through all the values so that expr ends up after them */
+            ret = 0.0f;
             while (i--) {
                 diff = op1 - evalExpression(expr, servId, m, useMask);
                 if (IS_ZERO(diff))
-                    return 1.0f;
+                    ret = 1.0f;
             }
-            return 0.0f;
+            return ret;
 
         case OP_IFELSE:
             op1 = evalExpression(expr, servId, m, useMask);
@@ -426,16 +402,13 @@ protected:
             ret = evalExpression(expr, servId, m, useMask);
             op1 = evalExpression(expr, servId, m, useMask);
             op2 = evalExpression(expr, servId, m, useMask);
-            if (op1 < op2)
-                return ret > op1 && ret < op2;
-            else
-                return ret > op2 && ret < op1;
+            return evalBetween(ret, op1, op2);
         }
 
         return NAN;
     }
 
-    float getVariableValue(Message &m, uint8_t servId,
+    float getVariableValue(MessageView &m, uint8_t servId,
             uint8_t varServId, Type t, uint8_t num,
             uint32_t &useMask, bool useCurrent) {
         /* Check if we have this variable's value cached */
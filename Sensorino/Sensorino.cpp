@@ -27,14 +27,22 @@
 #include "ServiceManagerService.h"
 #include "RuleService.h"
 #include "FragmentedDatagram.h"
+#include "Timers.h"
+#include "WorkQueue.h"
 
 /* TODO: make these configurable */
 #define CONFIG_CSN_PIN  10
 #define CONFIG_INTR_PIN 14
 #define CONFIG_CE_PIN   15
 
+/* A PUBLISH_BATCH is kept to what one radio payload carries next to the
+ * FragmentedDatagram trailer, a batch that needs fragments has lost the
+ * airtime it was meant to save.
+ */
+#define BATCH_MAX_SIZE  (MAX_MESSAGE_LEN - 1)
+
 static FragmentedDatagram<RHReliableDatagram, RH_NRF24_MAX_MESSAGE_LEN,
-        MAX_MESSAGE_SIZE> *radioManager;
+        MAX_RADIO_MESSAGE_SIZE> *radioManager;
 
 Sensorino::Sensorino(bool noSM, bool noRE) {
     if (sensorino)
@@ -53,10 +61,16 @@ Sensorino::Sensorino(bool noSM, bool noRE) {
     RHGenericDriver *radio = new RH_NRF24(CONFIG_CE_PIN, CONFIG_CSN_PIN);
     #endif
     radioManager = new FragmentedDatagram<RHReliableDatagram,
-            RH_NRF24_MAX_MESSAGE_LEN, MAX_MESSAGE_SIZE>(*radio, address);
+            RH_NRF24_MAX_MESSAGE_LEN, MAX_RADIO_MESSAGE_SIZE>(*radio,
+                    address);
 
     servicesNum = 0;
 
+    coalesceWindow = 0;
+    coalesced = NULL;
+    coalesceDeadline = 0;
+    coalesceArmed = 0;
+
     sensorino = this;
 
     /* Initialise the radio and put it in Rx mode */
@@ -106,44 +120,79 @@ void Sensorino::radioOpDone(void) {
         radioCheckPacket();
 }
 
-/* TODO: call this in a Bottom Half */
 void Sensorino::radioCheckPacket(void) {
-    Message msg;
+    uint8_t frame[MAX_RADIO_MESSAGE_SIZE];
     uint8_t len;
 
     radioBusy++;
-    if (radioManager->recvfromAck(msg.getWriteBuffer(), &len,
-                NULL, NULL, NULL, NULL)) {
-        msg.writeLength(len);
+    /* Reassemble on the stack and parse the frame in place, no need to
+     * keep a receive buffer around between packets.
+     */
+    if (radioManager->recvfromAck(frame, &len)) {
+        MessageView msg(frame, len);
         handleMessage(msg);
     }
     radioBusy--;
 }
 
+/* Top half: the IRQ line stays low until the packet is read out, mask it
+ * so the level-triggered handler doesn't keep us in the ISR and leave the
+ * reading to radioWork().  Other interrupts are served in the meantime.
+ */
 void Sensorino::radioInterrupt(uint8_t pin) {
-    /* Check if the radio is busy, e.g. this may be a Tx FIFO empty
-     * interrupt or, the ACK receival, and we're not interested in
-     * those, RadioHead should take care of them.
-     */
-    if (radioBusy)
-        return;
+    sensorino->maskGPIOInterrupt(pin);
+    scheduleRadioWork();
+}
 
+/* Bottom half, runs from WorkQueue::run() with interrupts enabled */
+void Sensorino::radioWork(void *arg) {
     /* This will handle new messages */
+    radioBusy++;
     sensorino->radioOpDone();
+    radioBusy--;
+
+    sensorino->unmaskGPIOInterrupt(CONFIG_INTR_PIN);
 }
 
-void Sensorino::radioRun() {
+/* Also called after our own transmissions as RadioHead may have pulled
+ * a packet out of the radio while waiting for an ACK.
+ */
+void Sensorino::scheduleRadioWork(void) {
+    uint8_t sreg;
+
+    if (WorkQueue::schedule(radioWork))
+        return;
+
+    /* The queue is full and counts the drop.  The radio's pin stays
+     * masked until radioWork() runs so try again a little later.
+     */
+    sreg = SREG;
     cli();
+    if (!radioRetryArmed) {
+        radioRetryArmed = 1;
+        Timers::setTimeout(radioRetry, 1);
+    }
+    SREG = sreg;
+}
+
+/* Runs from the timer interrupt */
+void Sensorino::radioRetry(void) {
+    radioRetryArmed = 0;
+    scheduleRadioWork();
+}
+
+void Sensorino::radioRun() {
     /* This will handle new messages */
-    sensorino->radioOpDone();
-    sei();
+    scheduleRadioWork();
+    WorkQueue::run();
 }
 
 volatile uint8_t Sensorino::radioBusy = 0;
+volatile bool Sensorino::radioRetryArmed = 0;
 
-bool Sensorino::sendMessage(Message &m) {
-    bool ret;
+bool Sensorino::transmit(MessageView &m) {
     uint8_t dest = m.getDstAddress();
+    bool ret;
 
     /* Note if we were to ignore messages addressed at ourselves, such as
      * responses to events, we can do a m.getDstAddress() != getAddress()
@@ -152,25 +201,245 @@ bool Sensorino::sendMessage(Message &m) {
     if (dest == getAddress())
         dest = getBaseAddress();
 
-    radioBusy++;
     ret = radioManager->sendtoWait((uint8_t *) m.getRawData(),
             m.getRawLength(), dest);
+    deltaSent(m, ret);
+
+    return ret;
+}
+
+bool Sensorino::queueFrame(Message &m) {
+    if (coalescePublish(m))
+        return 1;
+
+    /* Keep the order of what the Base sees */
+    flushPublishes();
+
+    return transmit(m);
+}
+
+/* Have @fn called with @m from a work item, which then releases it.  A
+ * pool message is passed on as it is, anything else as a pool copy.  We
+ * are in an interrupt handler or in sendMessage() so the item can't run
+ * before the send() in progress has returned.
+ */
+bool Sensorino::queueMessage(Message &m, void (*fn)(void *arg)) {
+    Message *msg = &m;
+
+    if (!m.keep()) {
+        msg = Message::alloc(m.getSrcAddress(), m.getDstAddress());
+        if (!msg)
+            return 0;
+
+        *msg = m;
+    }
+
+    if (WorkQueue::schedule(fn, msg))
+        return 1;
+
+    /* Frees the copy or undoes keep() */
+    msg->release();
+    return 0;
+}
+
+/* Runs from WorkQueue::run(), @arg is a pool message */
+void Sensorino::sendWork(void *arg) {
+    ((Message *) arg)->send();
+}
+
+/* Same for a PUBLISH the rules need to see */
+void Sensorino::ruleWork(void *arg) {
+    Message *m = (Message *) arg;
+
+    sensorino->ruleEngine->evalPublish(*m);
+    m->release();
+}
 
-    if (m.getType() == Message::PUBLISH && ruleEngine)
-        ruleEngine->evalPublish(m); /* Note: may recurse */
+bool Sensorino::sendMessage(Message &m) {
+    DeltaEncoder *delta = NULL;
+    bool ret;
+
+    /* Never wait for the radio in an interrupt handler, including the
+     * timer callbacks, and the interrupt may have hit in the middle of a
+     * transmission or a received message's handling.  Send it from a work
+     * item.
+     */
+    if (inInterrupt())
+        return queueMessage(m, sendWork);
+
+    /* Only the Base knows how to decode deltas */
+    if (m.getType() == Message::PUBLISH &&
+            (m.getDstAddress() == getBaseAddress() ||
+             m.getDstAddress() == getAddress()))
+        delta = getDeltaEncoder(m, m.begin());
+
+    radioBusy++;
+    if (delta) {
+        /* Only the copy that goes on the air is delta coded, the rules
+         * below need the absolute values.
+         */
+        Message wire(m.getRawData(), HEADERS_LENGTH);
+
+        delta->encode(m, wire);
+        ret = queueFrame(wire);
+    } else
+        ret = queueFrame(m);
     radioBusy--;
 
-    if (!radioBusy)
-        radioOpDone(); /* Note: also may recurse (should use bottom halves) */
+    /* Rules see every PUBLISH, coalesced or not.  Their actions send and
+     * handle Messages of their own so evaluate them in a work item
+     * rather than from inside sendMessage().
+     */
+    if (m.getType() == Message::PUBLISH && ruleEngine &&
+            ruleEngine->hasRules())
+        queueMessage(m, ruleWork);
+
+    scheduleRadioWork();
 
     return ret;
 }
 
-void Sensorino::handleMessage(Message &msg) {
+/* The delta encoder of the service whose SERVICE_ID is at @pos, if any */
+DeltaEncoder *Sensorino::getDeltaEncoder(MessageView &m, uint8_t pos) {
+    Data::Type t;
+    Service *svc;
+    int svcId;
+
+    if (!pos)
+        return NULL;
+
+    m.iterGetTypeValue(pos, &t, &svcId);
+    if (t != Data::SERVICE_ID)
+        return NULL;
+
+    svc = getServiceById(svcId);
+    return svc ? svc->getDeltaEncoder() : NULL;
+}
+
+/* Tell the delta encoders of the services in a frame how it went */
+void Sensorino::deltaSent(MessageView &m, bool acked) {
+    DeltaEncoder *delta;
+
+    if (m.getType() == Message::PUBLISH) {
+        delta = getDeltaEncoder(m, m.begin());
+        if (delta)
+            delta->sent(m.getId(), acked);
+    } else if (m.getType() == Message::PUBLISH_BATCH)
+        for (Message::iter i = m.begin(); i; m.iterAdvance(i)) {
+            delta = getDeltaEncoder(m, i);
+            if (delta)
+                delta->sent(m.getId(), acked);
+        }
+}
+
+void Sensorino::setPublishCoalescing(uint32_t window) {
+    flushPublishes();
+
+    coalesceWindow = window;
+}
+
+/*
+ * Only PUBLISHes for the Base that carry exactly one SERVICE_ID, as their
+ * first element, are merged so that the Base can split the batch at each
+ * SERVICE_ID.  Multi-service messages like the Service Manager's service
+ * list go out on their own.  The batch is transmitted when the window
+ * expires or when the next message doesn't fit in BATCH_MAX_SIZE, one
+ * that doesn't fit on its own isn't batched.
+ */
+bool Sensorino::coalescePublish(Message &m) {
+    Message::iter i = m.begin();
+    Data::Type t;
+    int svcId, len;
+
+    if (!coalesceWindow || m.getType() != Message::PUBLISH ||
+            (m.getDstAddress() != getBaseAddress() &&
+             m.getDstAddress() != getAddress()) || !i)
+        return 0;
+
+    m.iterGetTypeValue(i, &t, NULL);
+    if (t != Data::SERVICE_ID || m.get<Data::SERVICE_ID>(1, svcId))
+        return 0;
+
+    len = m.getRawLength() - HEADERS_LENGTH;
+    if (HEADERS_LENGTH + len > BATCH_MAX_SIZE)
+        return 0;
+
+    if (coalesced && coalesced->getRawLength() + len > BATCH_MAX_SIZE)
+        flushPublishes();
+
+    if (!coalesced) {
+        /* The batch only holds a pool slot while it's open, send this
+         * one on its own if there's none free.
+         */
+        coalesced = Message::alloc(0, 0);
+        if (!coalesced)
+            return 0;
+
+        /* First one in the batch supplies the header */
+        coalesced->writeLength(-HEADERS_LENGTH);
+        memcpy(coalesced->getWriteBuffer(), m.getRawData(), HEADERS_LENGTH);
+        coalesced->writeLength(HEADERS_LENGTH);
+
+        /* The timer may still be armed for a batch that was flushed
+         * early, coalesceWork() then waits for this one's deadline.
+         */
+        coalesceDeadline = Timers::now() + coalesceWindow;
+        if (!coalesceArmed) {
+            coalesceArmed = 1;
+            Timers::setTimeout(coalesceTimeout, coalesceWindow);
+        }
+    } else
+        coalesced->setType(Message::PUBLISH_BATCH);
+
+    memcpy(coalesced->getWriteBuffer(), m.getRawData() + HEADERS_LENGTH, len);
+    coalesced->writeLength(len);
+
+    return 1;
+}
+
+void Sensorino::flushPublishes(void) {
+    /* Set radioBusy first so the timeout can't flush under our feet */
+    radioBusy++;
+    if (coalesced) {
+        transmit(*coalesced);
+        coalesced->release();
+        coalesced = NULL;
+    }
+    radioBusy--;
+
+    scheduleRadioWork();
+}
+
+/* Runs from the timer interrupt, the radio and the batch may be in use so
+ * leave the transmission to a bottom half.
+ */
+void Sensorino::coalesceTimeout(void) {
+    /* Should the queue be full try again a little later */
+    if (!WorkQueue::schedule(coalesceWork))
+        Timers::setTimeout(coalesceTimeout, 1);
+}
+
+/* Bottom half, runs from WorkQueue::run() */
+void Sensorino::coalesceWork(void *arg) {
+    uint32_t left = sensorino->coalesceDeadline - Timers::now();
+
+    /* The batch the timer was armed for has been flushed already, the
+     * one opened since gets its whole window.
+     */
+    if (sensorino->coalesced && left && !(left >> 31)) {
+        Timers::setTimeout(coalesceTimeout, left);
+        return;
+    }
+
+    sensorino->coalesceArmed = 0;
+    sensorino->flushPublishes();
+}
+
+void Sensorino::handleMessage(MessageView &msg) {
     int svcId;
     Service *targetSvc = NULL;
 
-    if (msg.find(SERVICE_ID, 0, &svcId))
+    if (msg.get<SERVICE_ID>(0, svcId))
         targetSvc = getServiceById(svcId);
 
     if (!targetSvc) {
@@ -269,6 +538,19 @@ static volatile uint8_t pcint_to_gpio[24] = {
     0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
 };
 
+/* PCMSK0 to PCMSK2 are consecutive registers */
+#define PORT_PCMSK(port) ((&PCMSK0)[port])
+
+static void callGPIOHandler(uint8_t port, uint8_t pin_msk, uint8_t num) {
+    if (port_obj_mask[port] & pin_msk) {
+        GenIntrCallback *cb = (GenIntrCallback *) gpio_handler[num];
+        cb->call(num);
+    } else {
+        void (*handler)(uint8_t) = (void (*)(uint8_t)) gpio_handler[num];
+        handler(num);
+    }
+}
+
 static void SensorinoGPIOISR(uint8_t port, volatile uint8_t *pin_reg) {
     uint8_t pin_msk = 1;
     uint8_t num;
@@ -296,21 +578,18 @@ static void SensorinoGPIOISR(uint8_t port, volatile uint8_t *pin_reg) {
          * need to re-check after re-enabling interrupts because a new
          * edge will set PCIFR and send us back here as soon as we return.
          * Note that at this point we already know that the level matches.
+         * Also stop if the handler has masked the pin, it will be
+         * re-checked in unmaskGPIOInterrupt().
          */
         while (1) {
-            if (port_obj_mask[port] & pin_msk) {
-                GenIntrCallback *cb = (GenIntrCallback *) gpio_handler[num];
-                cb->call(num);
-            } else {
-                void (*handler)(uint8_t) =
-                    (void (*)(uint8_t)) gpio_handler[num];
-                handler(num);
-            }
+            callGPIOHandler(port, pin_msk, num);
 
             if (port_edge_mask[port] & pin_msk)
                 break;
             if ((new_val ^ *pin_reg) & pin_msk)
                 break;
+            if (!(PORT_PCMSK(port) & pin_msk))
+                break;
         }
     }
 }
@@ -370,10 +649,49 @@ void Sensorino::detachGPIOInterrupt(uint8_t pin) {
     /* Disable corresponding interrupt */
     *digitalPinToPCMSK(pin) &= ~pcmsk;
 }
+
+void Sensorino::maskGPIOInterrupt(uint8_t pin) {
+    uint8_t sreg = SREG;
+    cli();
+    *digitalPinToPCMSK(pin) &= ~(1 << digitalPinToPCMSKbit(pin));
+    SREG = sreg;
+}
+
+void Sensorino::unmaskGPIOInterrupt(uint8_t pin) {
+    uint8_t port = digitalPinToPCICRbit(pin);
+    uint8_t pcmsk = 1 << digitalPinToPCMSKbit(pin);
+    uint8_t sreg = SREG;
+
+    cli();
+    *digitalPinToPCMSK(pin) |= pcmsk;
+
+    /* An edge-triggered pin may have changed while masked, the handler's
+     * work has read it since, only look for edges from here on.
+     */
+    if (port_edge_mask[port] & pcmsk)
+        port_val[port] = (port_val[port] & ~pcmsk) |
+            (*portInputRegister(digitalPinToPort(pin)) & pcmsk);
+
+    /* A level that is still active has no edge to trigger the ISR, call
+     * the handler as the ISR would.
+     */
+    if (!(port_edge_mask[port] & pcmsk) &&
+            ((port_val[port] ^ *portInputRegister(digitalPinToPort(pin))) &
+             pcmsk))
+        callGPIOHandler(port, pcmsk, pin);
+    SREG = sreg;
+}
+
+bool Sensorino::inInterrupt(void) {
+    return !(SREG & (1 << SREG_I));
+}
 #else
 static void doAttachGPIOInterrupt(uint8_t pin, uint8_t trigger,
         void *handler, uint8_t obj) {}
 void Sensorino::detachGPIOInterrupt(uint8_t pin) {}
+void Sensorino::maskGPIOInterrupt(uint8_t pin) {}
+void Sensorino::unmaskGPIOInterrupt(uint8_t pin) {}
+bool Sensorino::inInterrupt(void) { return 0; }
 #endif
 
 void Sensorino::attachGPIOInterrupt(uint8_t pin, uint8_t trigger,
@@ -10,7 +10,9 @@
 
 class Service;
 class Message;
+class MessageView;
 class RuleService;
+class DeltaEncoder;
 
 class GenIntrCallback {
 public:
@@ -21,13 +23,30 @@ class Sensorino {
     public:
         Sensorino(bool noSM = 0, bool noRE = 0);
 
-        void handleMessage(Message &m);
+        void handleMessage(MessageView &m);
         void setAddress(uint8_t address);
         uint8_t getAddress();
         uint8_t getBaseAddress() { return 0; };
 
+        /* From interrupt context while the radio is in use the message
+         * is sent from WorkQueue::run(), which the sketch's loop() must
+         * call whenever WorkQueue::pending().  A pool message is handed
+         * over as it is, others are copied into the pool.  The rules
+         * see a PUBLISH from WorkQueue::run() too.
+         */
         bool sendMessage(Message &m);
 
+        /* Opt-in: instead of sending every PUBLISH headed to the Base
+         * right away, collect the ones sent within @window timer ticks
+         * (F_TMR per second) and transmit them together as a single
+         * PUBLISH_BATCH frame, up to one radio payload, to save airtime.
+         * 0 disables coalescing.  An open batch takes up one
+         * Message::alloc() pool slot.
+         */
+        void setPublishCoalescing(uint32_t window);
+        /* Send whatever has been collected so far, e.g. before sleeping */
+        void flushPublishes(void);
+
         void addService(Service *s);
         void deleteService(Service *s);
 
@@ -51,6 +70,14 @@ class Sensorino {
         void attachGPIOInterrupt(uint8_t pin, uint8_t trigger,
                 GenIntrCallback *callback);
         void detachGPIOInterrupt(uint8_t pin);
+        /* A handler that leaves its work to a WorkQueue item can mask its
+         * pin until the item has run.  Unmasking a level-triggered pin
+         * whose level is still active calls the handler again.
+         */
+        void maskGPIOInterrupt(uint8_t pin);
+        void unmaskGPIOInterrupt(uint8_t pin);
+        /* True with interrupts disabled, e.g. in a handler */
+        static bool inInterrupt(void);
 
         /* This can be used in non-sleeping main loops for debugging
          * interrupts problems.
@@ -65,11 +92,32 @@ class Sensorino {
 
         RuleService *ruleEngine;
 
+        uint32_t coalesceWindow;
+        Message *coalesced;
+        /* When the open batch is due, in Timers::now() ticks */
+        uint32_t coalesceDeadline;
+        bool coalesceArmed;
+
+        bool transmit(MessageView &m);
+        bool queueFrame(Message &m);
+        bool coalescePublish(Message &m);
+        DeltaEncoder *getDeltaEncoder(MessageView &m, uint8_t pos);
+        void deltaSent(MessageView &m, bool acked);
+        static void coalesceTimeout(void);
+        static void coalesceWork(void *arg);
+        bool queueMessage(Message &m, void (*fn)(void *arg));
+        static void sendWork(void *arg);
+        static void ruleWork(void *arg);
+
         void radioOpDone(void);
         void radioCheckPacket(void);
         static void radioInterrupt(uint8_t pin);
+        static void radioWork(void *arg);
+        static void scheduleRadioWork(void);
+        static void radioRetry(void);
 
         static volatile uint8_t radioBusy;
+        static volatile bool radioRetryArmed;
 };
 
 #define attachObjGPIOInterrupt(pin, trigger, method) \
@@ -1,16 +1,25 @@
 #include "Sensorino.h"
 #include "Service.h"
 
-Service::Service(int _id) : id(_id) {
+Service::Service(int _id) : id(_id), delta(NULL) {
     sensorino->addService(this);
 }
 
-void Service::handleMessage(Message *message) {
+void Service::setDeltaCoding(uint8_t keyframeInterval) {
+    if (!delta)
+        delta = new DeltaEncoder(keyframeInterval);
+}
+
+void Service::handleMessage(MessageView *message) {
     switch (message->getType()) {
     case Message::SET:
         return onSet(message);
 
     case Message::REQUEST:
+        /* Whoever is asking may not have our delta coding reference */
+        if (delta)
+            delta->reset();
+
         /* NOTE: some things, like the current state request or
          * description request may be implemented here so as to
          * remove this burden from Service implementers.
@@ -23,14 +32,14 @@ void Service::handleMessage(Message *message) {
     }
 }
 
-Message *Service::publish(Message *message) {
+Message *Service::publish(MessageView *message) {
     /* NOTE: we may want to reference the original message Id in the
      * response somehow.
      */
     return startBaseMessage(Message::PUBLISH, message);
 }
 
-Message *Service::err(Message *message, Data::Type type) {
+Message *Service::err(MessageView *message, Data::Type type) {
     /* NOTE: we may want to reference the original message Id in the
      * response somehow.
      */
@@ -42,13 +51,11 @@ Message *Service::err(Message *message, Data::Type type) {
     return m;
 }
 
-Message *Service::startBaseMessage(Message::Type type, Message *orig) {
+Message *Service::startBaseMessage(Message::Type type,
+        MessageView *orig) {
     /* NOTE: internal messages (not transmitted over radio.. where
      * sender == addressee) may be implemented here or somewhere else.
      */
-    /* REVISIT: it may be desirable to avoid the malloc by using one
-     * (or a few) static Message instances over and over.
-     */
     uint8_t src = sensorino->getAddress();
     uint8_t dst = sensorino->getBaseAddress();
     Message *msg;
@@ -56,7 +63,8 @@ Message *Service::startBaseMessage(Message::Type type, Message *orig) {
     if (orig)
         dst = orig->getSrcAddress();
 
-    msg = new Message(src, dst);
+    /* Comes from the static Message pool, released by msg->send() */
+    msg = Message::allocOrDiscard(src, dst);
     msg->setType(type);
     msg->addIntValue(Data::SERVICE_ID, id);
     return msg;
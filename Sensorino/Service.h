@@ -11,6 +11,7 @@
 #include <stdint.h>
 
 #include "Message.h"
+#include "Delta.h"
 
 class Service {
 public:
@@ -22,28 +23,37 @@ public:
 
     int getId(void) { return id; }
 
-    void handleMessage(Message *message);
+    void handleMessage(MessageView *message);
+
+    /** Send the "fixed" coded values of this service's PUBLISHes as
+     * differences against the previous ones, with absolute values in
+     * every @keyframeInterval'th PUBLISH.  See Delta.h.
+     */
+    void setDeltaCoding(uint8_t keyframeInterval);
+    DeltaEncoder *getDeltaEncoder(void) { return delta; }
 
 protected:
     uint8_t id;
+    DeltaEncoder *delta;
 
     /* Services need to implement some of the following two: */
-    virtual void onSet(Message *message) { err(message)->send(); };
-    virtual void onRequest(Message *message) = 0;
+    virtual void onSet(MessageView *message) { err(message)->send(); };
+    virtual void onRequest(MessageView *message) = 0;
 
     /* Service implementations use this to start a new PUBLISH message.
      * When done constructing the contents, they'll call Message->send();
      */
-    Message *publish(Message *message = NULL);
+    Message *publish(MessageView *message = NULL);
 
     /* Service implementations use this to start a new ERR message.
      * When done constructing the contents, they'll call Message->send();
      */
-    Message *err(Message *message = NULL, Data::Type type = (Data::Type) -1);
+    Message *err(MessageView *message = NULL,
+            Data::Type type = (Data::Type) -1);
 
     /* Start a new message addressed at the Base or at the sender of
      * the original message. */
-    Message *startBaseMessage(Message::Type type, Message *orig);
+    Message *startBaseMessage(Message::Type type, MessageView *orig);
 
 private:
 };
@@ -15,7 +15,7 @@ public:
     }
 
 protected:
-    void onRequest(Message *message) {
+    void onRequest(MessageView *message) {
         Message *msg = publish(message);
         int svc_num = 0;
 
@@ -2,6 +2,7 @@
 
 #include "Service.h"
 #include "Timers.h"
+#include "WorkQueue.h"
 
 using namespace Data;
 
@@ -34,13 +35,13 @@ protected:
         msg->send();
     }
 
-    void onRequest(Message *message) {
+    void onRequest(MessageView *message) {
         Type req;
 
         /* If the request has no DataType value, or it's asking for the
          * SWITCH value, just send the current switch state.
          */
-        if (!message->find(DATATYPE, 0, &req) || req == SWITCH) {
+        if (!message->get<DATATYPE>(0, req) || req == SWITCH) {
             publishSwitch();
             return;
         }
@@ -60,7 +61,27 @@ protected:
         err(message, DATATYPE)->send();
     }
 
+    /* Top half: mask the pin so that the bouncing doesn't bring us back
+     * here and leave the debouncing and the PUBLISH to switchWork().
+     */
     void pinHandler(uint8_t pin) {
+        sensorino->maskGPIOInterrupt(pin);
+        scheduleWork();
+    }
+
+    /* Also the timer callback retrying a failed schedule().  The queue
+     * counts the drop, the pin stays masked until switchWork() runs so
+     * the edge isn't lost.
+     */
+    void scheduleWork(void) {
+        if (!WorkQueue::schedule(switchWork, this))
+            Timers::setObjTimeout(SwitchService::scheduleWork, 1);
+    }
+
+    /* Bottom half, runs from WorkQueue::run() */
+    static void switchWork(void *arg) {
+        SwitchService *svc = (SwitchService *) arg;
+        int pin = svc->pin;
 #ifdef DEBOUNCE
         uint8_t state = digitalRead(pin), count = 0, loops = 0;
         /* Wait until the pin reports the same value in N read()s in a row */
@@ -81,7 +102,8 @@ protected:
         }
 #endif
 
-        publishSwitch();
+        sensorino->unmaskGPIOInterrupt(pin);
+        svc->publishSwitch();
     }
 };
 /* vim: set sw=4 ts=4 et: */
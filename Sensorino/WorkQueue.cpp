@@ -0,0 +1,75 @@
+/*
+ * Deferred work for the Sensorino, see WorkQueue.h.
+ */
+#include <avr/interrupt.h>
+
+#include "WorkQueue.h"
+
+WorkQueue::Item WorkQueue::items[WORK_QUEUE_LEN];
+volatile uint8_t WorkQueue::head;
+volatile uint8_t WorkQueue::count;
+volatile uint16_t WorkQueue::drops;
+bool WorkQueue::running;
+
+bool WorkQueue::schedule(Func fn, void *arg) {
+    uint8_t sreg, i;
+    bool ret = 1;
+
+    sreg = SREG;
+    cli();
+
+    for (i = 0; i < count; i++) {
+        Item *item = &items[(uint8_t) (head + i) % WORK_QUEUE_LEN];
+
+        if (item->fn == fn && item->arg == arg)
+            break;
+    }
+
+    if (i < count)
+        ; /* Already waiting */
+    else if (count < WORK_QUEUE_LEN) {
+        Item *item = &items[(uint8_t) (head + count) % WORK_QUEUE_LEN];
+
+        item->fn = fn;
+        item->arg = arg;
+        count++;
+    } else {
+        drops++;
+        ret = 0;
+    }
+
+    SREG = sreg;
+    return ret;
+}
+
+void WorkQueue::run(void) {
+    uint8_t sreg;
+    Item item;
+
+    if (running)
+        return;
+    running = 1;
+
+    while (1) {
+        sreg = SREG;
+        cli();
+
+        if (!count) {
+            SREG = sreg;
+            break;
+        }
+
+        /* Take it off the queue first so it can schedule itself again */
+        item = items[head];
+        head = (head + 1) % WORK_QUEUE_LEN;
+        count--;
+
+        SREG = sreg;
+
+        item.fn(item.arg);
+    }
+
+    running = 0;
+}
+
+/* vim: set sw=4 ts=4 et: */
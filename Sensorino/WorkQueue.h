@@ -0,0 +1,55 @@
+/*
+ * Deferred work, "bottom halves", for the Sensorino.  An interrupt
+ * handler only does what can't wait, e.g. quiet the device that raised
+ * the interrupt, and schedule()s the rest.  The sketch's loop() calls
+ * run() after every wake-up and the work then runs with interrupts
+ * enabled, one item at a time: other interrupts are served meanwhile,
+ * work items never run inside each other and the stack doesn't grow with
+ * every nested handler.
+ *
+ * The queue is a fixed-size FIFO of function and argument pairs.
+ * Scheduling a pair that's already waiting does nothing so an interrupt
+ * that fires again before its work has run takes no more room.
+ */
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Items waiting, at most 255 */
+#ifndef WORK_QUEUE_LEN
+#define WORK_QUEUE_LEN 8
+#endif
+
+class WorkQueue {
+public:
+    typedef void (*Func)(void *arg);
+
+    /* Have @fn(@arg) called from run().  Safe from interrupt context.
+     * @return false if the queue is full, the item is then dropped and
+     * counted in dropped().
+     */
+    static bool schedule(Func fn, void *arg = NULL);
+    /* Call everything scheduled, including what gets scheduled
+     * meanwhile, until the queue is empty.  Does nothing when called
+     * from a work item.
+     */
+    static void run(void);
+    static bool pending(void) { return count; }
+    static uint16_t dropped(void) { return drops; }
+
+private:
+    struct Item {
+        Func fn;
+        void *arg;
+    };
+
+    static Item items[WORK_QUEUE_LEN];
+    static volatile uint8_t head, count;
+    static volatile uint16_t drops;
+    static bool running;
+};
+
+#endif // whole file
+/* vim: set sw=4 ts=4 et: */
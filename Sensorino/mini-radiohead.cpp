@@ -220,9 +220,11 @@ static void nrf24_set_tx_addr(uint8_t addr[3]) {
 }
 
 static uint8_t nrf24_in_rx = 0;
+static uint8_t nrf24_in_tx = 0;
 
 static void nrf24_rx_mode(void) {
-	if (nrf24_in_rx)
+	/* A Tx in progress switches back to Rx when it's done */
+	if (nrf24_in_rx || nrf24_in_tx)
 		return;
 
 	/* Rx mode */
@@ -295,7 +297,13 @@ static void nrf24_rx_read(uint8_t *buf, uint8_t *pkt_len) {
 	nrf24_write_reg(STATUS, 1 << RX_DR);
 }
 
-static void nrf24_tx(uint8_t *buf, uint8_t len) {
+/*
+ * Upload @len bytes from @buf followed by @tail_len bytes from @tail as one
+ * payload, so that a caller adding a header or trailer to a slice of its
+ * own buffer needn't assemble the payload in a temporary buffer first.
+ */
+static void nrf24_tx(const uint8_t *buf, uint8_t len,
+		const uint8_t *tail, uint8_t tail_len) {
 	/*
 	 * The user may have put the chip out of Rx mode to perform a
 	 * few Tx operations in a row, or they may have left the chip
@@ -325,12 +333,15 @@ static void nrf24_tx(uint8_t *buf, uint8_t len) {
 	 * new payloads for another while.
 	 */
 	nrf24_tx_flush();
+	nrf24_in_tx = 1;
 
 	nrf24_csn(0);
 
 	spi_transfer(W_TX_PAYLOAD);
 	while (len --)
 		spi_transfer(*buf ++);
+	while (tail_len --)
+		spi_transfer(*tail ++);
 
 	nrf24_csn(1);
 
@@ -341,6 +352,28 @@ static void nrf24_tx(uint8_t *buf, uint8_t len) {
 	nrf24_ce(1);
 }
 
+/* End the Tx op, @status says whether the payload got through */
+static int nrf24_tx_done(uint8_t status) {
+	nrf24_ce(0);
+
+	/* Reset status bits */
+	nrf24_write_reg(STATUS, (1 << MAX_RT) | (1 << TX_DS));
+	nrf24_in_tx = 0;
+
+	if (nrf24_in_rx) {
+		nrf24_in_rx = 0;
+
+		nrf24_rx_mode();
+	}
+
+	return (status & (1 << TX_DS)) ? 0 : -1;
+}
+
+static uint8_t nrf24_tx_finished(uint8_t status) {
+	return ((status & (1 << TX_DS)) && !(status & (1 << TX_FULL))) ||
+		(status & (1 << MAX_RT));
+}
+
 static int nrf24_tx_result_wait(void) {
 	uint8_t status;
 	uint16_t count = 10000; /* ~100ms timeout */
@@ -350,22 +383,31 @@ static int nrf24_tx_result_wait(void) {
 	/* Reset CE early so that a new Tx or Rx op can start sooner. */
 	nrf24_ce(0);
 
-	while ((!(status & (1 << TX_DS)) || (status & (1 << TX_FULL))) &&
-			!(status & (1 << MAX_RT)) && --count) {
+	while (!nrf24_tx_finished(status) && --count) {
 		delay8((int) (F_CPU / 8000L * 0.01));
 		status = nrf24_read_status();
 	}
 
-	/* Reset status bits */
-	nrf24_write_reg(STATUS, (1 << MAX_RT) | (1 << TX_DS));
+	return nrf24_tx_done(status);
+}
 
-	if (nrf24_in_rx) {
-		nrf24_in_rx = 0;
+/*
+ * Non-blocking version of the above, leaves CE high for as long as the
+ * Tx takes.  Returns 1 while the chip is still busy.
+ */
+static uint16_t nrf24_tx_start;
 
-		nrf24_rx_mode();
-	}
+static int nrf24_tx_result_poll(void) {
+	uint8_t status = nrf24_read_status();
 
-	return (status & (1 << TX_DS)) ? 0 : -1;
+	if (nrf24_tx_finished(status))
+		return nrf24_tx_done(status);
+
+	/* Same ~100ms timeout */
+	if ((uint16_t) millis() - nrf24_tx_start > 100)
+		return nrf24_tx_done(0);
+
+	return 1;
 }
 
 #include "mini-radiohead.h"
@@ -422,10 +464,34 @@ bool RHReliableDatagram::available() {
 bool RHReliableDatagram::sendtoWait(uint8_t *buf, uint8_t len,
 		uint8_t address) {
 	update_tx_addr(address);
-	nrf24_tx(buf, len);
+	nrf24_tx(buf, len, NULL, 0);
 	return !nrf24_tx_result_wait();
 }
 
+bool RHReliableDatagram::sendtoWait(const uint8_t *buf, uint8_t len,
+		uint8_t trailer, uint8_t address) {
+	update_tx_addr(address);
+	nrf24_tx(buf, len, &trailer, 1);
+	return !nrf24_tx_result_wait();
+}
+
+void RHReliableDatagram::sendtoStart(const uint8_t *buf, uint8_t len,
+		uint8_t trailer, uint8_t address) {
+	update_tx_addr(address);
+	nrf24_tx(buf, len, &trailer, 1);
+	nrf24_tx_start = millis();
+}
+
+int8_t RHReliableDatagram::sendtoPoll() {
+	int ret;
+
+	if (!nrf24_in_tx)
+		return RH_TX_FAILED;
+
+	ret = nrf24_tx_result_poll();
+	return ret > 0 ? RH_TX_PENDING : ret ? RH_TX_FAILED : RH_TX_OK;
+}
+
 bool RHReliableDatagram::recvfromAck(uint8_t *buf, uint8_t *len, uint8_t *from,
 		uint8_t *to, uint8_t *id, uint8_t *flags) {
 	if (!available())
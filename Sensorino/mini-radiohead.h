@@ -15,6 +15,16 @@ public:
 	RH_NRF24(uint8_t chipEnablePin, uint8_t slaveSelectPin);
 };
 
+/* RHReliableDatagram::sendtoWait() can append a trailer byte on its own */
+#define RH_HAVE_SENDTO_TRAILER
+/* ...and has a non-blocking variant, sendtoStart() and sendtoPoll() */
+#define RH_HAVE_SENDTO_START
+
+/* sendtoPoll() return values */
+#define RH_TX_OK	0
+#define RH_TX_FAILED	-1
+#define RH_TX_PENDING	1
+
 class RHReliableDatagram {
 public:
 	RHReliableDatagram(RHGenericDriver &driver, uint8_t thisAddress = 0);
@@ -22,6 +32,19 @@ public:
 	void setThisAddress(uint8_t new_addr);
 	bool available();
 	bool sendtoWait(uint8_t *buf, uint8_t len, uint8_t address);
+	/* Send @len bytes of @buf followed by @trailer in one payload */
+	bool sendtoWait(const uint8_t *buf, uint8_t len, uint8_t trailer,
+			uint8_t address);
+	/* Same as above but returns once the payload is uploaded, then
+	 * sendtoPoll() says RH_TX_PENDING until it's been acked (RH_TX_OK)
+	 * or the retries have run out (RH_TX_FAILED).  Nothing else may be
+	 * sent in the meantime.  The chip stays in Tx mode until then so
+	 * nothing new is received either, available() only reports what
+	 * was already in the Rx FIFO.  Rx resumes once the result is in.
+	 */
+	void sendtoStart(const uint8_t *buf, uint8_t len, uint8_t trailer,
+			uint8_t address);
+	int8_t sendtoPoll();
 	bool recvfromAck(uint8_t *buf, uint8_t *len, uint8_t *from = NULL,
 			uint8_t *to = NULL, uint8_t *id = NULL,
 			uint8_t *flags = NULL);
@@ -13,6 +13,7 @@
 #include <Sensorino.h>
 #include <RelayService.h>
 #include <Timers.h>
+#include <WorkQueue.h>
 
 Sensorino s;
 RelayService rs(2, 13, 0); /* The onboard LED is the "relay" */
@@ -35,4 +36,9 @@ void loop() {
   m.addBoolValue(SWITCH, on);
 
   s.handleMessage(m);
+
+  /* Handle incoming radio messages and anything else the interrupt
+   * handlers have left for us.
+   */
+  WorkQueue::run();
 }
@@ -13,6 +13,7 @@
 //#include <SPI.h>
 //#include <RH_NRF24.h>
 #include <Sensorino.h>
+#include <WorkQueue.h>
 #include <RelayService.h>
 #include <SwitchService.h>
 
@@ -111,12 +112,23 @@ void setup() {
 }
 
 void loop() {
+  /* Whatever the interrupt handlers left for us, e.g. incoming radio
+   * messages, runs here after each wake-up.
+   */
+  WorkQueue::run();
+
   if (Timers::pending())
     set_sleep_mode(SLEEP_MODE_STANDBY);
   else
     set_sleep_mode(SLEEP_MODE_PWR_DOWN);
-  /* Sequence recommended in <avr/sleep.h> */
+  /* Sequence recommended in <avr/sleep.h>, don't sleep if an interrupt
+   * has scheduled more work since the check.
+   */
   cli();
+  if (WorkQueue::pending()) {
+    sei();
+    return;
+  }
   //sleep_bod_disable();
   sei();
   sleep_cpu();
@@ -11,6 +11,7 @@
  * communication to work.
  */
 #include <Sensorino.h>
+#include <WorkQueue.h>
 #include <RelayService.h>
 #include <SwitchService.h>
 #include <OnchipThermometerService.h>
@@ -57,6 +58,12 @@ void setup() {
 
   s.setAddress(MY_NODE_ADDR);
 
+  /* A single wall switch action often makes several services publish,
+   * send whatever they publish within 50ms in one radio frame.  The
+   * main loop below stays in idle mode while the window is open.
+   */
+  s.setPublishCoalescing(F_TMR / 20);
+
   sleep_enable();
 
   /*
@@ -87,9 +94,23 @@ void setup() {
 }
 
 void loop() {
+  /* Incoming radio messages and the coalesced PUBLISH_BATCH frames are
+   * handled here after each wake-up.
+   */
+  WorkQueue::run();
+
   if (Timers::pending())
     set_sleep_mode(SLEEP_MODE_IDLE);
   else
     set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  /* Don't sleep if an interrupt has scheduled more work since the check,
+   * sei() takes effect after sleep_cpu() so nothing can slip in between.
+   */
+  cli();
+  if (WorkQueue::pending()) {
+    sei();
+    return;
+  }
+  sei();
   sleep_cpu();
 }
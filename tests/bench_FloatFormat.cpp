@@ -0,0 +1,246 @@
+/*
+ * Host-side benchmark of the float to text conversion used by the Json
+ * writer and printExpr(), compared against the conversions it replaced
+ * and against the C library.
+ *
+ * Built by tests/Makefile.  Run as "./bench_FloatFormat" to print the
+ * results, or as "./bench_FloatFormat bench_FloatFormat.baseline" to
+ * also compare against the stored baseline, same as bench_Message.cpp.
+ * The "bytes/op" column is the average text length.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <FloatFormat.h>
+
+/* Keep the compiler from optimising the measured work away */
+static volatile uint32_t sink;
+
+static uint64_t nsecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The Json writer's previous printFloat(), 5 decimals, null beyond 2e9 */
+static int legacyJson(char *str, float val) {
+    char *start = str, buf[12], *ptr = buf + sizeof(buf);
+    unsigned long frac, ival;
+    uint8_t digits = 5;
+
+    if (val != val || val > 2e9 || val < -2e9)
+        return sprintf(str, "null");
+
+    if (val < 0) {
+        *str++ = '-';
+        val = -val;
+    }
+
+    frac = (val - (unsigned long) val) * 100000.0 + 0.5;
+    ival = val;
+    if (frac >= 100000) {
+        ival++;
+        frac -= 100000;
+    }
+    do {
+        *--ptr = '0' + ival % 10;
+        ival /= 10;
+    } while (ival);
+    memcpy(str, ptr, buf + sizeof(buf) - ptr);
+    str += buf + sizeof(buf) - ptr;
+
+    *str++ = '.';
+    do {
+        *str++ = '0' + frac / 10000;
+        frac = frac % 10000 * 10;
+    } while (frac && --digits);
+
+    return str - start;
+}
+
+/* The expression decompiler's previous numToStr(), recursive division
+ * by 10
+ */
+static float legacyDigit(char *&str, float val) {
+    if (val >= 10.0f)
+        val = legacyDigit(str, val / 10.0f) * 10.0f;
+    *str++ = '0' + (int) val;
+    return val - (int) val;
+}
+
+static int legacyExpr(char *str, float val) {
+    char *start = str;
+    uint16_t frac;
+
+    if (val < 0.0f) {
+        *str++ = '-';
+        val = -val;
+    }
+    frac = legacyDigit(str, val) * 10000.0f;
+    if (frac)
+        *str++ = '.';
+    while (frac) {
+        *str++ = '0' + frac / 1000;
+        frac = (frac % 1000) * 10;
+    }
+
+    return str - start;
+}
+
+static int shortest(char *str, float val) {
+    return formatFloat(str, val);
+}
+
+static int libcShortest(char *str, float val) {
+    return sprintf(str, "%.9g", val);
+}
+
+/*
+ * Value mixes, the legacy conversions only handle the "sensor" range.
+ */
+#define VALUES 1024
+
+static float sensorValues[VALUES], wideValues[VALUES];
+
+static void buildValues(void) {
+    uint32_t seed = 1;
+
+    for (int i = 0; i < VALUES; i++) {
+        seed = seed * 1103515245 + 12345;
+
+        /* Readings with a few decimals: temperatures, voltages, etc. */
+        sensorValues[i] = (int32_t) (seed >> 8) % 200000 / 100.0f;
+
+        /* Any finite float */
+        uint32_t bits = (seed ^ (seed >> 15) << 17) & 0xfeffffff;
+        memcpy(&wideValues[i], &bits, sizeof(float));
+    }
+}
+
+static const struct Conv {
+    const char *name;
+    int (*conv)(char *str, float val);
+    bool sensorOnly;
+} convs[] = {
+    { "shortest", shortest, 0 },
+    { "legacy-json", legacyJson, 1 },
+    { "legacy-expr", legacyExpr, 1 },
+    { "libc-%.9g", libcShortest, 0 },
+};
+
+struct Result {
+    char name[64];
+    double nsPerOp;
+    double bytesPerOp;
+};
+
+static Result results[64];
+static int resultsNum;
+
+/* Each benchmark runs several times and the fastest run is reported */
+static void report(const char *op, const char *mix, uint64_t ns,
+        unsigned long iters, unsigned long bytes) {
+    char name[64];
+    Result *r;
+
+    snprintf(name, sizeof(name), "%s/%s", op, mix);
+    for (r = results; r < results + resultsNum; r++)
+        if (!strcmp(r->name, name))
+            break;
+
+    if (r == results + resultsNum) {
+        resultsNum++;
+        strcpy(r->name, name);
+    } else if (r->nsPerOp <= (double) ns / iters)
+        return;
+
+    r->nsPerOp = (double) ns / iters;
+    r->bytesPerOp = (double) bytes / iters;
+}
+
+#define ITERS 1000000UL
+#define RUNS 7
+
+/* Host timings are noisy, only flag changes well above the noise */
+#define REGRESSION_PCT 20.0
+
+static void benchConv(const Conv &conv, const char *mix,
+        const float *values) {
+    unsigned long bytes = 0;
+    char str[64];
+    uint64_t start = nsecs();
+
+    for (unsigned long i = 0; i < ITERS; i++) {
+        int len = conv.conv(str, values[i & (VALUES - 1)]);
+
+        bytes += len;
+        sink += str[len - 1];
+    }
+
+    report(conv.name, mix, nsecs() - start, ITERS, bytes);
+}
+
+static int compareBaseline(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[256];
+    int regressions = 0;
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    printf("\n%-28s %12s %12s %8s\n", "vs. baseline", "base ns/op",
+            "ns/op", "change");
+
+    while (fgets(line, sizeof(line), f)) {
+        char name[64];
+        double ns, bytes;
+
+        if (line[0] == '#' ||
+                sscanf(line, "%63s %lf %lf", name, &ns, &bytes) != 3)
+            continue;
+
+        for (int i = 0; i < resultsNum; i++) {
+            if (strcmp(results[i].name, name))
+                continue;
+
+            double change = (results[i].nsPerOp - ns) / ns * 100.0;
+            bool bad = change > REGRESSION_PCT;
+
+            printf("%-28s %12.2f %12.2f %+7.1f%%%s\n", name, ns,
+                    results[i].nsPerOp, change, bad ? " REGRESSION" : "");
+            regressions += bad;
+        }
+    }
+
+    fclose(f);
+    return regressions ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    buildValues();
+
+    for (int run = 0; run < RUNS; run++)
+        for (unsigned int i = 0; i < sizeof(convs) / sizeof(*convs); i++) {
+            benchConv(convs[i], "sensor", sensorValues);
+            if (!convs[i].sensorOnly)
+                benchConv(convs[i], "wide", wideValues);
+        }
+
+    printf("# %-26s %12s %12s\n", "benchmark", "ns/op", "bytes/op");
+    for (int i = 0; i < resultsNum; i++)
+        printf("%-28s %12.2f %12.2f\n", results[i].name,
+                results[i].nsPerOp, results[i].bytesPerOp);
+
+    if (argc > 1)
+        return compareBaseline(argv[1]);
+
+    return 0;
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,304 @@
+/*
+ * Host-side benchmark of the Message TLV codec hot path: building PUBLISH
+ * payloads, Message::find() lookups and the iterator loop used by the
+ * rule engine and the JSON converter.
+ *
+ * Built by tests/Makefile.  Run as "./bench_Message" to print the
+ * results, or as "./bench_Message bench_Message.baseline", which is what
+ * "make bench" does, to also compare each line against the stored
+ * baseline.  Lines that got more than REGRESSION_PCT slower are marked
+ * with "REGRESSION" and the exit status is non-zero.  Baselines are only
+ * comparable on the machine they were recorded on.  To refresh the
+ * baseline redirect the output of a plain "./bench_Message" run into the
+ * baseline file, in a commit of its own that says why.  A change that
+ * makes the code slower doesn't get to refresh it, the regression has to
+ * stay visible.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <Message.h>
+#include <Sensorino.h>
+
+using namespace Data;
+
+/* Message.cpp references these, provide minimal stand-ins like Base does */
+void Sensorino::die(const prog_char *err) {
+    fprintf(stderr, "Panic because: %s\n", err);
+    exit(2);
+}
+
+bool Sensorino::sendMessage(Message &m) {
+    return 0;
+}
+
+Sensorino *sensorino;
+
+/* Keep the compiler from optimising the measured work away */
+static volatile uint32_t sink;
+
+static uint64_t nsecs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Payload mixes modelled on what the existing services emit.
+ */
+static const uint8_t ruleExpr[] = { 6, 3, 3, 52, 0, 4, 3, 52, 0 };
+static const uint8_t ruleAction[] = { 1, 1, 2 };
+
+static void buildSwitch(Message &m) {
+    /* SwitchService::publishSwitch */
+    m.addIntValue(SERVICE_ID, 20);
+    m.addBoolValue(SWITCH, 1);
+}
+
+static void buildThermometer(Message &m) {
+    /* OnchipThermometerService::publishValue */
+    m.addIntValue(SERVICE_ID, 30);
+    m.addFloatValue(TEMPERATURE, 21.375f);
+}
+
+static void buildDescription(Message &m) {
+    /* RuleService::onRequest service description */
+    m.addIntValue(SERVICE_ID, 1);
+    m.addIntValue(COUNT, 0);
+    m.addIntValue(COUNT, 2);
+    m.addDataTypeValue(EXPRESSION);
+    m.addDataTypeValue(MESSAGE);
+}
+
+static void buildMultiSensor(Message &m) {
+    /* A weather-station style node publishing everything at once */
+    m.addIntValue(SERVICE_ID, 40);
+    m.addFloatValue(TEMPERATURE, 21.375f);
+    m.addFloatValue(TEMPERATURE, -3.5f);
+    m.addFloatValue(RELATIVE_HUMIDITY, 55.25f);
+    m.addFloatValue(PRESSURE, 101325.0f);
+    m.addFloatValue(VOLTAGE, 3.3f);
+    m.addFloatValue(ILLUMINANCE, 1200.0f);
+    m.addBoolValue(PRESENCE, 1);
+    m.addBoolValue(SWITCH, 0);
+    m.addIntValue(COUNT, 12345);
+}
+
+static void buildRule(Message &m) {
+    /* RuleService rule dump */
+    m.addIntValue(SERVICE_ID, 1);
+    m.addIntValue(COUNT, 5);
+    m.addBinaryValue(EXPRESSION, ruleExpr, sizeof(ruleExpr));
+    m.addBinaryValue(MESSAGE, ruleAction, sizeof(ruleAction));
+}
+
+static const struct Mix {
+    const char *name;
+    void (*build)(Message &m);
+    /* Element looked up by the find benchmark, the last one of the mix
+     * so that the lookup has to walk the whole payload.
+     */
+    Data::Type findType;
+    int findNum;
+} mixes[] = {
+    { "switch", buildSwitch, SWITCH, 0 },
+    { "thermometer", buildThermometer, TEMPERATURE, 0 },
+    { "description", buildDescription, DATATYPE, 1 },
+    { "multisensor", buildMultiSensor, COUNT, 0 },
+    { "rule", buildRule, MESSAGE, 0 },
+};
+
+struct Result {
+    char name[64];
+    double nsPerOp;
+    double bytesPerOp;
+};
+
+static Result results[64];
+static int resultsNum;
+
+/* Each benchmark runs several times and the fastest run is reported to
+ * filter out scheduling noise on the host.
+ */
+static void report(const char *op, const char *mix, uint64_t ns,
+        unsigned long iters, unsigned long bytes) {
+    char name[64];
+    Result *r;
+
+    snprintf(name, sizeof(name), "%s/%s", op, mix);
+    for (r = results; r < results + resultsNum; r++)
+        if (!strcmp(r->name, name))
+            break;
+
+    if (r == results + resultsNum) {
+        resultsNum++;
+        strcpy(r->name, name);
+    } else if (r->nsPerOp <= (double) ns / iters)
+        return;
+
+    r->nsPerOp = (double) ns / iters;
+    r->bytesPerOp = (double) bytes / iters;
+}
+
+#define ITERS 1000000UL
+#define RUNS 7
+
+/* Host timings are noisy, only flag changes well above the noise */
+#define REGRESSION_PCT 20.0
+
+static void benchAdd(const Mix &mix) {
+    unsigned long bytes = 0;
+    uint64_t start = nsecs();
+
+    for (unsigned long i = 0; i < ITERS; i++) {
+        Message m(1, 0);
+        m.setType(Message::PUBLISH);
+        mix.build(m);
+        bytes += m.getRawLength() - HEADERS_LENGTH;
+        sink += m.getRawData()[HEADERS_LENGTH];
+    }
+
+    report("add", mix.name, nsecs() - start, ITERS, bytes);
+}
+
+static void benchFind(const Mix &mix) {
+    Message m(1, 0);
+    unsigned long bytes = 0;
+    uint8_t value[8];
+
+    m.setType(Message::PUBLISH);
+    mix.build(m);
+
+    uint64_t start = nsecs();
+
+    for (unsigned long i = 0; i < ITERS; i++) {
+        sink += m.find(mix.findType, mix.findNum, value);
+        sink += value[0];
+        bytes += m.getRawLength() - HEADERS_LENGTH;
+    }
+
+    report("find", mix.name, nsecs() - start, ITERS, bytes);
+}
+
+static void benchIter(const Mix &mix) {
+    Message m(1, 0);
+    unsigned long bytes = 0;
+
+    m.setType(Message::PUBLISH);
+    mix.build(m);
+
+    uint64_t start = nsecs();
+
+    for (unsigned long i = 0; i < ITERS; i++) {
+        for (Message::iter it = m.begin(); it; m.iterAdvance(it)) {
+            Data::Type t;
+            uint8_t value[8];
+
+            m.iterGetTypeValue(it, &t, value);
+            sink += t + value[0];
+        }
+        bytes += m.getRawLength() - HEADERS_LENGTH;
+    }
+
+    report("iter", mix.name, nsecs() - start, ITERS, bytes);
+}
+
+/* Same as the find benchmark but looking up every element of the message
+ * in turn, which is what RuleService does for multi-variable rules.
+ */
+static void benchFindAll(const Mix &mix) {
+    Message m(1, 0);
+    unsigned long bytes = 0;
+    Data::Type types[32];
+    int nums[32], count = 0;
+
+    m.setType(Message::PUBLISH);
+    mix.build(m);
+
+    for (Message::iter it = m.begin(); it; m.iterAdvance(it)) {
+        m.iterGetTypeValue(it, &types[count], NULL);
+        nums[count] = 0;
+        for (int j = 0; j < count; j++)
+            if (types[j] == types[count])
+                nums[count]++;
+        count++;
+    }
+
+    uint64_t start = nsecs();
+
+    for (unsigned long i = 0; i < ITERS / count; i++) {
+        for (int j = 0; j < count; j++) {
+            uint8_t value[8];
+
+            sink += m.find(types[j], nums[j], value);
+            sink += value[0];
+        }
+        bytes += m.getRawLength() - HEADERS_LENGTH;
+    }
+
+    report("findall", mix.name, nsecs() - start, ITERS / count, bytes);
+}
+
+static int compareBaseline(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[256];
+    int regressions = 0;
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    printf("\n%-28s %12s %12s %8s\n", "vs. baseline", "base ns/op",
+            "ns/op", "change");
+
+    while (fgets(line, sizeof(line), f)) {
+        char name[64];
+        double ns, bytes;
+
+        if (line[0] == '#' ||
+                sscanf(line, "%63s %lf %lf", name, &ns, &bytes) != 3)
+            continue;
+
+        for (int i = 0; i < resultsNum; i++) {
+            if (strcmp(results[i].name, name))
+                continue;
+
+            double change = (results[i].nsPerOp - ns) / ns * 100.0;
+            bool bad = change > REGRESSION_PCT;
+
+            printf("%-28s %12.2f %12.2f %+7.1f%%%s\n", name, ns,
+                    results[i].nsPerOp, change, bad ? " REGRESSION" : "");
+            regressions += bad;
+        }
+    }
+
+    fclose(f);
+    return regressions ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    for (int run = 0; run < RUNS; run++)
+        for (unsigned int i = 0; i < sizeof(mixes) / sizeof(*mixes); i++) {
+            benchAdd(mixes[i]);
+            benchFind(mixes[i]);
+            benchFindAll(mixes[i]);
+            benchIter(mixes[i]);
+        }
+
+    printf("# %-26s %12s %12s\n", "benchmark", "ns/op", "bytes/op");
+    for (int i = 0; i < resultsNum; i++)
+        printf("%-28s %12.2f %12.2f\n", results[i].name,
+                results[i].nsPerOp, results[i].bytesPerOp);
+
+    if (argc > 1)
+        return compareBaseline(argv[1]);
+
+    return 0;
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,265 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <Expression.h>
+#include <ExprOptimizer.h>
+#include <gmock/gmock.h>
+
+using namespace Expression;
+
+#define COUNT 5 /* Data::COUNT, any type will do */
+
+static float vars[4];
+static uint8_t useMask;
+
+/* Same evaluation as RuleService::evalExpression() with the variables
+ * taken from vars[], also records which ones were used.
+ */
+static float eval(const uint8_t *&expr) {
+    uint8_t op = *expr++, count;
+    float val, op1, op2, ret;
+    uint32_t bits;
+
+    switch (op) {
+    case VAL_INT8:
+        return (int8_t) *expr++;
+    case VAL_INT16:
+        expr += 2;
+        return (int16_t) ((expr[-2] << 8) | expr[-1]);
+    case VAL_FLOAT:
+        bits = ((uint32_t) expr[0] << 24) | ((uint32_t) expr[1] << 16) |
+            ((uint32_t) expr[2] << 8) | expr[3];
+        expr += 4;
+        memcpy(&val, &bits, sizeof(val));
+        return val;
+    case VAL_VARIABLE:
+    case VAL_PREVIOUS:
+        expr += 3;
+        useMask |= 1 << (expr[-1] & 3);
+        return vars[expr[-1] & 3];
+    case OP_NOT:
+        op1 = eval(expr);
+        return isnan(op1) ? NAN : !IS_TRUE(op1);
+    case OP_NEG:
+        return -eval(expr);
+    case OP_IN:
+        count = *expr++;
+        val = eval(expr);
+        ret = 0;
+        while (count--) {
+            op1 = val - eval(expr);
+            if (IS_ZERO(op1))
+                ret = 1;
+        }
+        return ret;
+    case OP_IFELSE:
+        val = eval(expr);
+        op1 = eval(expr);
+        op2 = eval(expr);
+        return IS_TRUE(val) ? op1 : op2;
+    case OP_BETWEEN:
+        val = eval(expr);
+        op1 = eval(expr);
+        op2 = eval(expr);
+        return evalBetween(val, op1, op2);
+    default:
+        op1 = eval(expr);
+        op2 = eval(expr);
+        return evalBinary(op, op1, op2);
+    }
+}
+
+static uint8_t optimize(const uint8_t *in, uint8_t len, uint8_t *out) {
+    return exprOptimize(in, len, out, 64);
+}
+
+#define EXPECT_OPTIMIZED(expected, in) \
+    do { \
+        uint8_t out[64]; \
+        uint8_t len = optimize(in, sizeof(in), out); \
+        ASSERT_EQ(sizeof(expected), len); \
+        EXPECT_EQ(0, memcmp(expected, out, len)); \
+    } while (0)
+
+/* Bytecode of the variable COUNT number @num of service 3 */
+#define VAR(num) VAL_VARIABLE, 3, COUNT, num
+#define MINUS_ZERO VAL_FLOAT, 0x80, 0x00, 0x00, 0x00
+
+TEST(ExprOptimizerTest, Folding) {
+    /* (2 * 3) + x is 6 + x */
+    static const uint8_t in0[] = {
+        OP_ADD, OP_MULT, VAL_INT8, 2, VAL_INT8, 3, VAR(0) };
+    static const uint8_t out0[] = { OP_ADD, VAL_INT8, 6, VAR(0) };
+    EXPECT_OPTIMIZED(out0, in0);
+
+    /* 2.0 - 100 * 10 takes two bytes, -0 needs to stay a float */
+    static const uint8_t in1[] = {
+        OP_SUB, VAL_FLOAT, 0x40, 0x00, 0x00, 0x00,
+        OP_MULT, VAL_INT8, 100, VAL_INT8, 10 };
+    static const uint8_t out1[] = { VAL_INT16, 0xfc, 0x1a };
+    EXPECT_OPTIMIZED(out1, in1);
+    static const uint8_t in2[] = { OP_NEG, VAL_INT8, 0 };
+    static const uint8_t out2[] = { MINUS_ZERO };
+    EXPECT_OPTIMIZED(out2, in2);
+
+    /* 2 in 1, 2 is 1, x in 1, 2 stays */
+    static const uint8_t in3[] = {
+        OP_IN, 2, VAL_INT8, 2, VAL_INT8, 1, VAL_INT8, 2 };
+    static const uint8_t out3[] = { VAL_INT8, 1 };
+    EXPECT_OPTIMIZED(out3, in3);
+    static const uint8_t in4[] = {
+        OP_IN, 2, VAR(0), VAL_INT8, 1, VAL_INT8, 2 };
+    EXPECT_OPTIMIZED(in4, in4);
+}
+
+TEST(ExprOptimizerTest, Identities) {
+    /* 1 * x, x / -1, --x */
+    static const uint8_t in0[] = { OP_MULT, VAL_INT8, 1, VAR(0) };
+    static const uint8_t out0[] = { VAR(0) };
+    EXPECT_OPTIMIZED(out0, in0);
+    static const uint8_t in1[] = { OP_DIV, VAR(0), VAL_INT8, 0xff };
+    static const uint8_t out1[] = { OP_NEG, VAR(0) };
+    EXPECT_OPTIMIZED(out1, in1);
+    static const uint8_t in2[] = { OP_NEG, OP_NEG, VAR(0) };
+    EXPECT_OPTIMIZED(out0, in2);
+
+    /* x + 0 and x - -0 are not x for x = -0 */
+    static const uint8_t in3[] = { OP_ADD, VAR(0), VAL_INT8, 0 };
+    EXPECT_OPTIMIZED(in3, in3);
+    static const uint8_t in4[] = { OP_SUB, VAR(0), MINUS_ZERO };
+    EXPECT_OPTIMIZED(in4, in4);
+
+    /* Variables in the branch not taken are kept, the rule needs them */
+    static const uint8_t in5[] = {
+        OP_IFELSE, VAL_INT8, 1, VAR(0), VAL_INT8, 5 };
+    EXPECT_OPTIMIZED(out0, in5);
+    static const uint8_t in6[] = {
+        OP_IFELSE, VAL_INT8, 1, VAL_INT8, 5, VAR(0) };
+    EXPECT_OPTIMIZED(in6, in6);
+}
+
+TEST(ExprOptimizerTest, Malformed) {
+    static const uint8_t trunc[] = { OP_ADD, VAL_INT8, 1 };
+    static const uint8_t extra[] = { VAL_INT8, 1, VAL_INT8, 2 };
+    static const uint8_t badOp[] = { 0xff };
+    static const uint8_t in[] = { OP_ADD, VAR(0), VAR(1) };
+    uint8_t out[64];
+
+    EXPECT_EQ(0, optimize(trunc, sizeof(trunc), out));
+    EXPECT_EQ(0, optimize(extra, sizeof(extra), out));
+    EXPECT_EQ(0, optimize(badOp, sizeof(badOp), out));
+    EXPECT_EQ(0, exprOptimize(in, sizeof(in), out, sizeof(in) - 1));
+    EXPECT_EQ(sizeof(in), exprOptimize(in, sizeof(in), out, sizeof(in)));
+}
+
+/* Random expression of depth up to @depth at @buf */
+static uint32_t seed = 1;
+
+static uint32_t rnd(uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+static void randomExpr(uint8_t *&buf, int depth) {
+    static const uint8_t binOps[] = {
+        OP_EQ, OP_NE, OP_LT, OP_GT, OP_LE, OP_GE,
+        OP_OR, OP_AND, OP_ADD, OP_SUB, OP_MULT, OP_DIV,
+    };
+    static const float consts[] = {
+        0.0f, -0.0f, 1.0f, -1.0f, 0.5f, 2.0f, 3.3f, 1000.0f, 40000.0f,
+        1.5e-7f, NAN, INFINITY,
+    };
+    uint32_t bits;
+
+    if (!depth || !rnd(3)) {
+        if (rnd(2)) {
+            *buf++ = VAL_VARIABLE;
+            *buf++ = 3;
+            *buf++ = COUNT;
+            *buf++ = rnd(4);
+        } else {
+            memcpy(&bits, &consts[rnd(sizeof(consts) / sizeof(*consts))], 4);
+            *buf++ = VAL_FLOAT;
+            *buf++ = bits >> 24;
+            *buf++ = bits >> 16;
+            *buf++ = bits >> 8;
+            *buf++ = bits;
+        }
+        return;
+    }
+
+    switch (rnd(6)) {
+    case 0:
+        *buf++ = rnd(2) ? OP_NOT : OP_NEG;
+        randomExpr(buf, depth - 1);
+        break;
+    case 1:
+        *buf++ = rnd(2) ? OP_IFELSE : OP_BETWEEN;
+        randomExpr(buf, depth - 1);
+        randomExpr(buf, depth - 1);
+        randomExpr(buf, depth - 1);
+        break;
+    case 2:
+        *buf++ = OP_IN;
+        *buf++ = 2;
+        randomExpr(buf, depth - 1);
+        randomExpr(buf, depth - 1);
+        randomExpr(buf, depth - 1);
+        break;
+    default:
+        *buf++ = binOps[rnd(sizeof(binOps))];
+        randomExpr(buf, depth - 1);
+        randomExpr(buf, depth - 1);
+    }
+}
+
+TEST(ExprOptimizerTest, SameResult) {
+    static const float values[] = {
+        0.0f, -0.0f, 1.0f, -1.0f, 0.5f, 3.3f, 1e30f, NAN, INFINITY,
+    };
+    uint8_t in[1024], out[256];
+
+    for (int i = 0; i < 20000; i++) {
+        uint8_t *end = in;
+
+        randomExpr(end, 4);
+        if (end - in > 255)
+            continue;
+
+        uint8_t inLen = end - in;
+        uint8_t outLen = exprOptimize(in, inLen, out, sizeof(out) - 1);
+        ASSERT_NE(0, outLen);
+        ASSERT_LE(outLen, inLen);
+
+        for (int j = 0; j < 8; j++) {
+            const uint8_t *inPtr = in, *outPtr = out;
+            float inVal, outVal;
+            uint8_t inMask;
+
+            for (int v = 0; v < 4; v++)
+                vars[v] = values[rnd(sizeof(values) / sizeof(*values))];
+
+            useMask = 0;
+            inVal = eval(inPtr);
+            inMask = useMask;
+            useMask = 0;
+            outVal = eval(outPtr);
+
+            ASSERT_EQ(in + inLen, inPtr);
+            ASSERT_EQ(out + outLen, outPtr);
+            ASSERT_EQ(inMask, useMask);
+            if (isnan(inVal))
+                ASSERT_TRUE(isnan(outVal));
+            else
+                ASSERT_EQ(0, memcmp(&inVal, &outVal, sizeof(inVal)));
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set sw=4 ts=4 et: */
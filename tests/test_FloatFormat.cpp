@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <FloatFormat.h>
+#include <gmock/gmock.h>
+
+static bool sameFloat(float a, float b) {
+    return !memcmp(&a, &b, sizeof(a));
+}
+
+static float fromBits(uint32_t bits) {
+    float val;
+
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+/* Number of significant digits in the shortest "%.*e" that reads back */
+static int shortestDigits(float val) {
+    char buf[32];
+    int digits;
+
+    for (digits = 1; digits < 9; digits++) {
+        snprintf(buf, sizeof(buf), "%.*e", digits - 1, val);
+        if (sameFloat(strtof(buf, NULL), val))
+            break;
+    }
+
+    return digits;
+}
+
+/* Round trip of one value through every path that matters */
+static void checkValue(float val) {
+    char str[FLOAT_STR_SIZE + 8];
+    FloatDecimal dec = floatToDecimal(val);
+    uint8_t len = formatFloat(str, val);
+    int digits = 0;
+
+    ASSERT_EQ(strlen(str), len);
+    ASSERT_LT(len, FLOAT_STR_SIZE);
+    ASSERT_TRUE(sameFloat(strtof(str, NULL), val)) << str;
+
+    float back = decimalToFloat(dec.digits, dec.exp);
+    ASSERT_TRUE(sameFloat(dec.negative ? -back : back, val)) << str;
+
+    for (uint32_t d = dec.digits; d; d /= 10)
+        digits++;
+    if (val != 0.0f) {
+        ASSERT_LE(digits, shortestDigits(val)) << str;
+    }
+}
+
+TEST(FloatFormatTest, KnownValues) {
+    static const struct {
+        float val;
+        const char *str;
+    } known[] = {
+        { 0.0f, "0.0" },
+        { -0.0f, "-0.0" },
+        { 1.0f, "1.0" },
+        { -3.5f, "-3.5" },
+        { 21.375f, "21.375" },
+        { 0.1f, "0.1" },
+        { 3.3f, "3.3" },
+        { 101325.0f, "101325.0" },
+        { 123456789.0f, "123456790.0" },
+        { 1e9f, "1e9" },
+        { 2e9f, "2e9" },
+        { 1e-5f, "0.00001" },
+        { 9.99e-6f, "9.99e-6" },
+        { 3.4028235e38f, "3.4028235e38" },
+        { 1.17549435e-38f, "1.1754944e-38" },
+        { 1.4e-45f, "1e-45" },
+        { NAN, "null" },
+        { INFINITY, "null" },
+        { -INFINITY, "null" },
+    };
+    char str[FLOAT_STR_SIZE];
+
+    for (unsigned int i = 0; i < sizeof(known) / sizeof(*known); i++) {
+        formatFloat(str, known[i].val);
+        EXPECT_STREQ(known[i].str, str);
+    }
+}
+
+TEST(FloatFormatTest, RoundTripCorpus) {
+    uint32_t seed = 1;
+
+    /* Powers of 2 and 10, the interval bounds are the tricky cases */
+    for (int e = -149; e <= 127; e++)
+        checkValue(ldexpf(1.0f, e));
+    for (int e = -45; e <= 38; e++) {
+        char str[32];
+
+        snprintf(str, sizeof(str), "1e%i", e);
+        checkValue(strtof(str, NULL));
+        snprintf(str, sizeof(str), "9.999999e%i", e - 1);
+        checkValue(strtof(str, NULL));
+    }
+
+    /* Subnormals, the normal range boundaries and the largest values */
+    for (uint32_t bits = 0; bits < 1000; bits++) {
+        checkValue(fromBits(bits));
+        checkValue(fromBits(0x00800000 + bits - 500));
+        checkValue(fromBits(0x7f7fffff - bits));
+    }
+
+    /* Values the sensors and the rule expressions actually carry */
+    for (int i = -100000; i <= 100000; i++) {
+        checkValue(i / 100.0f);
+        checkValue(i / 1024.0f);
+    }
+
+    /* Random bit patterns, same corpus every run */
+    for (int i = 0; i < 300000; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t bits = seed ^ (seed >> 15) << 17;
+
+        if ((bits & 0x7f800000) != 0x7f800000)
+            checkValue(fromBits(bits));
+    }
+}
+
+TEST(FloatFormatTest, Notation) {
+    char str[FLOAT_STR_SIZE];
+
+    /* Plain notation always has a dot so that floats stay floats */
+    formatFloat(str, 16777216.0f);
+    EXPECT_STREQ("16777216.0", str);
+    formatFloat(str, 0.000015f);
+    EXPECT_STREQ("0.000015", str);
+    formatFloat(str, -1.5e10f);
+    EXPECT_STREQ("-1.5e10", str);
+
+    /* The longest output fits in FLOAT_STR_SIZE */
+    EXPECT_EQ(FLOAT_STR_SIZE - 1, formatFloat(str, -1.14440945e-5f));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -1,13 +1,24 @@
-/*
- * Compilation from within the Sensorino subdirectory:
- * g++ -isystem ../gmock/gmock-1.7.0/gtest/include/ -I ../gmock/gmock-1.7.0/gtest/  -isystem  ../gmock/gmock-1.7.0/include/ -I ../gmock -pthread -I ../libraries/RadioHead -I ../libraries/RadioHead/RHutil  -I . ../tests/test_Message.cpp Message.cpp Sensorino.cpp ../libraries/RadioHead/Dummy.cpp ../libraries/RadioHead/RHGenericDriver.cpp ../libraries/RadioHead/RHReliableDatagram.cpp ../libraries/RadioHead/RHDatagram.cpp ../libraries/RadioHead/RHutil/simulator.cpp  Service.cpp  ../gmock/libgmock.a  -o test
- *
- */
+#include <stdio.h>
 
 #include <Message.h>
-#include <RHutil/simulator.h>
+#include <Delta.h>
+#include <Sensorino.h>
 #include <gmock/gmock.h>
 
+using namespace Data;
+
+/* Message.cpp references these, provide minimal stand-ins like Base does */
+void Sensorino::die(const prog_char *err) {
+    fprintf(stderr, "Panic because: %s\n", err);
+    exit(2);
+}
+
+bool Sensorino::sendMessage(Message &m) {
+    return 0;
+}
+
+Sensorino *sensorino;
+
 TEST(MessageTest, MsgIds) {
 
   uint8_t srcAddress=1;
@@ -46,18 +57,12 @@ TEST(MessageTest, AddGetValue) {
 
 TEST(MessageTest, AddTooManyValues) {
 
+    /* Each value takes at least 3 bytes, one more than fits */
     EXPECT_EXIT(
         {
             Message m=Message(255, 128);
-            m.addFloatValue(TEMPERATURE, 19.23);
-            m.addFloatValue(TEMPERATURE, 19.23);
-            m.addFloatValue(TEMPERATURE, 19.23);
-            m.addFloatValue(TEMPERATURE, 19.23);
-            m.addFloatValue(TEMPERATURE, 19.23);
-            m.addFloatValue(TEMPERATURE, 19.23);
-            m.addFloatValue(TEMPERATURE, 19.23);
-            m.addFloatValue(TEMPERATURE, 19.23);
-            m.addFloatValue(TEMPERATURE, 19.23);
+            for (int i = 0; i <= PAYLOAD_LENGTH / 3; i++)
+                m.addFloatValue(TEMPERATURE, 19.23);
         },
         ::testing::ExitedWithCode(2),
         //".*constructing message bigger that max size.*"
@@ -68,9 +73,384 @@ TEST(MessageTest, AddTooManyValues) {
 }
 
 
+TEST(MessageTest, Pool) {
+    Message *msgs[MESSAGE_POOL_SIZE];
+    uint16_t exhausted = Message::getPoolStats().exhausted;
+    uint16_t discarded = Message::getPoolStats().discarded;
+
+    for (int i = 0; i < MESSAGE_POOL_SIZE; i++) {
+        msgs[i] = Message::alloc(1, 2);
+        ASSERT_TRUE(msgs[i] != NULL);
+        EXPECT_EQ(1, msgs[i]->getSrcAddress());
+        EXPECT_EQ(2, msgs[i]->getDstAddress());
+        EXPECT_EQ(HEADERS_LENGTH, msgs[i]->getRawLength());
+    }
+    EXPECT_EQ(MESSAGE_POOL_SIZE, Message::getPoolStats().inUse);
+
+    /* Exhausted */
+    EXPECT_TRUE(Message::alloc(1, 2) == NULL);
+    EXPECT_EQ(exhausted + 1, Message::getPoolStats().exhausted);
+
+    /* The discard sink is still usable but is not part of the pool */
+    Message *d = Message::allocOrDiscard(3, 4);
+    ASSERT_TRUE(d != NULL);
+    d->addIntValue(SERVICE_ID, 5);
+    d->release();
+    EXPECT_EQ(MESSAGE_POOL_SIZE, Message::getPoolStats().inUse);
+    EXPECT_EQ(discarded + 1, Message::getPoolStats().discarded);
+
+    /* Double release is harmless */
+    msgs[0]->release();
+    msgs[0]->release();
+    EXPECT_EQ(MESSAGE_POOL_SIZE - 1, Message::getPoolStats().inUse);
+
+    Message *m = Message::alloc(5, 6);
+    EXPECT_EQ(msgs[0], m);
+    EXPECT_EQ(5, m->getSrcAddress());
+
+    /* A kept message survives one release */
+    EXPECT_TRUE(m->keep());
+    m->release();
+    EXPECT_EQ(MESSAGE_POOL_SIZE, Message::getPoolStats().inUse);
+    Message local;
+    EXPECT_FALSE(local.keep());
+
+    for (int i = 0; i < MESSAGE_POOL_SIZE; i++)
+        msgs[i]->release();
+    EXPECT_EQ(0, Message::getPoolStats().inUse);
+    EXPECT_EQ(MESSAGE_POOL_SIZE, Message::getPoolStats().peak);
+}
+
+TEST(MessageTest, FixedCoding) {
+    Message m(1, 2);
+    float value;
+    Data::Type t;
+
+    /* Type + length + 2 bytes of 0.01 units */
+    m.addFloatValue(TEMPERATURE, -12.34f);
+    EXPECT_EQ(HEADERS_LENGTH + 4, m.getRawLength());
+    ASSERT_TRUE(m.find(TEMPERATURE, 0, &value));
+    EXPECT_FLOAT_EQ(-12.34f, value);
+
+    /* Rounded to the nearest unit */
+    m.addFloatValue(VOLTAGE, 3.2996f);
+    ASSERT_TRUE(m.find(VOLTAGE, 0, &value));
+    EXPECT_FLOAT_EQ(3.3f, value);
+
+    /* Too big for 3 bytes, falls back to a float */
+    int len = m.getRawLength();
+    m.addFloatValue(TEMPERATURE, 1e6f);
+    EXPECT_EQ(len + 6, m.getRawLength());
+    ASSERT_TRUE(m.find(TEMPERATURE, 1, &value));
+    EXPECT_FLOAT_EQ(1e6f, value);
+
+    /* Plain float types are unaffected */
+    len = m.getRawLength();
+    m.addFloatValue(LENGTH, 0.5f);
+    EXPECT_EQ(len + 6, m.getRawLength());
+
+    Message::iter i = m.begin();
+    m.iterGetTypeValue(i, &t, &value);
+    EXPECT_EQ(TEMPERATURE, t);
+    EXPECT_FLOAT_EQ(-12.34f, value);
+    EXPECT_FLOAT_EQ(-12.34f, Message::toFloat(t, &value));
+
+    Message::CodingType coding;
+    Message::dataTypeToString(TEMPERATURE, &coding);
+    EXPECT_EQ(Message::fixedCoding, coding);
+}
+
+TEST(MessageTest, TypedAccessors) {
+    Message m(1, 2);
+    int id;
+    bool on;
+    float temp;
+    Data::Type dt;
+    Message::BinaryValue expr;
+    static const uint8_t bytes[] = { 6, 3, 3, 52, 0 };
+
+    m.add<SERVICE_ID>(7);
+    m.add<SWITCH>(true);
+    m.add<TEMPERATURE>(21.375f);
+    m.add<DATATYPE>(TEMPERATURE);
+    Message::BinaryValue val = { bytes, sizeof(bytes) };
+    m.add<EXPRESSION>(val);
+
+    ASSERT_TRUE(m.get<SERVICE_ID>(0, id));
+    EXPECT_EQ(7, id);
+    ASSERT_TRUE(m.get<SWITCH>(0, on));
+    EXPECT_TRUE(on);
+    ASSERT_TRUE(m.get<TEMPERATURE>(0, temp));
+    EXPECT_FLOAT_EQ(21.38f, temp);
+    ASSERT_TRUE(m.get<DATATYPE>(0, dt));
+    EXPECT_EQ(TEMPERATURE, dt);
+    ASSERT_TRUE(m.get<EXPRESSION>(0, expr));
+    EXPECT_EQ(sizeof(bytes), expr.len);
+    EXPECT_EQ(0, memcmp(bytes, expr.value, expr.len));
+
+    /* Same encoding as the runtime-typed API */
+    ASSERT_TRUE(m.find(TEMPERATURE, 0, &temp));
+    EXPECT_FLOAT_EQ(21.38f, temp);
+    EXPECT_FALSE(m.get<SERVICE_ID>(1, id));
+    EXPECT_FALSE(m.get<VOLTAGE>(0, temp));
+}
+
+TEST(MessageTest, NegativeValues) {
+    static const int ints[] = { -1, -128, -129, -32768, -70000, 70000 };
+    static const int32_t units[] = { -1, -128, -129, -32768, -8388608 };
+    Message m(1, 2);
+    int val;
+    int32_t u;
+    unsigned int k;
+
+    for (k = 0; k < sizeof(ints) / sizeof(*ints); k++)
+        m.addIntValue(COUNT, ints[k]);
+    for (k = 0; k < sizeof(units) / sizeof(*units); k++)
+        m.addFixedValue(TEMPERATURE, units[k]);
+
+    for (k = 0; k < sizeof(ints) / sizeof(*ints); k++) {
+        ASSERT_TRUE(m.get<COUNT>(k, val));
+        EXPECT_EQ(ints[k], val);
+        ASSERT_TRUE(m.find(COUNT, k, &val));
+        EXPECT_EQ(ints[k], val);
+    }
+
+    Message::iter i = m.begin();
+    for (k = 0; k < sizeof(ints) / sizeof(*ints); k++)
+        m.iterAdvance(i);
+    for (k = 0; k < sizeof(units) / sizeof(*units); k++, m.iterAdvance(i)) {
+        ASSERT_TRUE(m.iterGetFixedValue(i, &u));
+        EXPECT_EQ(units[k], u);
+    }
+}
+
+TEST(MessageTest, LongFormLength) {
+    /* The same EXPRESSION with a long form length, then a SERVICE_ID */
+    static const uint8_t raw[] = {
+        1, 0, Message::PUBLISH, 1,
+        EXPRESSION, 0x81, 3, 6, 3, 3,
+        SERVICE_ID, 1, 5,
+    };
+    MessageView v(raw, sizeof(raw));
+    Message::BinaryValue expr;
+    int id, count = 0;
+
+    ASSERT_TRUE(v.find(EXPRESSION, 0, &expr));
+    EXPECT_EQ(3, expr.len);
+    EXPECT_EQ(raw + 7, expr.value);
+    ASSERT_TRUE(v.find(SERVICE_ID, 0, &id));
+    EXPECT_EQ(5, id);
+
+    for (Message::iter i = v.begin(); i; v.iterAdvance(i))
+        count++;
+    EXPECT_EQ(2, count);
+
+    /* The indefinite form is not supported */
+    static const uint8_t bad[] = { 1, 0, Message::PUBLISH, 1,
+        EXPRESSION, 0x80, 6, 0, 0 };
+    MessageView b(bad, sizeof(bad));
+    EXPECT_FALSE(b.find(EXPRESSION, 0, &expr));
+
+    /* A length past the end stops the walk, even one that would wrap an
+     * 8-bit position back into the header.
+     */
+    static const uint8_t over[] = { 1, 0, Message::PUBLISH, 1,
+        EXPRESSION, 0x82, 0, 0xfd, SERVICE_ID, 1, 5 };
+    MessageView o(over, sizeof(over));
+    EXPECT_FALSE(o.find(SERVICE_ID, 0, &id));
+    count = 0;
+    for (Message::iter i = o.begin(); i; o.iterAdvance(i))
+        count++;
+    EXPECT_EQ(1, count);
+
+#if PAYLOAD_LENGTH >= 300
+    /* Build with -DPAYLOAD_LENGTH=1020 to check big values */
+    static uint8_t big[300];
+    Message m(1, 0);
+
+    memset(big, 0x55, sizeof(big));
+    m.addBinaryValue(MESSAGE, big, 200);
+    m.addBinaryValue(EXPRESSION, big, sizeof(big));
+    m.addIntValue(SERVICE_ID, 7);
+    EXPECT_EQ(HEADERS_LENGTH + 3 + 200 + 4 + 300 + 3, m.getRawLength());
+    ASSERT_TRUE(m.find(EXPRESSION, 0, &expr));
+    EXPECT_EQ(sizeof(big), expr.len);
+    ASSERT_TRUE(m.find(SERVICE_ID, 0, &id));
+    EXPECT_EQ(7, id);
+#endif
+}
+
+TEST(MessageTest, TruncatedValue) {
+    /* The SERVICE_ID claims two bytes but the frame ends after one */
+    static const uint8_t frame[] = { 1, 0, Message::PUBLISH, 1,
+        SERVICE_ID, 2, 5 };
+    MessageView v(frame, sizeof(frame));
+    int id;
+
+    EXPECT_FALSE(v.find(SERVICE_ID, 0, &id));
+    EXPECT_FALSE(v.get<SERVICE_ID>(0, id));
+}
+
+TEST(MessageTest, NestedBinaryValue) {
+    Message m(1, 2);
+    Message::BinaryValue sub;
+    int id;
+
+    m.addIntValue(SERVICE_ID, 1);
+    msglen_t start = m.beginBinaryValue(MESSAGE);
+    m.addIntValue(SERVICE_ID, 2);
+    m.addBoolValue(SWITCH, 1);
+    m.endBinaryValue(start);
+    m.addIntValue(COUNT, 3);
+
+    ASSERT_TRUE(m.find(MESSAGE, 0, &sub));
+    EXPECT_EQ(6, sub.len);
+    EXPECT_FALSE(m.find(SERVICE_ID, 1, &id));
+    ASSERT_TRUE(m.find(COUNT, 0, &id));
+    EXPECT_EQ(3, id);
+
+    MessageView v(m, sub);
+    ASSERT_TRUE(v.find(SERVICE_ID, 0, &id));
+    EXPECT_EQ(2, id);
+    EXPECT_FALSE(v.find(COUNT, 0, &id));
+    EXPECT_EQ(m.getId(), v.getId());
+
+    /* The nested view's iteration ends with the nested payload */
+    int count = 0;
+    for (Message::iter i = v.begin(); i; v.iterAdvance(i))
+        count++;
+    EXPECT_EQ(2, count);
+}
 
+TEST(MessageTest, Index) {
+    Message m(1, 2);
+    Data::Type dt;
+    int id;
+    bool b;
 
-SerialSimulator Serial;
+    /* Enough types for collisions in the index' hash */
+    m.addIntValue(SERVICE_ID, 7);
+    for (int i = 0; i < 3; i++) {
+        m.addIntValue(COUNT, i);
+        m.addBoolValue(SWITCH, i & 1);
+        m.addIntValue(DATATYPE, 20 + i);
+    }
+
+    /* The first lookup scans, the later ones use the index */
+    for (int pass = 0; pass < 3; pass++) {
+        ASSERT_TRUE(m.find(SERVICE_ID, 0, &id));
+        EXPECT_EQ(7, id);
+        for (int i = 0; i < 3; i++) {
+            ASSERT_TRUE(m.find(COUNT, i, &id));
+            EXPECT_EQ(i, id);
+            ASSERT_TRUE(m.find(SWITCH, i, &b));
+            EXPECT_EQ(i & 1, b);
+            ASSERT_TRUE(m.get<DATATYPE>(i, dt));
+            EXPECT_EQ(20 + i, dt);
+        }
+        EXPECT_FALSE(m.find(COUNT, 3, &id));
+        EXPECT_FALSE(m.find(COUNT, -1, &id));
+        EXPECT_FALSE(m.find(TEMPERATURE, 0, &id));
+    }
+
+    /* Adding drops the index */
+    m.addIntValue(COUNT, 3);
+    EXPECT_TRUE(m.find(COUNT, 3, &id));
+    EXPECT_TRUE(m.find(COUNT, 3, &id));
+    EXPECT_EQ(3, id);
+
+    /* So does looking at the same object through a new view */
+    Message copy(m.getRawData(), m.getRawLength() - 3);
+    EXPECT_FALSE(copy.find(COUNT, 3, &id));
+    EXPECT_FALSE(copy.find(COUNT, 3, &id));
+    copy = m;
+    EXPECT_TRUE(copy.find(COUNT, 3, &id));
+
+    /* More TLVs than the index holds are scanned */
+    Message big(1, 2);
+    for (int i = 0; i < MESSAGE_INDEX_SIZE + 4; i++)
+        big.addBoolValue(i & 1 ? SWITCH : PRESENCE, 1);
+    for (int pass = 0; pass < 2; pass++) {
+        EXPECT_TRUE(big.find(SWITCH, MESSAGE_INDEX_SIZE / 2 + 1, &b));
+        EXPECT_FALSE(big.find(SWITCH, MESSAGE_INDEX_SIZE / 2 + 2, &b));
+    }
+}
+
+static void buildReading(Message &m, float temp, float humidity) {
+    m.setType(Message::PUBLISH);
+    m.addIntValue(SERVICE_ID, 30);
+    m.addFloatValue(TEMPERATURE, temp);
+    m.addFloatValue(RELATIVE_HUMIDITY, humidity);
+    m.addBoolValue(PRESENCE, 1);
+}
+
+TEST(MessageTest, DeltaCoding) {
+    DeltaEncoder enc(2);
+    DeltaCache cache;
+    DeltaValues abs;
+    int ref;
+
+    /* First one is a keyframe */
+    Message m1(10, 0);
+    buildReading(m1, 21.5f, 40.0f);
+    Message w1(m1.getRawData(), HEADERS_LENGTH);
+    enc.encode(m1, w1);
+    ASSERT_TRUE(w1.find(DELTA_REF, 0, &ref));
+    EXPECT_EQ(DELTA_KEYFRAME, ref);
+    enc.sent(w1.getId(), 1);
+    EXPECT_EQ(1, cache.resolve(w1, w1.begin(), 0, abs));
+    EXPECT_EQ(2, abs.count);
+    EXPECT_EQ(2150, abs.units[0]);
+
+    /* Then deltas against the last acked one */
+    Message m2(10, 0);
+    buildReading(m2, 21.75f, 40.0f);
+    Message w2(m2.getRawData(), HEADERS_LENGTH);
+    enc.encode(m2, w2);
+    ASSERT_TRUE(w2.find(DELTA_REF, 0, &ref));
+    EXPECT_EQ(w1.getId(), ref);
+    EXPECT_LT(w2.getRawLength(), w1.getRawLength());
+    bool presence = 0;
+    EXPECT_TRUE(w2.find(PRESENCE, 0, &presence));
+    EXPECT_TRUE(presence);
+
+    /* ACK lost, the Base still has the frame */
+    enc.sent(w2.getId(), 0);
+    EXPECT_EQ(1, cache.resolve(w2, w2.begin(), 0, abs));
+    EXPECT_EQ(2175, abs.units[0]);
+    EXPECT_EQ(4000, abs.units[1]);
+
+    Message m3(10, 0);
+    buildReading(m3, 22.0f, 41.0f);
+    Message w3(m3.getRawData(), HEADERS_LENGTH);
+    enc.encode(m3, w3);
+    ASSERT_TRUE(w3.find(DELTA_REF, 0, &ref));
+    EXPECT_EQ(w1.getId(), ref);
+    enc.sent(w3.getId(), 1);
+    EXPECT_EQ(1, cache.resolve(w3, w3.begin(), 0, abs));
+    EXPECT_EQ(2200, abs.units[0]);
+    EXPECT_EQ(4100, abs.units[1]);
+
+    /* Keyframe after @keyframeInterval deltas */
+    Message m4(10, 0);
+    buildReading(m4, 22.0f, 41.0f);
+    Message w4(m4.getRawData(), HEADERS_LENGTH);
+    enc.encode(m4, w4);
+    ASSERT_TRUE(w4.find(DELTA_REF, 0, &ref));
+    EXPECT_EQ(DELTA_KEYFRAME, ref);
+    enc.sent(w4.getId(), 1);
+
+    /* A Base that never saw the reference asks for a resync */
+    Message m5(10, 0);
+    buildReading(m5, 22.5f, 41.0f);
+    Message w5(m5.getRawData(), HEADERS_LENGTH);
+    enc.encode(m5, w5);
+    DeltaCache fresh;
+    EXPECT_EQ(-1, fresh.resolve(w5, w5.begin(), 0, abs));
+
+    /* Plain messages are not delta coded */
+    EXPECT_EQ(0, cache.resolve(m5, m5.begin(), 0, abs));
+}
 
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
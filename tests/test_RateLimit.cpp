@@ -0,0 +1,84 @@
+#include <stdint.h>
+
+#include <RateLimit.h>
+#include <gmock/gmock.h>
+
+TEST(RateLimitTest, Bucket) {
+    RateLimit r;
+    int i;
+
+    /* A burst, then one per interval */
+    for (i = 0; i < RATE_LIMIT_BURST; i++)
+        EXPECT_TRUE(r.allow(5, 100));
+    EXPECT_FALSE(r.allow(5, 100));
+    EXPECT_FALSE(r.allow(5, 100 + RATE_LIMIT_INTERVAL_MS - 1));
+    EXPECT_TRUE(r.allow(5, 100 + RATE_LIMIT_INTERVAL_MS));
+    EXPECT_FALSE(r.allow(5, 100 + RATE_LIMIT_INTERVAL_MS));
+
+    /* Other nodes have their own buckets */
+    EXPECT_TRUE(r.allow(6, 100));
+
+    /* Refilled up to the burst size, times wrap around */
+    for (i = 0; i < RATE_LIMIT_BURST; i++)
+        EXPECT_TRUE(r.allow(5, 0xfff0));
+    EXPECT_FALSE(r.allow(5, 0xfff0));
+}
+
+TEST(RateLimitTest, Report) {
+    RateLimit r;
+    uint8_t node;
+    uint16_t count;
+    int i;
+
+    for (i = 0; i < RATE_LIMIT_BURST + 3; i++)
+        r.allow(5, 1000);
+    for (i = 0; i < RATE_LIMIT_BURST + 1; i++)
+        r.allow(6, 1000);
+    r.allow(7, 1000);
+
+    /* Once per period, only the nodes that had drops */
+    EXPECT_FALSE(r.report(RATE_LIMIT_REPORT_MS - 1, &node, &count));
+    ASSERT_TRUE(r.report(RATE_LIMIT_REPORT_MS, &node, &count));
+    EXPECT_EQ(5, node);
+    EXPECT_EQ(3, count);
+    ASSERT_TRUE(r.report(RATE_LIMIT_REPORT_MS, &node, &count));
+    EXPECT_EQ(6, node);
+    EXPECT_EQ(1, count);
+    EXPECT_FALSE(r.report(RATE_LIMIT_REPORT_MS, &node, &count));
+
+    r.allow(6, 1000);
+    EXPECT_FALSE(r.report(2 * RATE_LIMIT_REPORT_MS - 1, &node, &count));
+    ASSERT_TRUE(r.report(2 * RATE_LIMIT_REPORT_MS, &node, &count));
+    EXPECT_EQ(6, node);
+    EXPECT_EQ(1, count);
+    EXPECT_FALSE(r.report(2 * RATE_LIMIT_REPORT_MS, &node, &count));
+}
+
+TEST(RateLimitTest, Evict) {
+    RateLimit r;
+    int i;
+
+    /* Node 1 has been flooding, the quietest node 2 makes room for a new
+     * one.  Node 1 keeps its empty bucket.
+     */
+    for (i = 0; i < RATE_LIMIT_BURST + 1; i++)
+        r.allow(1, 0);
+    r.allow(2, 0);
+    for (i = 3; i <= RATE_LIMIT_NODES; i++) {
+        r.allow(i, 0);
+        r.allow(i, 0);
+    }
+    EXPECT_TRUE(r.allow(RATE_LIMIT_NODES + 1, 0));
+    EXPECT_FALSE(r.allow(1, 0));
+
+    /* Node 2 is back with a full bucket, at the expense of node 3 */
+    for (i = 0; i < RATE_LIMIT_BURST; i++)
+        EXPECT_TRUE(r.allow(2, 0));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,129 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include <ValueCache.h>
+#include "../Sensorino/Sensorino.h"
+#include <gmock/gmock.h>
+
+using namespace Data;
+
+/* Message.cpp references these, provide minimal stand-ins like Base does */
+void Sensorino::die(const prog_char *err) {
+    fprintf(stderr, "Panic because: %s\n", err);
+    exit(2);
+}
+
+bool Sensorino::sendMessage(Message &m) {
+    return 0;
+}
+
+Sensorino *sensorino;
+
+class StringPrint : public Print {
+public:
+    size_t write(uint8_t chr) {
+        str += (char) chr;
+        return 1;
+    }
+    using Print::write;
+
+    std::string str;
+};
+
+static void publish(ValueCache &cache, Message &m) {
+    MessageView view(m.getRawData(), m.getRawLength());
+
+    cache.update(view, view.begin(), false, NULL);
+}
+
+static bool request(ValueCache &cache, StringPrint &out, uint8_t node,
+        int service, Type t = (Type) -1) {
+    Message req(0, node);
+
+    req.setType(Message::REQUEST);
+    req.addIntValue(SERVICE_ID, service);
+    if (t != (Type) -1)
+        req.addDataTypeValue(t);
+    return cache.answer(out, req, false);
+}
+
+TEST(ValueCacheTest, Answer) {
+    ValueCache cache;
+    StringPrint out;
+    Message m(6, 0);
+
+    m.setType(Message::PUBLISH);
+    m.addIntValue(SERVICE_ID, 3);
+    m.addFloatValue(TEMPERATURE, 21.5);
+    m.addFloatValue(TEMPERATURE, 22.5);
+    m.addBoolValue(SWITCH, true);
+    publish(cache, m);
+
+    /* Everything the service published, in the order first seen */
+    ASSERT_TRUE(request(cache, out, 6, 3));
+    EXPECT_EQ(0u, out.str.find("{\"type\":\"publish\",\"from\":6,"
+                "\"serviceId\":3,\"temperature\":[21.5,22.5],"
+                "\"switch\":true,\"age\":")) << out.str;
+
+    /* Only the type asked for */
+    out.str.clear();
+    ASSERT_TRUE(request(cache, out, 6, 3, SWITCH));
+    EXPECT_EQ(0u, out.str.find("{\"type\":\"publish\",\"from\":6,"
+                "\"serviceId\":3,\"switch\":true,\"age\":")) << out.str;
+
+    /* Anything unknown goes over the radio */
+    out.str.clear();
+    EXPECT_FALSE(request(cache, out, 6, 3, RELATIVE_HUMIDITY));
+    EXPECT_FALSE(request(cache, out, 6, 4));
+    EXPECT_FALSE(request(cache, out, 7, 3));
+    EXPECT_EQ("", out.str);
+}
+
+TEST(ValueCacheTest, Update) {
+    ValueCache cache;
+    StringPrint out;
+    Message m1(6, 0), m2(6, 0);
+
+    m1.setType(Message::PUBLISH);
+    m1.addIntValue(SERVICE_ID, 3);
+    m1.addIntValue(COUNT, 1);
+    publish(cache, m1);
+
+    m2.setType(Message::PUBLISH);
+    m2.addIntValue(SERVICE_ID, 3);
+    m2.addIntValue(COUNT, 2);
+    publish(cache, m2);
+
+    ASSERT_TRUE(request(cache, out, 6, 3, COUNT));
+    EXPECT_EQ(0u, out.str.find("{\"type\":\"publish\",\"from\":6,"
+                "\"serviceId\":3,\"count\":2,")) << out.str;
+}
+
+TEST(ValueCacheTest, Evict) {
+    ValueCache cache;
+    StringPrint out;
+    int n;
+
+    /* One more value than fits, the first one to be updated goes */
+    for (n = 0; n <= VALUE_CACHE_SIZE; n++) {
+        Message m(1 + n / 128, 0);
+
+        m.setType(Message::PUBLISH);
+        m.addIntValue(SERVICE_ID, n % 128);
+        m.addIntValue(COUNT, n);
+        publish(cache, m);
+    }
+
+    n = VALUE_CACHE_SIZE;
+    EXPECT_FALSE(request(cache, out, 1, 0));
+    EXPECT_TRUE(request(cache, out, 1, 1));
+    EXPECT_TRUE(request(cache, out, 1 + n / 128, n % 128));
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set sw=4 ts=4 et: */
@@ -0,0 +1,92 @@
+#include <stdint.h>
+
+#include <WorkQueue.h>
+#include <gmock/gmock.h>
+
+static char ran[64];
+static int ranLen;
+
+static void record(void *arg) {
+    ran[ranLen++] = (char) (intptr_t) arg;
+    ran[ranLen] = '\0';
+}
+
+static void reschedule(void *arg) {
+    record(arg);
+    /* Once more, and something else that has to wait for its turn */
+    if (arg == (void *) 'a') {
+        WorkQueue::schedule(reschedule, (void *) 'b');
+        WorkQueue::schedule(record, (void *) 'c');
+    }
+}
+
+static void nested(void *arg) {
+    record(arg);
+    WorkQueue::schedule(record, (void *) 'y');
+    WorkQueue::run();
+    record((void *) 'z');
+}
+
+TEST(WorkQueueTest, Order) {
+    ranLen = 0;
+
+    EXPECT_FALSE(WorkQueue::pending());
+    EXPECT_TRUE(WorkQueue::schedule(record, (void *) '1'));
+    EXPECT_TRUE(WorkQueue::schedule(record, (void *) '2'));
+    EXPECT_TRUE(WorkQueue::schedule(reschedule, (void *) 'a'));
+    EXPECT_TRUE(WorkQueue::schedule(record, (void *) '3'));
+    EXPECT_TRUE(WorkQueue::pending());
+
+    WorkQueue::run();
+    EXPECT_STREQ("12a3bc", ran);
+    EXPECT_FALSE(WorkQueue::pending());
+}
+
+TEST(WorkQueueTest, Duplicates) {
+    ranLen = 0;
+
+    /* Only the same function with the same argument is a duplicate */
+    EXPECT_TRUE(WorkQueue::schedule(record, (void *) '1'));
+    EXPECT_TRUE(WorkQueue::schedule(record, (void *) '2'));
+    EXPECT_TRUE(WorkQueue::schedule(record, (void *) '1'));
+    EXPECT_TRUE(WorkQueue::schedule(reschedule, (void *) '1'));
+
+    WorkQueue::run();
+    EXPECT_STREQ("121", ran);
+}
+
+TEST(WorkQueueTest, Full) {
+    uint16_t drops = WorkQueue::dropped();
+    int i;
+
+    ranLen = 0;
+
+    for (i = 0; i < WORK_QUEUE_LEN; i++)
+        EXPECT_TRUE(WorkQueue::schedule(record,
+                    (void *) (intptr_t) ('a' + i)));
+    EXPECT_FALSE(WorkQueue::schedule(record, (void *) 'z'));
+    EXPECT_EQ(drops + 1, WorkQueue::dropped());
+    /* Already waiting, so no room needed */
+    EXPECT_TRUE(WorkQueue::schedule(record, (void *) 'a'));
+    EXPECT_EQ(drops + 1, WorkQueue::dropped());
+
+    WorkQueue::run();
+    EXPECT_EQ(WORK_QUEUE_LEN, ranLen);
+    EXPECT_EQ('a' + WORK_QUEUE_LEN - 1, ran[WORK_QUEUE_LEN - 1]);
+}
+
+TEST(WorkQueueTest, NoNesting) {
+    ranLen = 0;
+
+    /* Items never run inside other items */
+    EXPECT_TRUE(WorkQueue::schedule(nested, (void *) 'x'));
+    WorkQueue::run();
+    EXPECT_STREQ("xzy", ran);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set sw=4 ts=4 et: */
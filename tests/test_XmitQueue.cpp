@@ -0,0 +1,131 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <XmitQueue.h>
+#include "../Sensorino/Sensorino.h"
+#include <gmock/gmock.h>
+
+/* Message.cpp references these, provide minimal stand-ins like Base does */
+void Sensorino::die(const prog_char *err) {
+    fprintf(stderr, "Panic because: %s\n", err);
+    exit(2);
+}
+
+bool Sensorino::sendMessage(Message &m) {
+    return 0;
+}
+
+Sensorino *sensorino;
+
+/* A message header for node @dst, @id tells the messages apart */
+#define MSG(dst, id) { 0, dst, 0, id }
+
+TEST(XmitQueueTest, Lanes) {
+    static const uint8_t a1[] = MSG(5, 1), a2[] = MSG(5, 2);
+    static const uint8_t b1[] = MSG(6, 1);
+    XmitQueue q;
+    XmitEntry *e;
+
+    ASSERT_TRUE(q.push(a1, sizeof(a1), 0));
+    ASSERT_TRUE(q.push(a2, sizeof(a2), 0));
+    ASSERT_TRUE(q.push(b1, sizeof(b1), 0));
+
+    /* The older message to 5 first, then 6 gets its turn */
+    e = q.pick(0);
+    ASSERT_TRUE(e);
+    EXPECT_EQ(5, e->dst);
+    EXPECT_EQ(1, e->raw[3]);
+    q.remove(e);
+
+    e = q.pick(0);
+    ASSERT_TRUE(e);
+    EXPECT_EQ(6, e->dst);
+    q.remove(e);
+
+    e = q.pick(0);
+    ASSERT_TRUE(e);
+    EXPECT_EQ(2, e->raw[3]);
+    q.remove(e);
+
+    EXPECT_EQ(NULL, q.pick(0));
+    EXPECT_TRUE(q.empty());
+}
+
+TEST(XmitQueueTest, LaneLimit) {
+    static const uint8_t a1[] = MSG(5, 1), b1[] = MSG(6, 1);
+    XmitQueue q;
+    XmitEntry *e;
+    int i;
+
+    /* A node that doesn't ack can fill its own lane only... */
+    for (i = 0; i < XMIT_LANE_MAX; i++)
+        ASSERT_TRUE(q.push(a1, sizeof(a1), 0));
+    EXPECT_EQ(NULL, q.push(a1, sizeof(a1), 0));
+
+    /* ...the other destinations still get through */
+    for (i = XMIT_LANE_MAX; i < XMIT_QUEUE_LEN && i < 2 * XMIT_LANE_MAX; i++)
+        ASSERT_TRUE(q.push(b1, sizeof(b1), 0));
+
+    e = q.pick(0);
+    ASSERT_TRUE(e);
+    EXPECT_EQ(5, e->dst);
+    q.backOff(e, 0);
+    e = q.pick(1);
+    ASSERT_TRUE(e);
+    EXPECT_EQ(6, e->dst);
+}
+
+TEST(XmitQueueTest, BackOff) {
+    static const uint8_t a1[] = MSG(5, 1), a2[] = MSG(5, 2);
+    static const uint8_t b1[] = MSG(6, 1);
+    XmitQueue q;
+    XmitEntry *e;
+
+    q.push(a1, sizeof(a1), 100);
+    q.push(a2, sizeof(a2), 100);
+    q.push(b1, sizeof(b1), 100);
+
+    /* A failed lane holds its later messages but not the other lanes */
+    e = q.pick(100);
+    ASSERT_EQ(5, e->dst);
+    q.backOff(e, 100);
+    e = q.pick(101);
+    ASSERT_TRUE(e);
+    EXPECT_EQ(6, e->dst);
+    q.remove(e);
+    EXPECT_EQ(NULL, q.pick(101));
+
+    /* Retried after XMIT_BACKOFF_MS, then twice that */
+    e = q.pick(100 + XMIT_BACKOFF_MS);
+    ASSERT_TRUE(e);
+    EXPECT_EQ(1, e->raw[3]);
+    q.backOff(e, 200);
+    EXPECT_EQ(NULL, q.pick(200 + 2 * XMIT_BACKOFF_MS - 1));
+    EXPECT_EQ(e, q.pick(200 + 2 * XMIT_BACKOFF_MS));
+}
+
+TEST(XmitQueueTest, Deadline) {
+    static const uint8_t a1[] = MSG(5, 1), b1[] = MSG(6, 1);
+    XmitQueue q;
+    XmitEntry *e;
+    uint16_t t0 = 0xff00;
+
+    /* Times wrap around */
+    q.push(a1, sizeof(a1), t0);
+    q.push(b1, sizeof(b1), t0 + 500);
+    EXPECT_EQ(NULL, q.expired(t0 + XMIT_DEADLINE_MS - 1));
+
+    e = q.expired(t0 + XMIT_DEADLINE_MS);
+    ASSERT_TRUE(e);
+    EXPECT_EQ(5, e->dst);
+    q.remove(e);
+    EXPECT_EQ(NULL, q.expired(t0 + XMIT_DEADLINE_MS));
+    EXPECT_FALSE(q.empty());
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set sw=4 ts=4 et: */